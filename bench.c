@@ -0,0 +1,321 @@
+/**
+ * @file
+ *
+ * @brief Time the number formatting in format.c and the send ring in ring.h on
+ * the board, against the code they replaced.
+ *
+ * Only built with "make WORDCLOCK_BENCH=1", which adds the BENCH command.
+ * The old formatting is copied from serial_send_int(), serial_send_hex_int()
+ * and print_time() as they were before format.c, less the sending, which
+ * hasn't changed.  The old send channel is copied from serial.c as it was
+ * before ring.h, as in tests/ring-bench.c, and each is timed moving a 20 byte
+ * line: a block copy in, then single bytes out as the transmit interrupt
+ * handler takes them.
+ *
+ * The commander runs one step per tick, see commanderBenchState(), so that the
+ * other active objects get their turn and their queues don't fill.  Each step
+ * calls one function 16 times between two BSP_stamp()s.  The slowest, the old
+ * code on 65535, should take about 18000 cycles or 5ms, well inside the 50ms
+ * tick.  Timer 1 counts every 256 cycles, so the difference times 16 is the
+ * cycles per call, to within 16 cycles.  That less the same loop calling an
+ * empty function is the figure shown.  Each is the best of four steps, to
+ * leave out the odd interrupt.  The host simulation doesn't run Timer 1 during
+ * an event, so there it shows 0.
+ */
+
+#ifdef WORDCLOCK_BENCH
+
+#include "bench.h"
+#include "format.h"
+#include "serial.h"
+#include "bsp.h"
+#include "ring.h"
+#include <avr/pgmspace.h>
+#include <string.h>
+
+
+/** The input for the function being timed.  Volatile, so that the calls
+    aren't folded into constants. */
+static volatile uint16_t number;
+static volatile uint8_t regs[3];
+
+static char out[16];
+
+
+/**
+ * @name The old code
+ * @{
+ */
+static void __attribute__((noinline)) old_uint(char *buf, unsigned int n)
+{
+	char *bufp;
+
+	bufp = buf + 9;
+	*bufp = '\0';
+	if (0 == n) {
+		bufp--;
+		*bufp = '0';
+	} else {
+		while (n) {
+			int nn = n % 10;
+			bufp--;
+			*bufp = (char)(nn + '0');
+			n /= 10;
+		}
+	}
+}
+
+
+static void __attribute__((noinline)) old_hex(char *buf, unsigned int x)
+{
+	static PROGMEM const char hexchars[] = "0123456789ABCDEF";
+	char *bufp;
+
+	bufp = buf + 9;
+	*bufp = '\0';
+	if (0 == x) {
+		bufp--;
+		*bufp = '0';
+	} else {
+		while (x) {
+			int xx = x & 0x0f;
+			char c = pgm_read_byte_near(&(hexchars[xx]));
+			bufp--;
+			*bufp = c;
+			x >>= 4;
+		}
+	}
+}
+
+
+static void __attribute__((noinline)) old_time(char *buf, const uint8_t *bytes)
+{
+	uint8_t hoursbyte;
+	uint8_t minutesbyte;
+	uint8_t secondsbyte;
+	uint8_t hours;
+	uint8_t minutes;
+	uint8_t seconds;
+	char *p;
+
+	secondsbyte = bytes[0];
+	minutesbyte = bytes[1];
+	hoursbyte = bytes[2];
+	if (hoursbyte & 0x40) {
+		/* 12 hour mode */
+		hours = (hoursbyte & 0x0f) + ((hoursbyte & 0x10) >> 4) * 10;
+	} else {
+		hours = (hoursbyte & 0x0f) + ((hoursbyte & 0x30) >> 4)* 10;
+	}
+	minutes = (minutesbyte & 0x0f) + ((minutesbyte & 0x70) >> 4) * 10;
+	seconds = (secondsbyte & 0x0f) + ((secondsbyte & 0x70) >> 4) * 10;
+
+	p = buf;
+	if (hours > 9)
+		*p++ = '0' + hours / 10;
+	*p++ = '0' + hours % 10;
+	*p++ = ':';
+	*p++ = '0' + minutes / 10;
+	*p++ = '0' + minutes % 10;
+	*p++ = ':';
+	*p++ = '0' + seconds / 10;
+	*p++ = '0' + seconds % 10;
+	if (hoursbyte & 0x40) {
+		strcpy_P(p, (hoursbyte & 0x20) ? PSTR(" PM") : PSTR(" AM"));
+	} else {
+		strcpy_P(p, PSTR(" (24)"));
+	}
+}
+
+
+#define LINE 20
+
+struct OldChannel {
+	char *buffer;
+	uint8_t size;
+	uint8_t head;
+	volatile uint8_t ready;
+	volatile uint8_t tail;
+};
+
+
+static uint8_t old_space(struct OldChannel *ch, uint8_t head)
+{
+	uint8_t tail = ch->tail;
+
+	if (head >= tail) {
+		return ch->size - 1 - (head - tail);
+	} else {
+		return tail - head - 1;
+	}
+}
+
+
+static uint8_t __attribute__((noinline))
+old_push_block(struct OldChannel *ch, const char *s, uint8_t n)
+{
+	uint8_t head = ch->head;
+	uint8_t space = old_space(ch, head);
+	uint8_t first;
+
+	if (n > space)
+		n = space;
+	first = ch->size - head;
+	if (first > n)
+		first = n;
+	memcpy(ch->buffer + head, s, first);
+	memcpy(ch->buffer, s + first, n - first);
+	head += n;
+	if (head >= ch->size)
+		head -= ch->size;
+	ch->head = head;
+	ch->ready = head;
+	return n;
+}
+
+
+static char __attribute__((noinline)) old_pop(struct OldChannel *ch)
+{
+	uint8_t tail = ch->tail;
+	char c = ch->buffer[tail];
+
+	tail++;
+	if (tail >= ch->size)
+		tail = 0;
+	ch->tail = tail;
+	return c;
+}
+/** @} */
+
+
+/** The line sent through each channel, the size of a typical reply. */
+static const char line[LINE] = "Processing: \"TIME\"\r\n";
+
+/** Where the popped bytes go, so that the pops aren't optimised away. */
+static volatile char sink;
+
+static char oldbuffer[128];
+static char ringbuffer[128];
+static struct OldChannel old = { oldbuffer, sizeof(oldbuffer), 0, 0, 0 };
+static struct Ring ring = RING_INIT(ringbuffer);
+
+
+static void call_none(void) { }
+static void call_old_uint(void) { old_uint(out, number); }
+static void call_new_uint(void) { format_uint(out, number); }
+static void call_old_hex(void) { old_hex(out, number); }
+static void call_new_hex(void) { format_hex(out, number); }
+static void call_old_time(void) { old_time(out, (const uint8_t *)regs); }
+static void call_new_time(void) { format_time(out, (const uint8_t *)regs); }
+
+static void call_old_line(void)
+{
+	uint8_t i;
+
+	old_push_block(&old, line, LINE);
+	for (i = 0; i < LINE; i++) {
+		sink = old_pop(&old);
+	}
+}
+
+static void call_new_line(void)
+{
+	uint8_t i;
+
+	ring_push_block(&ring, line, LINE);
+	for (i = 0; i < LINE; i++) {
+		sink = ring_pop(&ring);
+	}
+}
+
+
+/** One function to time, and its number input. */
+struct Bench {
+	void (*fn)(void);
+	uint16_t number;
+};
+
+/** The loop on its own first, then each old and new pair. */
+static const struct Bench Q_ROM benches[] = {
+	{ call_none,     0      },
+	{ call_old_uint, 65535  },
+	{ call_new_uint, 65535  },
+	{ call_old_uint, 42     },
+	{ call_new_uint, 42     },
+	{ call_old_hex,  0xbeef },
+	{ call_new_hex,  0xbeef },
+	{ call_old_time, 0      },
+	{ call_new_time, 0      },
+	{ call_old_line, 0      },
+	{ call_new_line, 0      },
+};
+
+#define N_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+/** The runs of each function, the best of which is taken. */
+#define BENCH_RUNS 4
+
+/** The calls in each run.  See the top of the file. */
+#define BENCH_CALLS 16
+
+/** The next step.  The function is step / BENCH_RUNS. */
+static uint8_t step;
+
+/** The fewest Timer 1 counts for BENCH_CALLS calls of each function. */
+static uint16_t best[N_BENCHES];
+
+
+void bench_start(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < N_BENCHES; i++) {
+		best[i] = 0xffff;
+	}
+	/* 12:59:59 PM */
+	regs[0] = 0x59;
+	regs[1] = 0x59;
+	regs[2] = 0x72;
+	step = 0;
+}
+
+
+/** The cycles per call of benches[@e i], less the loop. */
+static uint16_t cycles(uint8_t i)
+{
+	uint16_t t = best[i];
+
+	return t > best[0] ? (t - best[0]) * (256 / BENCH_CALLS) : 0;
+}
+
+
+uint8_t bench_step(void)
+{
+	struct Bench bench;
+	uint8_t i = step / BENCH_RUNS;
+	uint8_t n = BENCH_CALLS;
+	uint16_t t;
+
+	memcpy_P(&bench, &benches[i], sizeof(bench));
+	number = bench.number;
+	t = BSP_stamp();
+	do {
+		bench.fn();
+	} while (--n);
+	t = BSP_stamp() - t;
+	if (t < best[i]) {
+		best[i] = t;
+	}
+	if (++step < N_BENCHES * BENCH_RUNS) {
+		return 1;
+	}
+
+	SF("Cycles old/new: 65535 %u/%u 42 %u/%u hex %u/%u time %u/%u\r\n",
+	   cycles(1), cycles(2), cycles(3), cycles(4), cycles(5), cycles(6),
+	   cycles(7), cycles(8));
+	SF("Cycles old/new: %u byte line %u/%u\r\n", LINE, cycles(9),
+	   cycles(10));
+	return 0;
+}
+
+#endif
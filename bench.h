@@ -0,0 +1,23 @@
+#ifndef bench_h_INCLUDED
+#define bench_h_INCLUDED
+
+#include <stdint.h>
+
+/**
+ * @name Benchmarks on the board
+ *
+ * Only with WORDCLOCK_BENCH defined, see bench.c.
+ * @{
+ */
+/** Get ready for the first bench_step(). */
+void bench_start(void);
+/**
+ * Time one run of one function, well inside a tick.  After the last run, show
+ * the results.
+ *
+ * @return 1 if there are more steps, 0 after the last.
+ */
+uint8_t bench_step(void);
+/** @} */
+
+#endif
@@ -6,16 +6,18 @@
 #include <avr/wdt.h>
 
 
-Q_DEFINE_THIS_FILE;
+/** This file's number in binary trace IDs, see ST(). */
+#define TRACE_FILE 6
 
 
 static void start_tick_timer(void);
+static void start_stamp_timer(void);
 static void enable_rtc_sqw_interrupts(void);
 
 
 void QF_onStartup(void)
 {
-
+	serial_qf_started();
 }
 
 void QF_onIdle(void)
@@ -36,18 +38,33 @@ void BSP_watchdog(struct Wordclock *me)
 }
 
 
+/**
+ * Start Timer 1 counting at clk/8, so we can see how long the boot takes.
+ */
 void BSP_startmain(void)
 {
+	TCCR1A = 0;
+	TCCR1B = (1 << CS11);
+	TCNT1 = 0;
+}
 
+
+/**
+ * Microseconds since BSP_startmain(), up to 65535.
+ */
+uint16_t BSP_boot_us(void)
+{
+	uint32_t us;
+
+	/* clk/8 is 460800Hz, and 1e6/460800 == 625/288. */
+	us = ((uint32_t)TCNT1 * 625) / 288;
+	return us > 0xffff ? 0xffff : us;
 }
 
 
 void BSP_init(void)
 {
-	/* PORT A pin 1 used to flash a LED, as a test. */
-	DDRA |= (1 << 1);
-	PINA |= (1 << 1);
-
+	start_stamp_timer();
 	start_tick_timer();
 
 	enable_1hz_interrupts(0);
@@ -84,51 +101,14 @@ start_tick_timer(void)
 }
 
 
-void BSP_ledOn(void)
-{
-	ST("LED on\r\n");
-	PORTA |= (1 << 1);
-}
-
-
-void BSP_ledOff(void)
-{
-	ST("LED off\r\n");
-	PORTA &= ~ (1 << 1);
-}
-
-
-SIGNAL(TIMER0_COMP_vect)
-{
-	static volatile uint8_t counter = 0;
-
-	QF_tick();
-	counter++;
-	if (counter >= 17) {
-		fff(&wordclock);
-		QActive_postISR((QActive*)(&wordclock), WATCHDOG_SIGNAL, 0);
-		counter = 0;
-	}
-	fff(&wordclock);
-	QActive_postISR((QActive*)(&wordclock), TICK_20TH_SIGNAL, 0);
-}
-
-
-static uint8_t send_1hz_interrupts = 0;
-
-
-void enable_1hz_interrupts(uint8_t onoff)
-{
-	send_1hz_interrupts = onoff;
-}
-
-
-SIGNAL(INT2_vect)
+/**
+ * Start Timer 1 counting freely at clk/256, for BSP_stamp(), now that the
+ * boot timing is done.
+ */
+static void start_stamp_timer(void)
 {
-	if (send_1hz_interrupts) {
-		fff(&wordclock);
-		QActive_postISR((QActive*)(&wordclock), TICK_1S_SIGNAL, 0);
-	}
+	TCCR1A = 0;
+	TCCR1B = (1 << CS12);
 }
 
 
@@ -0,0 +1,132 @@
+/**
+ * @file
+ *
+ * @brief The parts of the board support that are the same on the board and
+ * in the host simulation.
+ *
+ * These are the timer and RTC interrupt handlers, and the functions that
+ * share their state.  bsp-avr.c and bsp-posix.c set up the hardware, real or
+ * simulated, and both use this, so the simulation runs the same handlers as
+ * the board.
+ */
+
+#include "bsp.h"
+#include "wordclock.h"
+#include "serial.h"
+#include "wordclock-signals.h"
+
+
+Q_DEFINE_THIS_FILE;
+
+
+/** Counts ticks, for trace timestamps. */
+static volatile uint16_t ticks = 0;
+
+
+/**
+ * The number of ticks since BSP_init(), wrapping at 65536.
+ */
+uint16_t BSP_ticks(void)
+{
+	uint16_t t;
+	uint8_t sreg;
+
+	sreg = SREG;
+	cli();
+	t = ticks;
+	SREG = sreg;
+	return t;
+}
+
+
+/**
+ * A high resolution timestamp, counting at BSP_STAMP_HZ.  Differences between
+ * stamps are good for up to 4.55 seconds.
+ *
+ * This is safe to call from interrupt handlers.
+ */
+uint16_t BSP_stamp(void)
+{
+	uint16_t t;
+	uint8_t sreg;
+
+	/* Interrupts off, as a handler reading any 16 bit timer register
+	   would upset the shared TEMP register. */
+	sreg = SREG;
+	cli();
+	t = TCNT1;
+	SREG = sreg;
+	return t;
+}
+
+
+static QActive *at_ao;
+static QSignal at_sig;
+static QParam at_par;
+
+
+/**
+ * Post a signal from the timer interrupt when BSP_stamp() reaches @e stamp.
+ *
+ * This is for things that must happen at a precise time, such as the write to
+ * the RTC after SYNC.  There is only one of these at a time, and a new one
+ * replaces the old.  @e stamp must be at least a millisecond in the future,
+ * or it will be 4.55 seconds late.
+ */
+void BSP_post_at(uint16_t stamp, QActive *ao, QSignal sig, QParam par)
+{
+	uint8_t sreg;
+
+	sreg = SREG;
+	cli();
+	at_ao = ao;
+	at_sig = sig;
+	at_par = par;
+	OCR1A = stamp;
+	TIFR = (1 << OCF1A);
+	TIMSK |= (1 << OCIE1A);
+	SREG = sreg;
+}
+
+
+SIGNAL(TIMER1_COMPA_vect)
+{
+	TIMSK &= ~(1 << OCIE1A);
+	fff(at_ao);
+	QActive_postISR(at_ao, at_sig, at_par);
+}
+
+
+SIGNAL(TIMER0_COMP_vect)
+{
+	static volatile uint8_t counter = 0;
+
+	QF_tick();
+	ticks ++;
+	counter++;
+	if (counter >= 17) {
+		fff(&wordclock);
+		QActive_postISR((QActive*)(&wordclock), WATCHDOG_SIGNAL, 0);
+		counter = 0;
+	}
+	fff(&wordclock);
+	QActive_postISR((QActive*)(&wordclock), TICK_20TH_SIGNAL, 0);
+}
+
+
+static uint8_t send_1hz_interrupts = 0;
+
+
+void enable_1hz_interrupts(uint8_t onoff)
+{
+	send_1hz_interrupts = onoff;
+}
+
+
+SIGNAL(INT2_vect)
+{
+	if (send_1hz_interrupts) {
+		fff(&wordclock);
+		QActive_postISR((QActive*)(&wordclock), TICK_1S_SIGNAL, 0);
+	}
+}
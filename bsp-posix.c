@@ -0,0 +1,771 @@
+/**
+ * @file
+ *
+ * @brief Board support for running the wordclock on a POSIX host.
+ *
+ * This replaces bsp-avr.c in the host build (make host).  The application
+ * code (wordclock, twi, commander, serial) is compiled unchanged against the
+ * stand-in AVR headers in posix/, and runs under the real QF-nano scheduler.
+ *
+ * The hardware is simulated here.  A SIGALRM every millisecond plays the part
+ * of the peripherals' clock, and each millisecond we:
+ *
+ * - shift bytes out of the USART to stdout, at the programmed baud rate;
+ *
+ * - shift bytes from stdin into the USART, at the same rate;
+ *
+ * - run the TWI, with a DS1307 on the bus;
+ *
+ * - generate the 20Hz tick that Timer 0 generates on the board;
+ *
+ * - once a second, advance the DS1307 and pulse its SQW output into INT2;
+ *
+ * - count down the watchdog.
+ *
+ * Interrupt handlers are called from the signal handler, and only while the I
+ * bit in the simulated SREG is set.  If the I bit is clear the work is left
+ * pending until sei() (see posix/avr/interrupt.h).  That matches the AVR,
+ * where QF-nano runs without interrupt nesting.  The TWI and Timer 1 keep
+ * running while interrupts are off, so that they can be polled before
+ * QF_run().
+ *
+ * If WORDCLOCK_HOST_SECONDS is set in the environment, we exit after that
+ * many simulated seconds.  That makes it possible to run the firmware from a
+ * script, with stdin redirected from a file of commands.
+ *
+ * If WORDCLOCK_HOST_IXON is set, the simulated host stops sending on XOFF and
+ * starts again on XON, and doesn't pass those to stdout, like a tty with
+ * "stty ixon".
+ *
+ * If WORDCLOCK_HOST_TWI_HANG is set to n, the DS1307 hangs in the nth TWI
+ * transaction, holding SDA low until the TWI is disabled.  That exercises the
+ * TWI deadline and bus recovery.
+ */
+
+#include "bsp.h"
+#include "wordclock.h"
+#include "serial.h"
+#include "wordclock-signals.h"
+#include "ds1307.h"
+#include "twi-status.h"
+#include "cpu-speed.h"
+
+#include <avr/wdt.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/** This file's number in binary trace IDs, see ST(). */
+#define TRACE_FILE 7
+
+
+/* The simulated registers.  SREG starts with interrupts off, as at reset. */
+volatile uint8_t SREG = 0;
+volatile uint8_t MCUCSR = (1 << PORF);
+volatile uint8_t GICR;
+volatile uint8_t PORTA, DDRA, PINA;
+volatile uint8_t PORTB, DDRB, PINB;
+volatile uint8_t PORTC, DDRC, PINC;
+volatile uint8_t PORTD, DDRD, PIND;
+volatile uint8_t TCCR0, OCR0, TIMSK, TIFR;
+volatile uint8_t TCCR1A, TCCR1B;
+volatile uint16_t TCNT1, OCR1A;
+volatile uint8_t TCCR2, TCNT2;
+volatile uint8_t UBRRH, UBRRL, UCSRA = (1 << UDRE), UCSRB, UCSRC;
+volatile uint16_t UDR;
+volatile uint8_t TWBR, TWSR = 0xf8, TWDR, TWAR;
+volatile uint16_t TWCR;
+
+volatile uint8_t posix_pending = 0;
+
+
+static void start_tick_timer(void);
+static void start_stamp_timer(void);
+static void enable_rtc_sqw_interrupts(void);
+
+static void posix_power_on(void) __attribute__((constructor));
+static void posix_sigalrm(int signum);
+static void posix_step(void);
+static void posix_step_usart(void);
+static void posix_step_twi(void);
+static void posix_step_timer1(void);
+static void posix_step_ds1307(void);
+static void posix_step_watchdog(void);
+
+static void ds1307_from_host_time(void);
+
+
+/** Milliseconds of simulated time, counted by the signal handler. */
+static volatile uint32_t elapsed_ms = 0;
+/** Milliseconds of simulated time that the peripherals have caught up to. */
+static uint32_t stepped_ms = 0;
+/** Exit after this many seconds, if non-zero. */
+static uint32_t run_seconds = 0;
+/** Hang in this TWI transaction, counting from one, if non-zero. */
+static uint32_t twi_hang = 0;
+/** Set if WORDCLOCK_HOST_IXON is, to act like a host with "stty ixon". */
+static uint8_t usart_ixon = 0;
+/** The millisecond within each second at which the DS1307 seconds change.
+    Writing the seconds register restarts the second, as on the real chip. */
+static uint16_t ds1307_phase = 0;
+
+
+static uint8_t tick_timer_running = 0;
+static uint8_t rtc_sqw_interrupts = 0;
+
+
+void QF_onStartup(void)
+{
+	serial_qf_started();
+}
+
+
+/**
+ * Wait for the next simulated interrupt.
+ *
+ * QF-nano calls this with interrupts off, and we must turn them on.  If a
+ * signal sneaks in between sei() and pause(), we sleep for at most one more
+ * millisecond.
+ */
+void QF_onIdle(void)
+{
+	sei();
+	pause();
+}
+
+
+void Q_onAssert(char const Q_ROM * const Q_ROM_VAR file, int line)
+{
+	char buf[80];
+	int n;
+
+	n = snprintf(buf, sizeof(buf), "\r\nASSERT %s %d%s%s\r\n", file, line,
+		     serial_assert_name ? " " : "",
+		     serial_assert_name ? serial_assert_name : "");
+	if (n > 0) {
+		write(STDERR_FILENO, buf, n);
+	}
+	_exit(EXIT_FAILURE);
+}
+
+
+void BSP_watchdog(struct Wordclock *me)
+{
+	wdt_reset();
+}
+
+
+/**
+ * Start Timer 1 counting at clk/8, so we can see how long the boot takes.
+ */
+void BSP_startmain(void)
+{
+	TCCR1A = 0;
+	TCCR1B = (1 << CS11);
+	TCNT1 = 0;
+}
+
+
+/**
+ * Microseconds since BSP_startmain(), up to 65535.
+ */
+uint16_t BSP_boot_us(void)
+{
+	uint32_t us;
+
+	/* clk/8 is 460800Hz, and 1e6/460800 == 625/288. */
+	us = ((uint32_t)TCNT1 * 625) / 288;
+	return us > 0xffff ? 0xffff : us;
+}
+
+
+void BSP_init(void)
+{
+	start_stamp_timer();
+	start_tick_timer();
+
+	enable_1hz_interrupts(0);
+	enable_rtc_sqw_interrupts();
+
+	sei();
+
+	wdt_enable(WDTO_2S);
+}
+
+
+static void start_tick_timer(void)
+{
+	tick_timer_running = 1;
+}
+
+
+/**
+ * Start Timer 1 counting freely at clk/256, for BSP_stamp(), now that the
+ * boot timing is done.
+ */
+static void start_stamp_timer(void)
+{
+	TCCR1A = 0;
+	TCCR1B = (1 << CS12);
+}
+
+
+static void enable_rtc_sqw_interrupts(void)
+{
+	cli();
+	GICR |= (1 << INT2);
+	rtc_sqw_interrupts = 1;
+	sei();
+}
+
+
+/* ---------------------------------------------------------------------- */
+/* The simulated hardware. */
+
+
+/**
+ * Called before main(), the way the hardware exists before the firmware
+ * starts.
+ */
+static void posix_power_on(void)
+{
+	struct sigaction sa;
+	struct itimerval itv;
+	const char *seconds;
+	int flags;
+
+	seconds = getenv("WORDCLOCK_HOST_SECONDS");
+	if (seconds) {
+		run_seconds = strtoul(seconds, 0, 10);
+	}
+	seconds = getenv("WORDCLOCK_HOST_TWI_HANG");
+	if (seconds) {
+		twi_hang = strtoul(seconds, 0, 10);
+	}
+	usart_ixon = (0 != getenv("WORDCLOCK_HOST_IXON"));
+
+	/* The TWI pull-ups. */
+	PINC = 0x03;
+
+	ds1307_from_host_time();
+
+	flags = fcntl(STDIN_FILENO, F_GETFL);
+	if (flags >= 0) {
+		fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = posix_sigalrm;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGALRM, &sa, 0);
+
+	itv.it_interval.tv_sec = 0;
+	itv.it_interval.tv_usec = 1000;
+	itv.it_value = itv.it_interval;
+	setitimer(ITIMER_REAL, &itv, 0);
+}
+
+
+static void posix_sigalrm(int signum)
+{
+	elapsed_ms ++;
+	posix_pending = 1;
+	if (SREG & (1 << SREG_I)) {
+		posix_run_pending();
+	} else {
+		/* Peripherals that can be polled with interrupts off. */
+		posix_step_twi();
+		posix_step_timer1();
+	}
+}
+
+
+/** Set while interrupt handlers may be called. */
+static uint8_t posix_in_interrupt = 0;
+
+
+/**
+ * Bring the peripherals up to the current simulated time.
+ *
+ * The I bit is cleared while we do this, in the same way that the AVR clears
+ * it on entry to an interrupt handler.
+ */
+void posix_run_pending(void)
+{
+	SREG &= ~(1 << SREG_I);
+	posix_in_interrupt = 1;
+	while (posix_pending) {
+		posix_pending = 0;
+		while (stepped_ms != elapsed_ms) {
+			stepped_ms ++;
+			posix_step();
+		}
+	}
+	posix_in_interrupt = 0;
+	SREG |= (1 << SREG_I);
+}
+
+
+static void posix_step(void)
+{
+	/* Before the TWI, so that a write to the seconds register puts the
+	   next second a whole second away. */
+	if (ds1307_phase == (stepped_ms % 1000)) {
+		posix_step_ds1307();
+	}
+	posix_step_usart();
+	posix_step_twi();
+	posix_step_timer1();
+	if (tick_timer_running && 0 == (stepped_ms % 50)) {
+		TIMER0_COMP_vect();
+	}
+	if (0 == (stepped_ms % 1000)) {
+		if (run_seconds && stepped_ms / 1000 >= run_seconds) {
+			_exit(EXIT_SUCCESS);
+		}
+	}
+	posix_step_watchdog();
+}
+
+
+/* ---------------------------------------------------------------------- */
+/* USART */
+
+
+/** Bits that the USART is able to move in the current millisecond. */
+static uint32_t usart_tx_bits = 0;
+static uint32_t usart_rx_bits = 0;
+static uint8_t usart_rx_eof = 0;
+/** Set while the simulated host has been stopped by XOFF. */
+static uint8_t usart_rx_stopped = 0;
+
+
+static uint32_t usart_baud(void)
+{
+	uint16_t ubrr = ((UBRRH & 0x0f) << 8) | UBRRL;
+
+	if (UCSRA & (1 << U2X)) {
+		return F_CPU / (8UL * (ubrr + 1));
+	} else {
+		return F_CPU / (16UL * (ubrr + 1));
+	}
+}
+
+
+/**
+ * Move as many bytes as the baud rate allows.  Each byte is ten bits on the
+ * wire (start, eight data, stop).
+ */
+static void posix_step_usart(void)
+{
+	uint32_t bits_per_ms = usart_baud() / 1000;
+	char out[64];
+	uint8_t nout = 0;
+	uint8_t c;
+
+	usart_tx_bits += bits_per_ms;
+	while ((UCSRB & (1 << TXEN)) && (UCSRB & (1 << UDRIE))
+	       && usart_tx_bits >= 10 && nout < sizeof(out)) {
+		UDR = 0x100;
+		USART_UDRE_vect();
+		if (UDR > 0xff) {
+			/* The handler had nothing to send. */
+			break;
+		}
+		usart_tx_bits -= 10;
+		if (usart_ixon && (0x13 == UDR || 0x11 == UDR)) {
+			/* XOFF or XON, which the host's tty driver acts on
+			   and doesn't pass on. */
+			usart_rx_stopped = (0x13 == UDR);
+			continue;
+		}
+		out[nout++] = (char) UDR;
+	}
+	if (nout) {
+		write(STDOUT_FILENO, out, nout);
+	}
+	if (! (UCSRB & (1 << UDRIE)) && usart_tx_bits > 10) {
+		/* An idle line doesn't save up bandwidth. */
+		usart_tx_bits = 10;
+	}
+
+	usart_rx_bits += bits_per_ms;
+	while ((UCSRB & (1 << RXEN)) && ! usart_rx_eof && ! usart_rx_stopped
+	       && usart_rx_bits >= 10) {
+		ssize_t n = read(STDIN_FILENO, &c, 1);
+		if (n == 0) {
+			usart_rx_eof = 1;
+			break;
+		} else if (n < 0) {
+			break;
+		}
+		usart_rx_bits -= 10;
+		UDR = c;
+		UCSRA |= (1 << RXC);
+		if (UCSRB & (1 << RXCIE)) {
+			USART_RXC_vect();
+		}
+		UCSRA &= ~(1 << RXC);
+	}
+	if (usart_rx_bits > 10) {
+		usart_rx_bits = 10;
+	}
+}
+
+
+/* ---------------------------------------------------------------------- */
+/* TWI */
+
+
+enum TWIBusPhase {
+	BUS_IDLE,		/**< No START sent, or STOP has been sent. */
+	BUS_ADDRESS,		/**< START sent, SLA+R/W is next. */
+	BUS_MT,			/**< Master transmitter, slave ACKed. */
+	BUS_MR,			/**< Master receiver, slave ACKed. */
+	BUS_NACKED,		/**< Nobody answered.  STOP is next. */
+	BUS_STUCK,		/**< The slave is holding SDA low. */
+};
+
+static enum TWIBusPhase bus_phase = BUS_IDLE;
+
+
+/** The DS1307 registers: seven of time, one of control, 56 of RAM. */
+static uint8_t ds1307_regs[64];
+static uint8_t ds1307_pointer = 0;
+/** Set after SLA+W, until the register pointer has been written. */
+static uint8_t ds1307_want_pointer = 0;
+
+
+/** Bit 8 of the simulated TWCR, set along with TWINT by the hardware. */
+#define TWINT_BY_HARDWARE 0x100
+
+
+/**
+ * Finish a TWI action: set the status and TWINT, and call the interrupt
+ * handler if it's enabled.
+ */
+static void twi_interrupt(uint8_t status)
+{
+	TWSR = status | (TWSR & 0x03);
+	TWCR |= (1 << TWINT) | TWINT_BY_HARDWARE;
+	if ((TWCR & (1 << TWIE)) && posix_in_interrupt) {
+		TWI_vect();
+	}
+}
+
+
+/**
+ * Perform whatever the firmware asked the TWI to do.
+ *
+ * On the AVR, TWINT is set by the hardware and cleared by writing a one to
+ * it.  Here, TWINT set without bit 8 means the firmware has written a one, and
+ * that is when the hardware starts its next action.  A byte at 100kbit/s takes
+ * about 90us, so we allow several actions per millisecond.
+ */
+static void posix_step_twi(void)
+{
+	uint16_t twcr;
+	uint8_t actions;
+
+	for (actions = 0; actions < 8; actions++) {
+		twcr = TWCR;
+		if (! (twcr & (1 << TWEN))) {
+			/* Near enough to the recovery clocks letting the
+			   slave go. */
+			bus_phase = BUS_IDLE;
+			PINC |= 0x03;
+			return;
+		}
+		if (BUS_STUCK == bus_phase) {
+			return;
+		}
+		if (twcr & TWINT_BY_HARDWARE) {
+			/* Waiting for the firmware.  An interrupt that was raised
+			   while interrupts were off is delivered now. */
+			if ((twcr & (1 << TWIE)) && posix_in_interrupt) {
+				TWI_vect();
+				continue;
+			}
+			return;
+		}
+		if (! (twcr & (1 << TWINT))) {
+			return;
+		}
+		TWCR = twcr & ~((1 << TWINT) | (1 << TWSTO));
+
+		if (twcr & (1 << TWSTO)) {
+			bus_phase = BUS_IDLE;
+			continue;
+		}
+		if (twcr & (1 << TWSTA)) {
+			static uint32_t transactions = 0;
+			uint8_t status = (BUS_IDLE == bus_phase)
+				? TWI_08_START_SENT
+				: TWI_10_REPEATED_START_SENT;
+			if (BUS_IDLE == bus_phase
+			    && ++transactions == twi_hang) {
+				bus_phase = BUS_STUCK;
+				PINC &= ~0x02;
+				return;
+			}
+			bus_phase = BUS_ADDRESS;
+			twi_interrupt(status);
+			continue;
+		}
+
+		switch (bus_phase) {
+		case BUS_IDLE:
+			return;
+		case BUS_ADDRESS:
+			if ((TWDR >> 1) != DS1307_ADDRESS) {
+				bus_phase = BUS_NACKED;
+				twi_interrupt((TWDR & 0b1)
+					      ? TWI_48_MR_SLA_R_TX_NACK_RX
+					      : TWI_20_MT_SLA_W_TX_NACK_RX);
+			} else if (TWDR & 0b1) {
+				bus_phase = BUS_MR;
+				twi_interrupt(TWI_40_MR_SLA_R_TX_ACK_RX);
+			} else {
+				bus_phase = BUS_MT;
+				ds1307_want_pointer = 1;
+				twi_interrupt(TWI_18_MT_SLA_W_TX_ACK_RX);
+			}
+			break;
+		case BUS_MT:
+			if (ds1307_want_pointer) {
+				ds1307_pointer = TWDR & 0x3f;
+				ds1307_want_pointer = 0;
+			} else {
+				ds1307_regs[ds1307_pointer] = TWDR;
+				if (0 == ds1307_pointer) {
+					ds1307_phase = stepped_ms % 1000;
+				}
+				ds1307_pointer = (ds1307_pointer + 1) & 0x3f;
+			}
+			twi_interrupt(TWI_28_MT_DATA_TX_ACK_RX);
+			break;
+		case BUS_MR:
+			TWDR = ds1307_regs[ds1307_pointer];
+			ds1307_pointer = (ds1307_pointer + 1) & 0x3f;
+			twi_interrupt((twcr & (1 << TWEA))
+				      ? TWI_50_MR_DATA_RX_ACK_TX
+				      : TWI_58_MR_DATA_RX_NACK_TX);
+			break;
+		case BUS_NACKED:
+		case BUS_STUCK:
+			return;
+		}
+	}
+}
+
+
+/* ---------------------------------------------------------------------- */
+/* Timer 1 */
+
+
+/**
+ * Count Timer 1 in normal mode, with the output compare A interrupt.  Only the
+ * clk/8 and clk/256 prescalers are simulated.
+ */
+static void posix_step_timer1(void)
+{
+	static uint16_t fraction = 0;
+	static uint8_t timer1_match = 0;
+	uint16_t before = TCNT1;
+	uint16_t n;
+
+	switch (TCCR1B & 0x07) {
+	case (1 << CS11):
+		n = (F_CPU / 8) / 1000;
+		break;
+	case (1 << CS12):
+		/* 14.4 counts each millisecond. */
+		fraction += (F_CPU / 256) % 1000;
+		n = (F_CPU / 256) / 1000 + fraction / 1000;
+		fraction %= 1000;
+		break;
+	default:
+		return;
+	}
+	TCNT1 += n;
+	/* TIFR isn't simulated, as the firmware clears a flag by writing a
+	   one, which a variable can't tell from setting it.  A match only
+	   counts while the interrupt is enabled. */
+	if ((uint16_t)(OCR1A - before - 1) < n && (TIMSK & (1 << OCIE1A))) {
+		timer1_match = 1;
+	}
+	if (timer1_match && posix_in_interrupt) {
+		timer1_match = 0;
+		TIMER1_COMPA_vect();
+	}
+}
+
+
+/* ---------------------------------------------------------------------- */
+/* DS1307 */
+
+
+static uint8_t bcd2bin(uint8_t bcd)
+{
+	return (bcd >> 4) * 10 + (bcd & 0x0f);
+}
+
+
+static uint8_t bin2bcd(uint8_t bin)
+{
+	return ((bin / 10) << 4) | (bin % 10);
+}
+
+
+/**
+ * Start the simulated DS1307 at the host's local time, in 12 hour mode, with
+ * the 1Hz square wave enabled.
+ */
+static void ds1307_from_host_time(void)
+{
+	time_t now;
+	struct tm tm;
+	uint8_t hour12;
+
+	now = time(0);
+	localtime_r(&now, &tm);
+	hour12 = tm.tm_hour % 12;
+	if (0 == hour12) {
+		hour12 = 12;
+	}
+	ds1307_regs[0] = bin2bcd(tm.tm_sec);
+	ds1307_regs[1] = bin2bcd(tm.tm_min);
+	ds1307_regs[2] = 0x40 | (tm.tm_hour >= 12 ? 0x20 : 0) | bin2bcd(hour12);
+	ds1307_regs[3] = tm.tm_wday + 1;
+	ds1307_regs[4] = bin2bcd(tm.tm_mday);
+	ds1307_regs[5] = bin2bcd(tm.tm_mon + 1);
+	ds1307_regs[6] = bin2bcd(tm.tm_year % 100);
+	ds1307_regs[7] = (1 << 4);
+}
+
+
+/**
+ * Advance the DS1307 by one second, and pulse SQW.
+ */
+static void posix_step_ds1307(void)
+{
+	static const uint8_t days[12] = {
+		31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	uint8_t *r = ds1307_regs;
+	uint8_t sec, min, hour, pm, date, month, year, mdays;
+	uint8_t newday = 0;
+
+	if (r[0] & 0x80) {
+		/* CH set, oscillator stopped. */
+		return;
+	}
+
+	sec = bcd2bin(r[0] & 0x7f) + 1;
+	min = bcd2bin(r[1] & 0x7f);
+	if (sec >= 60) {
+		sec = 0;
+		min ++;
+	}
+	r[0] = bin2bcd(sec);
+	if (min >= 60) {
+		min = 0;
+		if (r[2] & 0x40) {
+			hour = bcd2bin(r[2] & 0x1f) + 1;
+			pm = r[2] & 0x20;
+			if (12 == hour) {
+				pm ^= 0x20;
+				newday = ! pm;
+			} else if (13 == hour) {
+				hour = 1;
+			}
+			r[2] = 0x40 | pm | bin2bcd(hour);
+		} else {
+			hour = bcd2bin(r[2] & 0x3f) + 1;
+			if (24 == hour) {
+				hour = 0;
+				newday = 1;
+			}
+			r[2] = bin2bcd(hour);
+		}
+	}
+	r[1] = bin2bcd(min);
+
+	if (newday) {
+		r[3] = (r[3] % 7) + 1;
+		date = bcd2bin(r[4]) + 1;
+		month = bcd2bin(r[5]);
+		year = bcd2bin(r[6]);
+		mdays = days[(month - 1) % 12];
+		if (2 == month && 0 == (year % 4)) {
+			mdays = 29;
+		}
+		if (date > mdays) {
+			date = 1;
+			month ++;
+			if (month > 12) {
+				month = 1;
+				year = (year + 1) % 100;
+			}
+		}
+		r[4] = bin2bcd(date);
+		r[5] = bin2bcd(month);
+		r[6] = bin2bcd(year);
+	}
+
+	/* SQWE set and RS1:RS0 == 00 gives 1Hz.  The falling edge comes with
+	   the seconds update. */
+	if ((r[7] & (1 << 4)) && ! (r[7] & 0x03)
+	    && rtc_sqw_interrupts && (GICR & (1 << INT2))) {
+		INT2_vect();
+	}
+}
+
+
+/* ---------------------------------------------------------------------- */
+/* Watchdog */
+
+
+static uint16_t wdt_timeout_ms = 0;
+static uint16_t wdt_count_ms = 0;
+
+
+void posix_wdt_enable(uint8_t timeout)
+{
+	wdt_timeout_ms = 16 << timeout;
+	wdt_count_ms = 0;
+}
+
+
+void posix_wdt_disable(void)
+{
+	wdt_timeout_ms = 0;
+}
+
+
+void posix_wdt_reset(void)
+{
+	wdt_count_ms = 0;
+}
+
+
+static void posix_step_watchdog(void)
+{
+	static const char msg[] = "\r\nwatchdog reset\r\n";
+
+	if (! wdt_timeout_ms) {
+		return;
+	}
+	wdt_count_ms ++;
+	if (wdt_count_ms >= wdt_timeout_ms) {
+		write(STDERR_FILENO, msg, sizeof(msg) - 1);
+		_exit(EXIT_FAILURE);
+	}
+}
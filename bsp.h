@@ -40,10 +40,22 @@
 
 void BSP_watchdog(struct Wordclock *me);
 void BSP_startmain();		/* Code to put right at the start of main() */
+uint16_t BSP_boot_us(void);
+uint16_t BSP_ticks(void);
 void BSP_init(void);
 
-void BSP_ledOn();
-void BSP_ledOff();
+/**
+ * The rate of BSP_stamp(), which wraps every 4.55 seconds.  Timer 1 at
+ * clk/256.
+ */
+#define BSP_STAMP_HZ 14400U
+
+/** A difference between two BSP_stamp()s, in units of 0.1ms. */
+#define BSP_STAMP_TO_100US(n) \
+	((uint16_t)(((uint32_t)(n) * 10000) / BSP_STAMP_HZ))
+
+uint16_t BSP_stamp(void);
+void BSP_post_at(uint16_t stamp, QActive *ao, QSignal sig, QParam par);
 
 void enable_1hz_interrupts(uint8_t onoff);
 
@@ -3,17 +3,16 @@
  *
  * @brief Implement a command interpreter for the word clock.
  *
- * This is fairly simple.  It merely reads the the line and calls the
- * appropriate function for that line.  We currently sort of assume that the
- * line is a one word command.
+ * This is fairly simple.  It splits the line into words, looks the first
+ * word up in a table of commands, checks the rest against that command's
+ * argument schema, and calls the command's function with them.
  *
- * This is a QP-nano HSM, but only because that is an easy way to get character
- * events to it from an ISR (using QActive_postISR()).
+ * This is a QP-nano HSM, but only because that is an easy way to get line
+ * events to it from an ISR (using QActive_postISR()).  The serial receive
+ * interrupt handler assembles the lines, see struct SerialLine.
  *
- * @todo Actually separate the first word from the line, and call the
- * appropriate function for that word, allowing for command arguments.
- *
- * @todo Implement backspacing. (Or is that going too far?)
+ * @todo Implement backspacing. (Or is that going too far?)  It would have to be
+ * done in the serial receive interrupt handler.
  */
 
 
@@ -21,73 +20,253 @@
 #include "wordclock.h"
 #include "wordclock-signals.h"
 #include "serial.h"
+#include "bsp.h"
+#ifdef WORDCLOCK_BENCH
+#include "bench.h"
+#endif
 
 #include <avr/pgmspace.h>
+#include <string.h>
 
 
 Q_DEFINE_THIS_FILE;
 
+/** This file's number in binary trace IDs, see ST(). */
+#define TRACE_FILE 5
+
 
 struct Commander commander;
 
 
-static void add_to_buffer(struct Commander *me, char c);
-static void process_buffer(struct Commander *me);
-static void clear_buffer(struct Commander *me);
+static void process_line(char *line);
+static void process_packet(struct SerialLine *line);
+static void check_commands(void);
+static void show_snapshot(void);
 
 
 static QState commanderInitial(struct Commander *me);
 static QState commanderState(struct Commander *me);
+static QState commanderBaudState(struct Commander *me);
+static QState commanderBaudConfirmState(struct Commander *me);
+#ifdef WORDCLOCK_BENCH
+static QState commanderBenchState(struct Commander *me);
+#endif
+
+/** The most arguments a command can have. */
+#define COMMAND_MAX_ARGS 3
+
+/**
+ * A command's arguments, checked against its schema.
+ */
+struct CommandArgs {
+	/** The number of arguments. */
+	uint8_t n;
+	/** Each argument, as typed. */
+	char *word[COMMAND_MAX_ARGS];
+	/** The value of each 'u' or 'a' argument.  'a' is 0 for AM and 0x20
+	    for PM. */
+	uint16_t number[COMMAND_MAX_ARGS];
+	/** The value of a 't' argument, as the DS1307 seconds, minutes and
+	    hours registers without the flags. */
+	uint8_t time[3];
+};
 
-static void fn_TRON(const char *line);
-static void fn_TROFF(const char *line);
-static void fn_SET(const char *line);
-static void fn_GET(const char *line);
-static void fn_RESET(const char *line);
+/**
+ * Returned by a command whose reply comes later, from a signal handler, which
+ * also sends the status byte in binary command mode.
+ */
+#define COMMAND_PENDING 0
+
+/**
+ * @return COMMANDER_OK or COMMANDER_FAILED, see commander.h, or
+ * COMMAND_PENDING.
+ */
+typedef uint8_t (*command_fn)(struct CommandArgs *args);
 
-typedef void (*command_fn)(const char*);
+/** The longest command name, plus one. */
+#define COMMAND_NAME_MAX 7
+
+/**
+ * An entry in the command table.
+ *
+ * The schema has a character for each argument: 'w' for a word, 'u' for a
+ * number from 0 to 65535, 't' for a time (h:mm:ss), and 'a' for A, AM, P or
+ * PM.  Arguments after a '?' are optional.
+ *
+ * In a binary command packet the arguments are: for 'w', the bytes up to a
+ * null or the end of the packet; for 'u', two bytes, low byte first; for 't',
+ * the seconds, minutes and hours in BCD; for 'a', one byte, non-zero for PM.
+ */
+struct Command {
+	char name[COMMAND_NAME_MAX];
+	/** The opcode in binary command mode.  These must not change. */
+	uint8_t opcode;
+	command_fn fn;
+	char args[COMMAND_MAX_ARGS + 2];
+	/** Usage and description, in program memory. */
+	PGM_P help;
+};
+
+static uint8_t fn_BAUD(struct CommandArgs *args);
+#ifdef WORDCLOCK_BENCH
+static uint8_t fn_BENCH(struct CommandArgs *args);
+#endif
+static uint8_t fn_BINARY(struct CommandArgs *args);
+static uint8_t fn_FRAME(struct CommandArgs *args);
+static uint8_t fn_GET(struct CommandArgs *args);
+static uint8_t fn_HELP(struct CommandArgs *args);
+static uint8_t fn_QUIET(struct CommandArgs *args);
+static uint8_t fn_RESET(struct CommandArgs *args);
+static uint8_t fn_SET(struct CommandArgs *args);
+static uint8_t fn_STATS(struct CommandArgs *args);
+static uint8_t fn_SYNC(struct CommandArgs *args);
+static uint8_t fn_TROFF(struct CommandArgs *args);
+static uint8_t fn_TRON(struct CommandArgs *args);
+
+static PROGMEM const char h_BAUD[] =
+	"BAUD [rate] - show or change the baud rate";
+#ifdef WORDCLOCK_BENCH
+static PROGMEM const char h_BENCH[] =
+	"BENCH - time the number formatting and send ring, see bench.c";
+#endif
+static PROGMEM const char h_BINARY[] =
+	"BINARY [ON|OFF] - show or change binary command mode";
+static PROGMEM const char h_FRAME[] =
+	"FRAME [ON|OFF] - show or change framed mode";
+static PROGMEM const char h_GET[] =
+	"GET [FRESH] - show the time, FRESH to read the RTC first";
+static PROGMEM const char h_HELP[] =
+	"HELP [command] - list the commands, or show one";
+static PROGMEM const char h_QUIET[] =
+	"QUIET [ON|OFF] - show or change echoing of commands";
+static PROGMEM const char h_RESET[] = "RESET - reset via the watchdog";
+static PROGMEM const char h_SET[] = "SET h:mm:ss AM|PM - set the time";
+static PROGMEM const char h_STATS[] = "STATS - serial losses and errors";
+static PROGMEM const char h_SYNC[] =
+	"SYNC [h:mm:ss AM|PM frac] - time the line, or set the time exactly";
+static PROGMEM const char h_TROFF[] = "TROFF - turn tracing off";
+static PROGMEM const char h_TRON[] = "TRON - turn tracing on";
+
+/**
+ * The commands, in order of name (ignoring case) for find_command().
+ * commander_ctor() checks the order.
+ */
+static const struct Command Q_ROM commands[] = {
+	{ "BAUD",   0x01, fn_BAUD,   "?w",   h_BAUD   },
+#ifdef WORDCLOCK_BENCH
+	{ "BENCH",  0x0d, fn_BENCH,  "",     h_BENCH  },
+#endif
+	{ "BINARY", 0x0a, fn_BINARY, "?w",   h_BINARY },
+	{ "FRAME",  0x02, fn_FRAME,  "?w",   h_FRAME  },
+	{ "GET",    0x03, fn_GET,    "?w",   h_GET    },
+	{ "HELP",   0x04, fn_HELP,   "?w",   h_HELP   },
+	{ "QUIET",  0x0b, fn_QUIET,  "?w",   h_QUIET  },
+	{ "RESET",  0x05, fn_RESET,  "",     h_RESET  },
+	{ "SET",    0x06, fn_SET,    "ta",   h_SET    },
+	{ "STATS",  0x07, fn_STATS,  "",     h_STATS  },
+	{ "SYNC",   0x0c, fn_SYNC,   "?tau", h_SYNC   },
+	{ "TROFF",  0x08, fn_TROFF,  "",     h_TROFF  },
+	{ "TRON",   0x09, fn_TRON,   "",     h_TRON   },
+};
 
-static PROGMEM const char s_TROFF[] = "TROFF";
-static PROGMEM const char s_TRON[] = "TRON";
-static PROGMEM const char s_SET[] = "SET";
-static PROGMEM const char s_GET[] = "GET";
-static PROGMEM const char s_RESET[] = "RESET";
+#define N_COMMANDS ((uint8_t)(sizeof(commands) / sizeof(commands[0])))
 
 
 void commander_ctor(void)
 {
 	QActive_ctor((QActive*)(&commander), (QStateHandler)&commanderInitial);
+	commander.resetting = 0;
+	commander.baudChange = 0;
+	commander.quiet = 0;
+	commander.binary = 0;
+	commander.nheld = 0;
+	commander.freshWaiting = 0;
+	commander.syncWaiting = 0;
+	check_commands();
 }
 
 
 static QState commanderInitial(struct Commander *me)
 {
+	S("commander!\r\n");
 	return Q_TRAN(commanderState);
-	for (uint8_t i=0; i<COMMANDER_BUFLEN; i++) {
-		me->buf[i] = 0;
-	}
-	me->len - 0;
 }
 
 
 static QState commanderState(struct Commander *me)
 {
-	char c;
+	struct SerialLine *line;
 
 	switch (Q_SIG(me)) {
 
-	case Q_ENTRY_SIG:
-		S("commander!\r\n");
+	case LINE_SIGNAL:
+		line = (struct SerialLine *) Q_PAR(me);
+		me->lineStamp = line->stamp;
+		me->lineStamped = line->stamped;
+		if (me->binary) {
+			process_packet(line);
+		} else {
+			process_line(line->data);
+		}
+		if (me->baudChange) {
+			serial_line_done(line);
+			return Q_TRAN(commanderBaudState);
+		}
+		if (serial_send_space() < COMMANDER_REPLY_SPACE) {
+			/* Keep the line until the replies have gone, so that
+			   a sender going faster than our replies is held up
+			   by XOFF rather than the replies being lost. */
+			me->held[me->nheld++] = line;
+			serial_notify_drained((QActive*)me);
+		} else {
+			serial_line_done(line);
+		}
+#ifdef WORDCLOCK_BENCH
+		if (me->benching) {
+			return Q_TRAN(commanderBenchState);
+		}
+#endif
+		return Q_HANDLED();
+
+	case SERIAL_DRAINED_SIGNAL:
+		if (me->resetting) {
+			cli();
+			while (1)
+				;
+		}
+		while (me->nheld) {
+			serial_line_done(me->held[--me->nheld]);
+		}
+		return Q_HANDLED();
+
+	case SNAPSHOT_SIGNAL:
+		/* One read answers every GET FRESH that was waiting. */
+		while (me->freshWaiting) {
+			me->freshWaiting --;
+			if (Q_PAR(me)) {
+				S("RTC read failed\r\n");
+			} else {
+				show_snapshot();
+			}
+			if (me->binary) {
+				serial_send_byte(Q_PAR(me) ? COMMANDER_FAILED
+						 : COMMANDER_OK);
+			}
+		}
 		return Q_HANDLED();
 
-	case CHAR_SIGNAL:
-		c = (char) Q_PAR(me);
-		if ('\r' == c || '\n' == c || '\0' == c) {
-			process_buffer(me);
-		} else if ('\x1b' == c) {
-			clear_buffer(me);
+	case SYNCED_SIGNAL:
+		me->syncWaiting = 0;
+		if (WORDCLOCK_SYNC_FAILED == (uint16_t)Q_PAR(me)) {
+			S("Sync failed\r\n");
 		} else {
-			add_to_buffer(me, c);
+			SF("Synced %T late=%u\r\n", wordclock.time,
+			   (uint16_t)Q_PAR(me));
+		}
+		if (me->binary) {
+			serial_send_byte(WORDCLOCK_SYNC_FAILED
+					 == (uint16_t)Q_PAR(me)
+					 ? COMMANDER_FAILED : COMMANDER_OK);
 		}
 		return Q_HANDLED();
 	}
@@ -95,150 +274,834 @@ static QState commanderState(struct Commander *me)
 }
 
 
-static void add_to_buffer(struct Commander *me, char c)
+/**
+ * Wait for the output to go, then change the baud rate.
+ *
+ * Lines that arrive meanwhile are ignored.
+ */
+static QState commanderBaudState(struct Commander *me)
 {
-	Q_ASSERT( me->len < COMMANDER_BUFLEN );
-	if (me->len >= COMMANDER_BUFLEN) {
-		return;
+	switch (Q_SIG(me)) {
+
+	case Q_ENTRY_SIG:
+		/* SERIAL_DRAINED_SIGNAL is ours now, so commanderState won't
+		   release a line it held back.  BAUD ignores further lines
+		   anyway. */
+		while (me->nheld) {
+			serial_line_done(me->held[--me->nheld]);
+		}
+		serial_notify_drained((QActive*)me);
+		return Q_HANDLED();
+
+	case SERIAL_DRAINED_SIGNAL:
+		/* The last two bytes are still in the USART, for at most
+		   2ms at 9600 baud.  A timeout of one tick can end at the
+		   next tick, which may be almost at once, so wait for two:
+		   at least one whole tick, 50ms. */
+		QActive_arm((QActive*)me, 2);
+		return Q_HANDLED();
+
+	case Q_TIMEOUT_SIG:
+		serial_set_baud(me->baudNew);
+		return Q_TRAN(commanderBaudConfirmState);
+
+	case LINE_SIGNAL:
+		serial_line_done((struct SerialLine *) Q_PAR(me));
+		return Q_HANDLED();
+	}
+	return Q_SUPER(commanderState);
+}
+
+
+/**
+ * Keep the new baud rate if OK comes back at that rate in time, otherwise go
+ * back to the old rate.
+ */
+static QState commanderBaudConfirmState(struct Commander *me)
+{
+	struct SerialLine *line;
+
+	switch (Q_SIG(me)) {
+
+	case Q_ENTRY_SIG:
+		SF("Send OK within %u seconds to keep %S baud\r\n",
+		   COMMANDER_BAUD_CONFIRM_TICKS / 20,
+		   serial_baud_name(me->baudNew));
+		QActive_arm((QActive*)me, COMMANDER_BAUD_CONFIRM_TICKS);
+		return Q_HANDLED();
+
+	case LINE_SIGNAL:
+		line = (struct SerialLine *) Q_PAR(me);
+		if (strcasecmp_P(line->data, PSTR("OK"))) {
+			serial_line_done(line);
+			S("Send OK to confirm\r\n");
+			return Q_HANDLED();
+		}
+		serial_line_done(line);
+		QActive_disarm((QActive*)me);
+		serial_save_baud(me->baudNew);
+		SF("%S baud saved\r\n", serial_baud_name(me->baudNew));
+		return Q_TRAN(commanderState);
+
+	case Q_TIMEOUT_SIG:
+		/* Nobody is listening at this rate, so there's no need to
+		   wait for the output to go. */
+		serial_set_baud(me->baudOld);
+		SF("No OK, back to %S baud\r\n",
+		   serial_baud_name(me->baudOld));
+		return Q_TRAN(commanderState);
+
+	case Q_EXIT_SIG:
+		me->baudChange = 0;
+		return Q_HANDLED();
+	}
+	return Q_SUPER(commanderBaudState);
+}
+
+
+#ifdef WORDCLOCK_BENCH
+/**
+ * Run BENCH one step per tick, so that the other active objects aren't held
+ * up.  See bench.c.
+ *
+ * Lines that arrive meanwhile are refused.
+ */
+static QState commanderBenchState(struct Commander *me)
+{
+	switch (Q_SIG(me)) {
+
+	case Q_ENTRY_SIG:
+		bench_start();
+		QActive_arm((QActive*)me, 1);
+		return Q_HANDLED();
+
+	case Q_TIMEOUT_SIG:
+		if (bench_step()) {
+			QActive_arm((QActive*)me, 1);
+			return Q_HANDLED();
+		}
+		if (me->binary) {
+			serial_send_byte(COMMANDER_OK);
+		}
+		return Q_TRAN(commanderState);
+
+	case LINE_SIGNAL:
+		serial_line_done((struct SerialLine *) Q_PAR(me));
+		if (me->binary) {
+			serial_send_byte(COMMANDER_FAILED);
+		} else {
+			S("BENCH is running\r\n");
+		}
+		return Q_HANDLED();
+
+	case Q_EXIT_SIG:
+		me->benching = 0;
+		return Q_HANDLED();
 	}
-	me->buf[me->len++] = c;
-	if (me->len == COMMANDER_BUFLEN-1) {
-		process_buffer(me);
+	return Q_SUPER(commanderState);
+}
+#endif
+
+
+/**
+ * Split a line into words at spaces, in place, in one pass.
+ *
+ * @return the number of words, or -1 if there are more than @e max.
+ */
+static int8_t tokenize(char *line, char **words, uint8_t max)
+{
+	uint8_t n = 0;
+
+	while (1) {
+		while (' ' == *line) {
+			line++;
+		}
+		if ('\0' == *line) {
+			return n;
+		}
+		if (n == max) {
+			return -1;
+		}
+		words[n++] = line;
+		while (*line && ' ' != *line) {
+			line++;
+		}
+		if (*line) {
+			*line++ = '\0';
+		}
 	}
 }
 
 
-static void process_buffer(struct Commander *me)
+/**
+ * Parse a decimal number from 0 to 65535.
+ *
+ * @return 1, or 0 if @e word isn't one.
+ */
+static uint8_t parse_number(const char *word, uint16_t *number)
+{
+	uint16_t n = 0;
+	uint8_t d;
+
+	if ('\0' == *word) {
+		return 0;
+	}
+	for (; *word; word++) {
+		d = *word - '0';
+		if (d > 9 || n > 6553 || (6553 == n && d > 5)) {
+			return 0;
+		}
+		n = n * 10 + d;
+	}
+	*number = n;
+	return 1;
+}
+
+
+/** Non-zero if @e c is a decimal digit. */
+#define IS_DIGIT(c) ((uint8_t)((c) - '0') <= 9)
+
+
+/**
+ * Check DS1307 seconds, minutes and hours registers (without the flags): BCD,
+ * with hours from 1 to 12.
+ */
+static uint8_t time_ok(const uint8_t *time)
 {
-	if (! me->len) {
+	return time[0] < 0x60 && (time[0] & 0x0f) < 10 &&
+		time[1] < 0x60 && (time[1] & 0x0f) < 10 &&
+		(time[2] & 0x0f) < 10 && time[2] >= 0x01 && time[2] <= 0x12;
+}
+
+
+/**
+ * Parse a time, "h:mm:ss" or "hh:mm:ss", with hours from 1 to 12, into the
+ * DS1307 seconds, minutes and hours registers (without the flags).
+ *
+ * @return 1, or 0 if @e word isn't a time.
+ */
+static uint8_t parse_time(const char *word, uint8_t *time)
+{
+	uint8_t hours = 0;
+
+	if (IS_DIGIT(word[0]) && IS_DIGIT(word[1])) {
+		hours = (word[0] - '0') << 4;
+		word++;
+	}
+	if (! IS_DIGIT(word[0]) || ':' != word[1] ||
+	    ! IS_DIGIT(word[2]) || ! IS_DIGIT(word[3]) || ':' != word[4] ||
+	    ! IS_DIGIT(word[5]) || ! IS_DIGIT(word[6]) || '\0' != word[7]) {
+		return 0;
+	}
+	time[0] = ((word[5] - '0') << 4) | (word[6] - '0');
+	time[1] = ((word[2] - '0') << 4) | (word[3] - '0');
+	time[2] = hours | (word[0] - '0');
+	return time_ok(time);
+}
+
+
+/**
+ * Check and convert one argument, of the type given by its character in a
+ * command's schema.  See struct Command.
+ *
+ * @return 1, or 0 if the argument is not of that type.
+ */
+static uint8_t parse_arg(char type, uint8_t i, struct CommandArgs *args)
+{
+	const char *word = args->word[i];
+
+	switch (type) {
+	case 'w':
+		return 1;
+	case 'u':
+		return parse_number(word, &args->number[i]);
+	case 't':
+		return parse_time(word, args->time);
+	case 'a':
+		if (! strcasecmp_P(word, PSTR("A")) ||
+		    ! strcasecmp_P(word, PSTR("AM"))) {
+			args->number[i] = 0;
+			return 1;
+		}
+		if (! strcasecmp_P(word, PSTR("P")) ||
+		    ! strcasecmp_P(word, PSTR("PM"))) {
+			args->number[i] = 0x20;
+			return 1;
+		}
+		return 0;
+	}
+	return 0;
+}
+
+
+/**
+ * Check the arguments in @e args against a command's schema.
+ *
+ * @return 1 if they match.
+ */
+static uint8_t parse_args(const char *schema, struct CommandArgs *args)
+{
+	uint8_t optional = 0;
+	uint8_t i = 0;
+
+	for (; *schema; schema++) {
+		if ('?' == *schema) {
+			optional = 1;
+			continue;
+		}
+		if (i == args->n) {
+			return optional;
+		}
+		if (! parse_arg(*schema, i, args)) {
+			return 0;
+		}
+		i++;
+	}
+	return i == args->n;
+}
+
+
+/**
+ * Find a command by name, ignoring case, with a binary search of commands[].
+ *
+ * @return the index in commands[], or -1.
+ */
+static int8_t find_command(const char *name)
+{
+	uint8_t lo = 0;
+	uint8_t hi = N_COMMANDS;
+	uint8_t mid;
+	int c;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		c = strcasecmp_P(name, commands[mid].name);
+		if (! c) {
+			return mid;
+		}
+		if (c < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return -1;
+}
+
+
+/**
+ * Check that commands[] is in order, so that find_command() works.
+ */
+static void check_commands(void)
+{
+	char name[COMMAND_NAME_MAX];
+	uint8_t i;
+
+	for (i = 1; i < N_COMMANDS; i++) {
+		strcpy_P(name, commands[i - 1].name);
+		Q_ASSERT(strcasecmp_P(name, commands[i].name) < 0);
+	}
+}
+
+
+/**
+ * Run one command.  The first word is the command, and the rest are its
+ * arguments, which are checked against the command's schema before its
+ * handler is called.
+ *
+ * @return one of the COMMANDER_ status bytes, or COMMAND_PENDING.
+ */
+static uint8_t run_command(char *text)
+{
+	char *words[1 + COMMAND_MAX_ARGS];
+	int8_t n;
+	int8_t index;
+	struct Command command;
+	struct CommandArgs args;
+
+	n = tokenize(text, words, 1 + COMMAND_MAX_ARGS);
+	if (! n) {
+		return COMMANDER_OK;
+	}
+	index = find_command(words[0]);
+	if (index < 0) {
+		S("unknown command\r\n");
+		return COMMANDER_UNKNOWN;
+	}
+	memcpy_P(&command, &commands[index], sizeof(command));
+	if (n > 0) {
+		args.n = n - 1;
+		memcpy(args.word, words + 1, sizeof(args.word));
+	}
+	if (n < 0 || ! parse_args(command.args, &args)) {
+		SF("Usage: %S\r\n", command.help);
+		return COMMANDER_BAD_ARGS;
+	}
+	return command.fn(&args);
+}
+
+
+/**
+ * Run a line of commands, separated by ';'.  The batch stops at the first
+ * command that fails.
+ */
+static void process_line(char *line)
+{
+	char *next;
+	uint8_t status;
+
+	if (! commander.quiet) {
+		SF("Processing: \"%s\"\r\n", line);
+	}
+	do {
+		next = strchr(line, ';');
+		if (next) {
+			*next++ = '\0';
+		}
+		status = run_command(line);
+		if (COMMANDER_OK != status && COMMAND_PENDING != status
+		    && next) {
+			S("Rest of the line skipped\r\n");
+			return;
+		}
+		line = next;
+	} while (line);
+}
+
+
+/**
+ * Check the arguments in a binary command packet against a command's schema,
+ * and convert them.  See struct Command.
+ *
+ * @return 1 if they match.
+ */
+static uint8_t parse_packet(const char *schema, char *p, uint8_t len,
+			    struct CommandArgs *args)
+{
+	char *end = p + len;
+	uint8_t optional = 0;
+	uint8_t i = 0;
+
+	for (; *schema; schema++) {
+		if ('?' == *schema) {
+			optional = 1;
+			continue;
+		}
+		if (p == end) {
+			if (! optional) {
+				return 0;
+			}
+			break;
+		}
+		args->word[i] = p;
+		switch (*schema) {
+		case 'w':
+			while (p < end && *p) {
+				p++;
+			}
+			if (p < end) {
+				p++;
+			}
+			break;
+		case 'u':
+			if (end - p < 2) {
+				return 0;
+			}
+			args->number[i] = (uint8_t)p[0] | ((uint8_t)p[1] << 8);
+			p += 2;
+			break;
+		case 't':
+			if (end - p < 3) {
+				return 0;
+			}
+			memcpy(args->time, p, 3);
+			if (! time_ok(args->time)) {
+				return 0;
+			}
+			p += 3;
+			break;
+		case 'a':
+			args->number[i] = *p++ ? 0x20 : 0;
+			break;
+		}
+		i++;
+	}
+	args->n = i;
+	return p == end;
+}
+
+
+/**
+ * Run a binary command packet, and answer it with a status byte.  See
+ * serial_binary() for the packet format.
+ *
+ * The commands are found by opcode with a linear search.  There are only a
+ * few, and the packets come no faster than the text commands.
+ */
+static void process_packet(struct SerialLine *line)
+{
+	struct Command command;
+	struct CommandArgs args;
+	uint8_t status;
+	uint8_t i;
+
+	if (! line->len) {
+		serial_send_byte(COMMANDER_BAD_PACKET);
 		return;
 	}
-	me->buf[me->len] = '\0';
-	S("Processing: \"");
-	serial_send(me->buf);
-	S("\"\r\n");
-	if (0) { }
-#define C(name,len)							\
-	else if ((!strncasecmp_P(me->buf, s_##name, len)) &&		\
-		 ((me->buf[len] == '\0') || (me->buf[len] == ' ')))	\
-		do { fn_##name(me->buf); } while (0)
-	C(TRON,4);
-	C(TROFF,5);
-	C(SET,3);
-	C(GET,3);
-	C(RESET,5);
-	else { SD("unknown command\r\n"); }
-	clear_buffer(me);
+	status = COMMANDER_UNKNOWN;
+	for (i = 0; i < N_COMMANDS; i++) {
+		if ((uint8_t)line->data[0] != Q_ROM_BYTE(commands[i].opcode)) {
+			continue;
+		}
+		memcpy_P(&command, &commands[i], sizeof(command));
+		if (parse_packet(command.args, line->data + 2,
+				 (uint8_t)line->data[1], &args)) {
+			status = command.fn(&args);
+		} else {
+			status = COMMANDER_BAD_ARGS;
+		}
+		break;
+	}
+	if (COMMAND_PENDING != status) {
+		serial_send_byte(status);
+	}
 }
 
 
-static void clear_buffer(struct Commander *me)
+/**
+ * Parse ON or OFF.
+ *
+ * @return 1 or 0, or -1 for anything else.
+ */
+static int8_t parse_on_off(const char *word)
 {
-	me->buf[0] = '\0';
-	me->len = 0;
+	if (! strcasecmp_P(word, PSTR("ON"))) {
+		return 1;
+	}
+	if (! strcasecmp_P(word, PSTR("OFF"))) {
+		return 0;
+	}
+	return -1;
 }
 
 
-static void fn_TRON(const char *line)
+static uint8_t fn_TRON(struct CommandArgs *args)
 {
 	S("Turning tracing on\r\n");
 	traceon();
+	return COMMANDER_OK;
+}
+
+
+#ifdef WORDCLOCK_BENCH
+/**
+ * Time the number formatting and the send ring against the code they replaced.  The results come
+ * about two seconds later, see commanderBenchState().
+ */
+static uint8_t fn_BENCH(struct CommandArgs *args)
+{
+	commander.benching = 1;
+	return COMMAND_PENDING;
 }
+#endif
 
 
-static void fn_TROFF(const char *line)
+static uint8_t fn_TROFF(struct CommandArgs *args)
 {
 	S("Turning tracing off\r\n");
 	traceoff();
+	return COMMANDER_OK;
+}
+
+
+/**
+ * Set the time by telling the Wordclock state machine to do so, eg
+ * "SET 5:07:00 PM".  The hours are 1 to 12, and AM or PM can be A or P, in
+ * either case.
+ */
+static uint8_t fn_SET(struct CommandArgs *args)
+{
+	static uint8_t bytes[3];
+
+	bytes[0] = args->time[0];
+	bytes[1] = args->time[1];
+	/* hours, plus AM/PM flag, plus 12/24 hour flag */
+	bytes[2] = args->time[2] | args->number[1] | 0x40;
+
+	SF("Setting time to %T\r\n", bytes);
+	SF("bytes= %b:%b:%b\r\n", bytes[0], bytes[1], bytes[2]);
+	fff(&wordclock);
+	QActive_post((QActive*)(&wordclock), SET_TIME_SIGNAL, (QParam)bytes);
+	return COMMANDER_OK;
 }
 
 
 /**
- * Set the time by telling the Wordclock state machine to do so.
+ * Show the time from the wordclock's snapshot, without touching the TWI, so
+ * GET can be polled as often as anyone likes.  "GET FRESH" has the wordclock
+ * read the DS1307 first (or wait for the read it already has in flight), and
+ * answers when SNAPSHOT_SIGNAL comes back.
+ */
+static uint8_t fn_GET(struct CommandArgs *args)
+{
+	if (! args->n) {
+		show_snapshot();
+		return COMMANDER_OK;
+	}
+	if (strcasecmp_P(args->word[0], PSTR("FRESH"))) {
+		S("Usage: GET [FRESH]\r\n");
+		return COMMANDER_BAD_ARGS;
+	}
+	if (0xff == commander.freshWaiting) {
+		return COMMANDER_FAILED;
+	}
+	if (! commander.freshWaiting) {
+		fff(&wordclock);
+		QActive_post((QActive*)(&wordclock), RTC_READ_SIGNAL, 0);
+	}
+	commander.freshWaiting ++;
+	return COMMAND_PENDING;
+}
+
+
+static void show_snapshot(void)
+{
+	const struct TimeSnapshot *snap = &wordclock.snapshot;
+
+	if (! snap->seq) {
+		S("No time yet\r\n");
+		return;
+	}
+	SF("Time %T age=%u seq=%u\r\n", snap->regs, snap->age, snap->seq);
+}
+
+
+/**
+ * Set the time from the host to within a few milliseconds.
  *
- * The format of the time is very specific:
+ * "SYNC" on its own answers "Sync n" at once, where n is how long the line
+ * waited here, in units of 0.1ms.  The host takes that from its round trip
+ * time to get the delay from sending a line to its arrival.
  *
- * "set hh:mm:ss A"
+ * "SYNC h:mm:ss AM|PM frac" gives the host's time when the line arrived (by
+ * the host's reckoning of the delay), frac being units of 0.1ms into that
+ * second.  The wordclock writes the RTC at the start of the next second, and
+ * "Synced" comes back with the time written and how late the write was, in
+ * units of 0.1ms.  tools/wcsync does all this.
  *
- * "set" can be upper or lower case, the time must contain six digits and two
- * colons on that order, and "A" can be "P" for PM, and must be upper case.
- * Only one space between "set" and the time is allowed, and leading or
- * trailing space is not allowed.
+ * Both need a line stamped as it arrived (see struct SerialLine), and fail
+ * with "Sync busy" otherwise.
+ */
+static uint8_t fn_SYNC(struct CommandArgs *args)
+{
+	static struct WordclockSync sync;
+	uint16_t waited;
+
+	waited = BSP_stamp() - commander.lineStamp;
+	if (! commander.lineStamped || waited >= BSP_STAMP_HZ
+	    || commander.syncWaiting) {
+		S("Sync busy\r\n");
+		return COMMANDER_FAILED;
+	}
+	if (! args->n) {
+		SF("Sync %u\r\n", BSP_STAMP_TO_100US(waited));
+		return COMMANDER_OK;
+	}
+	if (3 != args->n || args->number[2] > 9999) {
+		SF("Usage: %S\r\n", h_SYNC);
+		return COMMANDER_BAD_ARGS;
+	}
+	sync.time[0] = args->time[0];
+	sync.time[1] = args->time[1];
+	sync.time[2] = args->time[2] | args->number[1] | 0x40;
+	sync.frac = args->number[2];
+	sync.arrival = commander.lineStamp;
+	commander.syncWaiting = 1;
+	fff(&wordclock);
+	QActive_post((QActive*)(&wordclock), SYNC_SIGNAL, (QParam)&sync);
+	return COMMAND_PENDING;
+}
+
+
+/**
+ * Show how much serial output has been lost on each channel, and the receive
+ * errors since boot.
+ */
+static uint8_t fn_STATS(struct CommandArgs *args)
+{
+	struct SerialErrors errors;
+
+	SF("Drops: urgent=%u telemetry=%u bulk=%u\r\n",
+	   serial_drops(SERIAL_URGENT), serial_drops(SERIAL_TELEMETRY),
+	   serial_drops(SERIAL_BULK));
+	serial_errors(&errors);
+	SF("RX: overrun=%u framing=%u parity=%u lost=%u frames=%u\r\n",
+	   errors.overrun, errors.framing, errors.parity, errors.lost,
+	   errors.frames);
+#ifdef WORDCLOCK_TWI_TIMING
+	SF("TWI ISR: max %u cycles\r\n", twi_isr_max_cycles());
+#endif
+	return COMMANDER_OK;
+}
+
+
+/**
+ * Change the baud rate, eg "BAUD 115200".  With no rate, show the current
+ * rate.
  *
- * But it works.
+ * The reply goes at the old rate.  Then, once it has gone, the rate changes
+ * and we wait for OK at the new rate, see commanderBaudConfirmState().  That
+ * needs text mode.
  */
-static void fn_SET(const char *line)
+static uint8_t fn_BAUD(struct CommandArgs *args)
 {
-	static uint8_t bytes[3];
+	int8_t index;
 
-#define SP1 3
-#define Hr1 4
-#define Hr2 5
-#define MiC 6
-#define Mi1 7
-#define Mi2 8
-#define SeC 9
-#define Se1 10
-#define Se2 11
-#define SP2 12
-#define AoP 13
-#define END 14
-
-	if (
-	    /* Check that the line matches the syntax */
-	    line[SP1] != ' ' ||
-	    line[Hr1]  < '0' || line[Hr1]  > '1' ||
-	    line[Hr2]  < '0' || line[Hr2]  > '9' || line[MiC]  != ':' ||
-	    line[Mi1]  < '0' || line[Mi1]  > '5' ||
-	    line[Mi2]  < '0' || line[Mi2]  > '9' || line[SeC]  != ':' ||
-	    line[Se1]  < '0' || line[Se1]  > '5' ||
-	    line[Se2]  < '0' || line[Se2]  > '9' || line[SP2] != ' ' ||
-	    (line[AoP] != 'A' && line[AoP] != 'P') ||
-	    line[END] != '\0'
-	    ||
-	    /* Check for some extra validity in the hours */
-	    (line[Hr1] == '0' && line[Hr2] == '0') ||
-	    (line[Hr1] == '1' && line[Hr2]  > '2')
-	    ) {
-		S("time invalid\r\n");
-		return;
+	if (! args->n) {
+		SF("Baud %S\r\n", serial_baud_name(serial_baud()));
+		return COMMANDER_OK;
+	}
+	if (commander.binary) {
+		S("BAUD needs text mode\r\n");
+		return COMMANDER_FAILED;
 	}
+	index = serial_baud_index(args->word[0]);
+	if (index < 0) {
+		S("Baud rates: 9600 19200 38400 57600 115200 230400\r\n");
+		return COMMANDER_FAILED;
+	}
+	SF("Changing to %S baud\r\n", serial_baud_name(index));
+	commander.baudOld = serial_baud();
+	commander.baudNew = index;
+	commander.baudChange = 1;
+	return COMMANDER_OK;
+}
 
-	S("Setting time to ");
-	serial_send(line + 4);
-	S("\r\n");
 
-	/* seconds */
-	bytes[0] = ((line[10] - '0') << 4) + (line[11] - '0');
-	/* minutes */
-	bytes[1] = ((line[7]  - '0') << 4) + (line[8]  - '0');
-	/* hours, plus AM/PM flag, plus 12/24 hour flag */
-	bytes[2] = (((line[4]  - '0') << 4) + (line[5]  - '0'))
-		| (line[13]=='P' ? 0x20 : 0x00)
-		| 0x40;
-
-	S("bytes= ");
-	serial_send_hex_int(bytes[0]);
-	S(":");
-	serial_send_hex_int(bytes[1]);
-	S(":");
-	serial_send_hex_int(bytes[2]);
-	S("\r\n");
-	fff(&wordclock);
-	QActive_post((QActive*)(&wordclock), SET_TIME_SIGNAL, (QParam)bytes);
+/**
+ * Turn framed mode on or off, "FRAME ON" or "FRAME OFF".  With no argument,
+ * show the mode.
+ *
+ * The reply is sent in the new mode.  In framed mode, commands (including
+ * FRAME OFF) must arrive framed.  The mode is not saved, so a reset always
+ * comes back to plain text.  Framed mode ends binary command mode.
+ */
+static uint8_t fn_FRAME(struct CommandArgs *args)
+{
+	int8_t on;
+
+	if (args->n) {
+		on = parse_on_off(args->word[0]);
+		if (on < 0) {
+			S("FRAME ON or FRAME OFF\r\n");
+			return COMMANDER_FAILED;
+		}
+		serial_framed(on);
+		commander.binary = 0;
+	}
+	if (serial_is_framed()) {
+		S("Framed\r\n");
+	} else {
+		S("Not framed\r\n");
+	}
+	return COMMANDER_OK;
+}
+
+
+/**
+ * Turn binary command mode on or off, "BINARY ON" or "BINARY OFF".  With no
+ * argument, show the mode.
+ *
+ * In binary mode commands arrive as packets (see serial_binary()), and each
+ * is answered with a status byte, after any text the command sends.  Wait
+ * for the reply to BINARY ON before sending packets.  Binary mode ends framed
+ * mode.
+ */
+static uint8_t fn_BINARY(struct CommandArgs *args)
+{
+	int8_t on;
+
+	if (args->n) {
+		on = parse_on_off(args->word[0]);
+		if (on < 0) {
+			S("BINARY ON or BINARY OFF\r\n");
+			return COMMANDER_FAILED;
+		}
+		serial_binary(on);
+		commander.binary = on;
+	}
+	if (commander.binary) {
+		S("Binary\r\n");
+	} else {
+		S("Not binary\r\n");
+	}
+	return COMMANDER_OK;
+}
+
+
+/**
+ * Turn the "Processing:" echo of each line off ("QUIET ON") or on ("QUIET
+ * OFF").  With no argument, show the setting.
+ */
+static uint8_t fn_QUIET(struct CommandArgs *args)
+{
+	int8_t on;
+
+	if (args->n) {
+		on = parse_on_off(args->word[0]);
+		if (on < 0) {
+			S("QUIET ON or QUIET OFF\r\n");
+			return COMMANDER_FAILED;
+		}
+		commander.quiet = on;
+	}
+	if (commander.quiet) {
+		S("Quiet\r\n");
+	} else {
+		S("Not quiet\r\n");
+	}
+	return COMMANDER_OK;
 }
 
 
-static void fn_GET(const char *line)
+/**
+ * List the commands, or with a command name, show its usage.  The list is
+ * one line, so it fits in the urgent send buffer.
+ */
+static uint8_t fn_HELP(struct CommandArgs *args)
 {
-	S("Get time...\r\n");
+	int8_t index;
+	uint8_t i;
+
+	if (args->n) {
+		index = find_command(args->word[0]);
+		if (index < 0) {
+			S("unknown command\r\n");
+			return COMMANDER_FAILED;
+		}
+		SF("%S\r\n", (PGM_P)Q_ROM_PTR(commands[index].help));
+		return COMMANDER_OK;
+	}
+	S("Commands:");
+	for (i = 0; i < N_COMMANDS; i++) {
+		SF(" %S", commands[i].name);
+	}
+	S("\r\n");
+	return COMMANDER_OK;
 }
 
 
-static void fn_RESET(const char *line)
+/**
+ * Reset via the watchdog, once the message has gone.  See
+ * SERIAL_DRAINED_SIGNAL in commanderState().
+ */
+static uint8_t fn_RESET(struct CommandArgs *args)
 {
-	SD("Reset via watchdog - turning off interrupts...\r\n");
-	cli();
-	while (1)
-		;
+	S("Reset via watchdog - turning off interrupts...\r\n");
+	/* A full boot, not a warm restart from the saved state. */
+	wordclock_cold_reset();
+	commander.resetting = 1;
+	serial_notify_drained((QActive*)(&commander));
+	return COMMANDER_OK;
 }
@@ -3,15 +3,79 @@
 
 #include "qpn_port.h"
 #include "qactive-named.h"
+#include "serial.h"
 
 
-#define COMMANDER_BUFLEN 50
+/**
+ * How long to wait for OK after changing the baud rate, in ticks.
+ */
+#ifndef COMMANDER_BAUD_CONFIRM_TICKS
+#define COMMANDER_BAUD_CONFIRM_TICKS (10 * 20)
+#endif
+
+
+/**
+ * Keep each line until the replies to it have gone, if there is less than
+ * this much room for replies.  That makes a sender that honours XOFF wait for
+ * us, so no replies are lost.  This is enough for the longest reply to one
+ * command (STATS), but a line with a batch of commands can need more.
+ */
+#ifndef COMMANDER_REPLY_SPACE
+#define COMMANDER_REPLY_SPACE 120
+#endif
+
+
+/**
+ * @name Binary command replies
+ *
+ * In binary command mode (BINARY ON), each packet is answered with one of
+ * these bytes, after any text the command sends.  They are all above 0x7f,
+ * so they can't be mistaken for the text.
+ * @{
+ */
+/** The command was done. */
+#define COMMANDER_OK         0x80
+/** The command was refused, eg a baud rate we don't have. */
+#define COMMANDER_FAILED     0x81
+/** The arguments don't match the command. */
+#define COMMANDER_BAD_ARGS   0x82
+/** There is no command with that opcode. */
+#define COMMANDER_UNKNOWN    0x83
+/** The packet had a bad CRC or was too long. */
+#define COMMANDER_BAD_PACKET 0x84
+/** @} */
 
 
 struct Commander {
 	QActiveNamed super;
-	char buf[COMMANDER_BUFLEN];
-	uint8_t len;
+	/** Set by RESET, to reset when the output has gone. */
+	uint8_t resetting;
+	/** Set by BAUD, to change the rate when the output has gone. */
+	uint8_t baudChange;
+	/** The baud rate to go back to if the change isn't confirmed. */
+	uint8_t baudOld;
+	/** The baud rate being changed to. */
+	uint8_t baudNew;
+#ifdef WORDCLOCK_BENCH
+	/** Set by BENCH, to run it a step at a time. */
+	uint8_t benching;
+#endif
+	/** Set by QUIET ON, to stop echoing each line. */
+	uint8_t quiet;
+	/** Set by BINARY ON, when commands arrive as packets. */
+	uint8_t binary;
+	/** Lines kept until our replies have gone.  See
+	    COMMANDER_REPLY_SPACE. */
+	struct SerialLine *held[2];
+	uint8_t nheld;
+	/** The number of GET FRESH commands waiting for SNAPSHOT_SIGNAL. */
+	uint8_t freshWaiting;
+	/** Set while SYNC waits for SYNCED_SIGNAL. */
+	uint8_t syncWaiting;
+	/** The arrival of the line being processed, from struct
+	    SerialLine. */
+	uint16_t lineStamp;
+	uint8_t lineStamped;
 };
 
 
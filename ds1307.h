@@ -4,5 +4,13 @@
 #define DS1307_ADDRESS 0b1101000
 #define DS1307_ADDRMASK (DS1307_ADDRESS << 1)
 
+/* Register 0: clock halt, set when the oscillator is stopped. */
+#define DS1307_CH 0x80
+/* Register 2: 12 hour mode, and PM in 12 hour mode. */
+#define DS1307_12HOUR 0x40
+#define DS1307_PM 0x20
+/* Register 7: OUT=1, SQWE=1, RS=00 gives a 1Hz square wave. */
+#define DS1307_SQW_1HZ ((1<<7) | (1<<4))
+
 
 #endif
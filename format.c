@@ -0,0 +1,135 @@
+/**
+ * @file
+ *
+ * @brief Turn numbers into text without dividing.
+ *
+ * The ATmega32 has no divide instruction, so n % 10 and n / 10 are calls to
+ * libgcc's __udivmodhi4, which takes about 200 cycles.  The old digit loop did
+ * that once per digit, so a five digit number cost over 1000 cycles.
+ *
+ * Here decimal digits are found by subtracting powers of ten.  Each digit
+ * costs a 16 bit compare and subtract per unit of its value, about 8 cycles
+ * each, so the worst case (59999) is about 300 cycles, and a two digit number
+ * is well under 100.  The DS1307 keeps its registers in BCD, so the time is
+ * formatted straight from the register nibbles with no arithmetic at all,
+ * about 50 cycles for "h:mm:ss PM".
+ *
+ * These figures are counted from the generated code.  The BENCH command, in a
+ * "make WORDCLOCK_BENCH=1" build, measures them on the board against the old
+ * code, see bench.c.  tests/format-test.c checks every output against
+ * snprintf() on the host ("make test").
+ */
+
+#include "format.h"
+#include "qpn_port.h"
+
+
+static const uint16_t Q_ROM powers[] = { 10000, 1000, 100, 10 };
+
+
+/**
+ * @brief Write an unsigned number in decimal, with at least @e width digits.
+ *
+ * Leading zeros are added up to @e width, which can be up to
+ * FORMAT_UINT_MAX.  A width of 0 or 1 means no padding.
+ */
+uint8_t format_uint_padded(char *buf, uint16_t n, uint8_t width)
+{
+	char *p = buf;
+	uint8_t i;
+
+	for (i = 0; i < 4; i++) {
+		uint16_t power = pgm_read_word(&powers[i]);
+		char digit = '0';
+
+		while (n >= power) {
+			n -= power;
+			digit++;
+		}
+		if ('0' != digit || p != buf || width >= FORMAT_UINT_MAX - i) {
+			*p++ = digit;
+		}
+	}
+	*p++ = '0' + (uint8_t)n;
+	return (uint8_t)(p - buf);
+}
+
+
+/**
+ * @brief Write an unsigned number in decimal, with no leading zeros.
+ */
+uint8_t format_uint(char *buf, uint16_t n)
+{
+	return format_uint_padded(buf, n, 0);
+}
+
+
+/**
+ * @brief Write an unsigned number in upper case hex, with no leading zeros.
+ */
+uint8_t format_hex(char *buf, uint16_t x)
+{
+	static const char Q_ROM hexchars[] = "0123456789ABCDEF";
+	char *p = buf;
+	int8_t shift;
+
+	for (shift = 12; shift > 0; shift -= 4) {
+		if (p != buf || (x >> shift)) {
+			*p++ = Q_ROM_BYTE(hexchars[(x >> shift) & 0x0f]);
+		}
+	}
+	*p++ = Q_ROM_BYTE(hexchars[x & 0x0f]);
+	return (uint8_t)(p - buf);
+}
+
+
+/**
+ * @brief Write a BCD byte as two decimal digits.
+ */
+uint8_t format_bcd(char *buf, uint8_t bcd)
+{
+	buf[0] = '0' + (bcd >> 4);
+	buf[1] = '0' + (bcd & 0x0f);
+	return 2;
+}
+
+
+/**
+ * @brief Write the time from DS1307 registers, eg "5:07:09 PM".
+ *
+ * In 24 hour mode the time is followed by " (24)".  The hour has no leading
+ * zero.  Bits that aren't part of the time, such as CH in the seconds
+ * register, are ignored.
+ *
+ * @param regs the seconds, minutes and hours registers, in the order read
+ * from the DS1307.
+ */
+uint8_t format_time(char *buf, const uint8_t *regs)
+{
+	static const char Q_ROM suffixes[3][6] = { " AM", " PM", " (24)" };
+	uint8_t hours = regs[2];
+	uint8_t suffix;
+	char *p = buf;
+	char c;
+
+	if (hours & 0x40) {
+		/* 12 hour mode */
+		suffix = (hours & 0x20) ? 1 : 0;
+		hours &= 0x1f;
+	} else {
+		suffix = 2;
+		hours &= 0x3f;
+	}
+	if (hours & 0xf0) {
+		*p++ = '0' + (hours >> 4);
+	}
+	*p++ = '0' + (hours & 0x0f);
+	*p++ = ':';
+	p += format_bcd(p, regs[1] & 0x7f);
+	*p++ = ':';
+	p += format_bcd(p, regs[0] & 0x7f);
+	for (uint8_t i = 0; (c = Q_ROM_BYTE(suffixes[suffix][i])); i++) {
+		*p++ = c;
+	}
+	return (uint8_t)(p - buf);
+}
@@ -0,0 +1,28 @@
+#ifndef format_h_INCLUDED
+#define format_h_INCLUDED
+
+#include <stdint.h>
+
+/**
+ * @name Number formatting
+ *
+ * These write ASCII into @e buf and return the number of characters written.
+ * They don't add a terminating null.  None of them divide, see format.c.
+ * @{
+ */
+
+/** The longest output of format_uint() or format_uint_padded(). */
+#define FORMAT_UINT_MAX 5
+
+uint8_t format_uint(char *buf, uint16_t n);
+uint8_t format_uint_padded(char *buf, uint16_t n, uint8_t width);
+uint8_t format_hex(char *buf, uint16_t x);
+uint8_t format_bcd(char *buf, uint8_t bcd);
+
+/** The longest output of format_time(), "12:59:59 (24)". */
+#define FORMAT_TIME_MAX 13
+
+uint8_t format_time(char *buf, const uint8_t *regs);
+/** @} */
+
+#endif
@@ -1,55 +1,169 @@
+/**
+ * @file
+ *
+ * @brief Drive the FETs that light the words.
+ *
+ * The whole display is committed with one masked read-modify-write of each
+ * output port, inside a single critical section, so every word changes at the
+ * same time.
+ */
+
 #include "outputs.h"
 #include "serial.h"
 
 
+Q_DEFINE_THIS_FILE;
+
+/** This file's number in binary trace IDs, see ST(). */
+#define TRACE_FILE 3
+
+
+/** Every word. */
+#define OUTPUTS_ALL (ONE | TWO | THREE | FOUR | FIVE | SIX | SEVEN |	\
+		     EIGHT | NINE | TEN | ELEVEN | TWELVE |		\
+		     FIVE_MIN | TEN_MIN | QUARTER | TWENTY | HALF |	\
+		     PAST | TO | OCLOCK)
+
+/** The same words added instead of or'ed, to check for shared pins. */
+#define OUTPUTS_SUM (ONE + TWO + THREE + FOUR + FIVE + SIX + SEVEN +	\
+		     EIGHT + NINE + TEN + ELEVEN + TWELVE +		\
+		     FIVE_MIN + TEN_MIN + QUARTER + TWENTY + HALF +	\
+		     PAST + TO + OCLOCK)
+
+/** Pins that must never be driven by the display. */
+#define OUTPUTS_RESERVED (OUTPUT_PB(2) |		/* INT2, RTC SQW */ \
+			  OUTPUT_PC(0) | OUTPUT_PC(1) |	/* TWI */	\
+			  OUTPUT_PD(0) | OUTPUT_PD(1))	/* UART */
+
+/* Each word has its own pin. */
+Q_ASSERT_COMPILE(OUTPUTS_ALL == OUTPUTS_SUM);
+/* No word is on the TWI, UART or INT2 pins. */
+Q_ASSERT_COMPILE(0 == (OUTPUTS_ALL & OUTPUTS_RESERVED));
+
+#define OUTPUTS_A ((uint8_t)(OUTPUTS_ALL      ))
+#define OUTPUTS_B ((uint8_t)(OUTPUTS_ALL >>  8))
+#define OUTPUTS_C ((uint8_t)(OUTPUTS_ALL >> 16))
+#define OUTPUTS_D ((uint8_t)(OUTPUTS_ALL >> 24))
+
+
+static void outputs_trace(uint32_t words);
+
+
+/**
+ * The words that are currently lit.
+ */
+static uint32_t outputs_state = 0;
+
+
 /**
  * Initialise the outputs that drive the display lights.
  *
- * @todo Implement the output lines.
+ * All the words are turned off, and the FET lines are made outputs.  JTAG is
+ * disabled, as it shares PC2-PC5.  (JTD must be written twice within four
+ * cycles.)
  */
 void outputs_init(void)
 {
+	uint8_t sreg;
+	uint8_t mcucsr;
+
+	sreg = SREG;
+	cli();
+	mcucsr = MCUCSR | (1 << JTD);
+	MCUCSR = mcucsr;
+	MCUCSR = mcucsr;
 
+	PORTA &= ~OUTPUTS_A;
+	PORTB &= ~OUTPUTS_B;
+	PORTC &= ~OUTPUTS_C;
+	PORTD &= ~OUTPUTS_D;
+	DDRA |= OUTPUTS_A;
+	DDRB |= OUTPUTS_B;
+	DDRC |= OUTPUTS_C;
+	DDRD |= OUTPUTS_D;
+	outputs_state = 0;
+	SREG = sreg;
 }
 
 
 void outputs_off(void)
 {
-	//S("All outputs off\r\n");
+	outputs_set(0);
 }
 
 
-void output_on(uint8_t output)
+/**
+ * Display a set of words.
+ *
+ * Only the word bits of each port are changed.  Words that are lit before and
+ * after never go dark.
+ *
+ * @param words a mask of word bits, see outputs.h
+ */
+void outputs_set(uint32_t words)
 {
-	switch (output) {
-#define C(x) case x: S(#x); break
-	C(ONE);
-	C(TWO);
-	C(THREE);
-	C(FOUR);
-	C(FIVE);
-	C(SIX);
-	C(SEVEN);
-	C(EIGHT);
-	C(NINE);
-	C(TEN);
-	C(ELEVEN);
-	C(TWELVE);
-	C(FIVE_MIN);
-	C(TEN_MIN);
-	C(QUARTER);
-	C(TWENTY);
-	C(HALF);
-	C(PAST);
-	C(TO);
-	C(OCLOCK);
-	default:
-		S("<unknown output ");
-		serial_send_int(output);
-		S(">");
-		break;
+	uint8_t sreg;
+
+	Q_ASSERT( ! (words & ~OUTPUTS_ALL) );
+	if (words == outputs_state) {
+		return;
+	}
+	sreg = SREG;
+	cli();
+	PORTA = (PORTA & ~OUTPUTS_A) | (uint8_t)(words      );
+	PORTB = (PORTB & ~OUTPUTS_B) | (uint8_t)(words >>  8);
+	PORTC = (PORTC & ~OUTPUTS_C) | (uint8_t)(words >> 16);
+	PORTD = (PORTD & ~OUTPUTS_D) | (uint8_t)(words >> 24);
+	SREG = sreg;
+	outputs_state = words;
+	if (TRACING(TRACE)) {
+		outputs_trace(words);
 	}
+}
+
 
+uint32_t outputs_get(void)
+{
+	return outputs_state;
 }
 
 
+/**
+ * Print the names of the lit words.
+ */
+static void outputs_trace(uint32_t words)
+{
+	uint32_t bit;
+
+	ST("Outputs:");
+	for (bit = 1; bit; bit <<= 1) {
+		if (! (words & bit)) {
+			continue;
+		}
+		switch (bit) {
+#define C(x) case x: ST(" " #x); break
+		C(ONE);
+		C(TWO);
+		C(THREE);
+		C(FOUR);
+		C(FIVE);
+		C(SIX);
+		C(SEVEN);
+		C(EIGHT);
+		C(NINE);
+		C(TEN);
+		C(ELEVEN);
+		C(TWELVE);
+		C(FIVE_MIN);
+		C(TEN_MIN);
+		C(QUARTER);
+		C(TWENTY);
+		C(HALF);
+		C(PAST);
+		C(TO);
+		C(OCLOCK);
+#undef C
+		}
+	}
+	ST("\r\n");
+}
@@ -5,27 +5,48 @@
 
 void outputs_init(void);
 void outputs_off(void);
-void output_on(uint8_t output);
+void outputs_set(uint32_t words);
+uint32_t outputs_get(void);
 
-#define ONE       1
-#define TWO       2
-#define THREE     3
-#define FOUR      4
-#define FIVE      5
-#define SIX       6
-#define SEVEN     7
-#define EIGHT     8
-#define NINE      9
-#define TEN      10
-#define ELEVEN   11
-#define TWELVE   12
-#define FIVE_MIN 13
-#define TEN_MIN  14
-#define QUARTER  15
-#define TWENTY   16
-#define HALF     17
-#define PAST     18
-#define TO       19
-#define OCLOCK   20
+
+/**
+ * @name Word masks
+ *
+ * A set of words is a 32 bit mask laid out like the output ports: bits 0-7
+ * are PORTA, bits 8-15 are PORTB, bits 16-23 are PORTC and bits 24-31 are
+ * PORTD.  Each word is the bit for the FET line that drives it, so a mask can
+ * be written to the ports without any translation.
+ *
+ * This follows pins.ods, except that "Ten" is on PB4 rather than PB2, since
+ * PB2 is INT2 and carries the RTC square wave.
+ *
+ * @{
+ */
+#define OUTPUT_PA(n) (1UL << (n))
+#define OUTPUT_PB(n) (1UL << (8 + (n)))
+#define OUTPUT_PC(n) (1UL << (16 + (n)))
+#define OUTPUT_PD(n) (1UL << (24 + (n)))
+
+#define ONE       OUTPUT_PA(1)
+#define TWO       OUTPUT_PA(2)
+#define THREE     OUTPUT_PA(3)
+#define FOUR      OUTPUT_PA(4)
+#define FIVE      OUTPUT_PA(5)
+#define SIX       OUTPUT_PA(6)
+#define SEVEN     OUTPUT_PA(7)
+#define EIGHT     OUTPUT_PB(0)
+#define NINE      OUTPUT_PB(1)
+#define TEN       OUTPUT_PB(4)
+#define ELEVEN    OUTPUT_PB(3)
+#define TWELVE    OUTPUT_PC(2)
+#define FIVE_MIN  OUTPUT_PC(3)
+#define TEN_MIN   OUTPUT_PC(4)
+#define QUARTER   OUTPUT_PC(5)
+#define TWENTY    OUTPUT_PC(6)
+#define HALF      OUTPUT_PC(7)
+#define PAST      OUTPUT_PD(4)
+#define TO        OUTPUT_PD(5)
+#define OCLOCK    OUTPUT_PD(6)
+/** @} */
 
 #endif
@@ -0,0 +1,20 @@
+/**
+ * @file
+ *
+ * @brief Host stand-in for avr-libc's <avr/eeprom.h>.
+ *
+ * EEMEM variables are ordinary variables, so the "EEPROM" starts as zeros and
+ * lasts until the program exits.
+ */
+
+#ifndef posix_avr_eeprom_h_INCLUDED
+#define posix_avr_eeprom_h_INCLUDED
+
+#include <stdint.h>
+
+#define EEMEM
+
+#define eeprom_read_byte(p)      (*(const volatile uint8_t *)(p))
+#define eeprom_update_byte(p, v) (*(volatile uint8_t *)(p) = (v))
+
+#endif
@@ -0,0 +1,31 @@
+/**
+ * @file
+ *
+ * @brief Host stand-in for avr-libc's <avr/interrupt.h>.
+ *
+ * The global interrupt flag is the I bit in the simulated SREG, exactly as on
+ * the AVR, so the "sreg = SREG; cli(); ... SREG = sreg;" idiom works
+ * unchanged.  Simulated interrupts that arrive while the I bit is clear are
+ * held pending, and run when sei() sets it again.
+ */
+
+#ifndef posix_avr_interrupt_h_INCLUDED
+#define posix_avr_interrupt_h_INCLUDED
+
+#include <avr/io.h>
+
+void posix_run_pending(void);
+extern volatile uint8_t posix_pending;
+
+#define cli() do { SREG &= ~(1 << SREG_I); } while (0)
+#define sei()						\
+	do {						\
+		SREG |= (1 << SREG_I);			\
+		if (posix_pending)			\
+			posix_run_pending();		\
+	} while (0)
+
+#define SIGNAL(vector) void vector(void)
+#define ISR(vector) void vector(void)
+
+#endif
@@ -0,0 +1,129 @@
+/**
+ * @file
+ *
+ * @brief Host stand-in for avr-libc's <avr/io.h>.
+ *
+ * The I/O registers used by the wordclock are plain variables, defined in
+ * bsp-posix.c.  The simulated peripherals in bsp-posix.c watch those variables
+ * and call the interrupt handlers, in the same way that the real hardware
+ * would.
+ *
+ * Only the registers and bits that the wordclock uses are here.  Bit numbers
+ * match the ATmega32.
+ */
+
+#ifndef posix_avr_io_h_INCLUDED
+#define posix_avr_io_h_INCLUDED
+
+#include <stdint.h>
+
+
+extern volatile uint8_t SREG;
+#define SREG_I 7
+
+extern volatile uint8_t MCUCSR;
+#define JTD   7
+#define ISC2  6
+#define JTRF  4
+#define WDRF  3
+#define BORF  2
+#define EXTRF 1
+#define PORF  0
+
+extern volatile uint8_t GICR;
+#define INT1 7
+#define INT0 6
+#define INT2 5
+
+extern volatile uint8_t PORTA, DDRA, PINA;
+extern volatile uint8_t PORTB, DDRB, PINB;
+extern volatile uint8_t PORTC, DDRC, PINC;
+extern volatile uint8_t PORTD, DDRD, PIND;
+
+/* Timer 0 */
+extern volatile uint8_t TCCR0, OCR0, TIMSK, TIFR;
+#define FOC0  7
+#define WGM00 6
+#define COM01 5
+#define COM00 4
+#define WGM01 3
+#define CS02  2
+#define CS01  1
+#define CS00  0
+#define OCIE0 1
+#define OCIE1A 4
+#define OCF1A  4
+
+/* Timer 1 */
+extern volatile uint8_t TCCR1A, TCCR1B;
+extern volatile uint16_t TCNT1, OCR1A;
+#define CS12  2
+#define CS11  1
+#define CS10  0
+
+/* Timer 2, only so that WORDCLOCK_TWI_TIMING builds.  It doesn't count. */
+extern volatile uint8_t TCCR2, TCNT2;
+#define CS22  2
+#define CS21  1
+#define CS20  0
+
+/* USART */
+extern volatile uint8_t UBRRH, UBRRL, UCSRA, UCSRB, UCSRC;
+/**
+ * The USART data register is wider than the real one so that the simulation
+ * can tell when the transmit interrupt handler has written a byte.  The
+ * simulation stores a value above 0xff before calling the handler.
+ */
+extern volatile uint16_t UDR;
+#define RXC   7
+#define TXC   6
+#define UDRE  5
+#define FE    4
+#define DOR   3
+#define PE    2
+#define U2X   1
+#define MPCM  0
+#define RXCIE 7
+#define TXCIE 6
+#define UDRIE 5
+#define RXEN  4
+#define TXEN  3
+#define UCSZ2 2
+#define RXB8  1
+#define TXB8  0
+#define URSEL 7
+#define UMSEL 6
+#define UPM1  5
+#define UPM0  4
+#define USBS  3
+#define UCSZ1 2
+#define UCSZ0 1
+#define UCPOL 0
+
+/* TWI */
+extern volatile uint8_t TWBR, TWSR, TWDR, TWAR;
+/**
+ * The TWI control register is wider than the real one for the same reason as
+ * UDR.  When the simulated hardware sets TWINT it also sets bit 8, so that a
+ * write from the firmware (which clears bit 8) can be told apart.
+ */
+extern volatile uint16_t TWCR;
+/** Polled code must test TWINT with this, see twi.c. */
+#define TWINT_IS_SET() (TWCR & 0x100)
+#define TWINT 7
+#define TWEA  6
+#define TWSTA 5
+#define TWSTO 4
+#define TWWC  3
+#define TWEN  2
+#define TWIE  0
+
+/* Interrupt vectors, called by the peripheral simulation. */
+void TIMER0_COMP_vect(void);
+void TIMER1_COMPA_vect(void);
+void INT2_vect(void);
+void TWI_vect(void);
+void USART_RXC_vect(void);
+void USART_UDRE_vect(void);
+
+#endif
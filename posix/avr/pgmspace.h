@@ -0,0 +1,35 @@
+/**
+ * @file
+ *
+ * @brief Host stand-in for avr-libc's <avr/pgmspace.h>.
+ *
+ * There is only one address space on the host, so "program memory" is
+ * ordinary read-only data.
+ */
+
+#ifndef posix_avr_pgmspace_h_INCLUDED
+#define posix_avr_pgmspace_h_INCLUDED
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#define PROGMEM
+#define PGM_P const char *
+#define PSTR(s) (s)
+
+#define pgm_read_byte_near(addr) (*(const uint8_t *)(addr))
+#define pgm_read_byte(addr)      pgm_read_byte_near(addr)
+#define pgm_read_word_near(addr) (*(const uint16_t *)(addr))
+#define pgm_read_word(addr)      pgm_read_word_near(addr)
+#define pgm_read_dword(addr)     (*(const uint32_t *)(addr))
+
+#define strncasecmp_P(s1, s2, n) strncasecmp((s1), (s2), (n))
+#define strcasecmp_P(s1, s2)     strcasecmp((s1), (s2))
+#define strcmp_P(s1, s2)         strcmp((s1), (s2))
+#define strncmp_P(s1, s2, n)     strncmp((s1), (s2), (n))
+#define strlen_P(s)              strlen(s)
+#define memcpy_P(d, s, n)        memcpy((d), (s), (n))
+#define strcpy_P(d, s)           strcpy((d), (s))
+
+#endif
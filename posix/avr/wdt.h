@@ -0,0 +1,32 @@
+/**
+ * @file
+ *
+ * @brief Host stand-in for avr-libc's <avr/wdt.h>.
+ *
+ * The watchdog is simulated in bsp-posix.c, counting milliseconds of the
+ * simulated clock.
+ */
+
+#ifndef posix_avr_wdt_h_INCLUDED
+#define posix_avr_wdt_h_INCLUDED
+
+#include <stdint.h>
+
+#define WDTO_15MS  0
+#define WDTO_30MS  1
+#define WDTO_60MS  2
+#define WDTO_120MS 3
+#define WDTO_250MS 4
+#define WDTO_500MS 5
+#define WDTO_1S    6
+#define WDTO_2S    7
+
+void posix_wdt_enable(uint8_t timeout);
+void posix_wdt_disable(void);
+void posix_wdt_reset(void);
+
+#define wdt_enable(timeout) posix_wdt_enable(timeout)
+#define wdt_disable()       posix_wdt_disable()
+#define wdt_reset()         posix_wdt_reset()
+
+#endif
@@ -0,0 +1,15 @@
+/**
+ * @file
+ *
+ * @brief Host stand-in for avr-libc's <util/delay.h>.
+ */
+
+#ifndef posix_util_delay_h_INCLUDED
+#define posix_util_delay_h_INCLUDED
+
+#include <unistd.h>
+
+#define _delay_ms(ms) usleep((useconds_t)((ms) * 1000))
+#define _delay_us(us) usleep((useconds_t)(us))
+
+#endif
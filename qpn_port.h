@@ -30,11 +30,21 @@
 
 #define Q_ROM                   PROGMEM
 #define Q_ROM_BYTE(rom_var_)    pgm_read_byte_near(&(rom_var_))
+#ifdef __AVR
 #define Q_ROM_PTR(rom_var_)     pgm_read_word_near(&(rom_var_))
+#else
+/* On the host (bsp-posix.c) ROM pointers are ordinary 32 bit pointers. */
+#define Q_ROM_PTR(rom_var_)     (rom_var_)
+#endif
 
 #define Q_NFSM
+#ifdef __AVR
 #define Q_PARAM_SIZE            2 /* The wordclock event has an extra
 				     parameter. */
+#else
+#define Q_PARAM_SIZE            4 /* Event parameters carry pointers, and the
+				     host build is 32 bit. */
+#endif
 #define QF_TIMEEVT_CTR_SIZE     2 /* 16 bit time counter for wordclock. */
 
 /* maximum # active objects--must match EXACTLY the QF_active[] definition  */
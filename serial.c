@@ -1,14 +1,23 @@
 #include "wordclock.h"
 #include "serial.h"
 #include "commander.h"
+#include "bsp.h"
+#include "format.h"
+#include "ring.h"
 #include "wordclock-signals.h"
 #include <avr/wdt.h>
+#include <avr/eeprom.h>
 #include "cpu-speed.h"
 #include <util/delay.h>
+#include <string.h>
+#include <stdarg.h>
 
 
 Q_DEFINE_THIS_FILE;
 
+/** This file's number in binary trace IDs, see ST(). */
+#define TRACE_FILE 4
+
 
 #ifdef WORDCLOCK_TRACING
 uint8_t trace = 1;
@@ -21,15 +30,42 @@ void traceon(void) { trace = 1; }
 void traceoff(void) { trace = 0; }
 uint8_t tracing(void) { return trace; }
 
+/**
+ * The baud rates we can use.
+ *
+ * The 3.6864MHz clock divides exactly to all of these with U2X=0, which keeps
+ * the receiver's sixteen samples per bit, so U2X isn't needed.  UBRR is
+ * ClockIO / (16 * baud) - 1 (doc8161.pdf, p179 and p203).
+ */
+static const struct {
+	uint8_t ubrr;
+	char name[7];
+} Q_ROM baudrates[SERIAL_BAUDS] = {
+	{ 23, "9600" },
+	{ 11, "19200" },
+	{  5, "38400" },
+	{  3, "57600" },
+	{  1, "115200" },
+	{  0, "230400" },
+};
+
+/** Index into baudrates[] of the current rate. */
+static uint8_t baudindex;
+
+/** The saved baud rate index, and its complement as a check. */
+static uint8_t EEMEM eebaud[2];
+
+
 void
 serial_init(void)
 {
 	cli();
 
-	/* Set the baud rate.  ClockIO = 3.6864MHz, baud = 38400.
-	   doc8161.pdf, p179 and p203. */
+	/* Always start at the default rate, so the boot banner goes out at a
+	   known rate.  See serial_use_saved_baud(). */
 	UBRRH = 0;
-	UBRRL = 5;
+	UBRRL = Q_ROM_BYTE(baudrates[SERIAL_BAUD_DEFAULT].ubrr);
+	baudindex = SERIAL_BAUD_DEFAULT;
 
 	/* Ensure that U2X=0. */
 	UCSRA = 0;
@@ -58,9 +94,94 @@ serial_init(void)
 }
 
 
+/**
+ * @brief The number of bytes that can be queued on the urgent channel.
+ *
+ * Command replies, error reports and everything else sent with S() and
+ * serial_send() go here.  There must be room for a command's reply, including
+ * the "Processing:" echo of a full line.  This must be a power of two, no
+ * more than 128, see ring.h.
+ */
+#ifndef SEND_URGENT_SIZE
+#define SEND_URGENT_SIZE 128
+#endif
+
+/**
+ * @brief The number of bytes that can be queued on the bulk channel.
+ *
+ * Trace output goes here.  This needs to be a reasonable size, since with
+ * tracing on we send output several times per second.  If the buffer is too
+ * small, we will lose trace data.  (Lost data is indicated by the '!'
+ * character - see serial_send_char().)  This must be a power of two, no more
+ * than 128.
+ */
+#ifndef SEND_BULK_SIZE
+#define SEND_BULK_SIZE 128
+#endif
+
+/**
+ * @brief The number of bytes that can be queued on the telemetry channel.
+ *
+ * Telemetry records are short and binary, and are only sent in framed mode.
+ */
+#ifndef SEND_TELEMETRY_SIZE
+#define SEND_TELEMETRY_SIZE 32
+#endif
+
+Q_ASSERT_COMPILE(RING_SIZE_OK(SEND_URGENT_SIZE));
+Q_ASSERT_COMPILE(RING_SIZE_OK(SEND_BULK_SIZE));
+Q_ASSERT_COMPILE(RING_SIZE_OK(SEND_TELEMETRY_SIZE));
+
+
+/**
+ * One output channel.
+ *
+ * Task level code stages bytes past the ring's head.  They only become
+ * visible to the interrupt handler when they are committed, which is done at
+ * the end of each line (and for each binary trace record), so the channels
+ * are interleaved a line at a time.
+ */
+struct SendChannel {
+	struct Ring ring;
+	/** The number of bytes staged and not yet committed.  Only used by
+	    task level code. */
+	uint8_t pending;
+	/** The number of sends cut short or lost for lack of space. */
+	uint16_t drops;
+};
+
+static char urgentbuffer[SEND_URGENT_SIZE];
+static char telemetrybuffer[SEND_TELEMETRY_SIZE];
+static char bulkbuffer[SEND_BULK_SIZE];
+
+/** In priority order, see USART_UDRE_vect(). */
+static struct SendChannel channels[SERIAL_CHANNELS] = {
+	[SERIAL_URGENT]    = { RING_INIT(urgentbuffer),    0, 0 },
+	[SERIAL_TELEMETRY] = { RING_INIT(telemetrybuffer), 0, 0 },
+	[SERIAL_BULK]      = { RING_INIT(bulkbuffer),      0, 0 },
+};
+
+#define URGENT    (&channels[SERIAL_URGENT])
+#define TELEMETRY (&channels[SERIAL_TELEMETRY])
+#define BULK      (&channels[SERIAL_BULK])
+
+
+static int send_block(struct SendChannel *ch,
+		      const char *s, uint8_t len, uint8_t flags);
+
+/** send_block() flag: the data is in program memory. */
+#define SEND_ROM   0x01
+/** send_block() flag: send all of the data or none of it. */
+#define SEND_WHOLE 0x02
+
+
 /**
  * @brief Send a string from data memory out the serial port.
  *
+ * The string goes on the urgent channel, which is always sent before trace
+ * output.  It is sent when a line is finished, so it should end with "\r\n"
+ * (possibly after more calls).
+ *
  * If the serial send buffer is close to being overrun, we send a '!' character
  * and stop.  The '!' is not included in the character count.
  *
@@ -71,22 +192,18 @@ serial_init(void)
  */
 int serial_send(const char *s)
 {
-	int sent = 0;
+	size_t len = strlen(s);
 
-	while (*s) {
-		if (serial_send_char(*s++)) {
-			sent++;
-		} else {
-			break;
-		}
-	}
-	return sent;
+	return send_block(URGENT, s, len > 255 ? 255 : len, 0);
 }
 
 
 int serial_trace(const char *s) {
-	if (trace) return serial_send(s);
-	else return 0;
+	size_t len;
+
+	if (! trace) return 0;
+	len = strlen(s);
+	return send_block(BULK, s, len > 255 ? 255 : len, 0);
 }
 
 
@@ -99,80 +216,105 @@ int serial_trace(const char *s) {
  */
 int serial_send_rom(char const Q_ROM * const Q_ROM_VAR s)
 {
-	char c;
-	int i = 0;
-	int sent = 0;
+	size_t len = strlen_P(s);
 
-	while (1) {
-		c = Q_ROM_BYTE(s[i++]);
-		if (!c) {
-			break;
-		}
-		if (serial_send_char(c)) {
-			sent++;
-		} else {
-			break;
-		}
-	}
-	return sent;
+	return send_block(URGENT, s, len > 255 ? 255 : len, SEND_ROM);
 }
 
 
 int serial_trace_rom(char const Q_ROM * const Q_ROM_VAR s) {
-	if (trace) return serial_send_rom(s);
-	else return 0;
+	size_t len;
+
+	if (! trace) return 0;
+	len = strlen_P(s);
+	return send_block(BULK, s, len > 255 ? 255 : len, SEND_ROM);
 }
 
 
 /**
- * @brief The number of bytes that can be queued for sending.
- *
- * This buffer needs to be a reasonable size, since during development we send
- * output once per second.  If the buffer is too small, we will lose data.
- * (Lost data is indicated by the '!' character - see serial_send_char().)
- *
- * Ideally, make this at least the maximum number of bytes we will ever send
- * inside one second.
- *
- * @note The number of bytes that can actually be queued is one less than this
- * value, due to the way that the ring buffer works.
+ * @brief The number of bytes that can be added to a channel.
  */
-#define SEND_BUFFER_SIZE 120
-
-static char sendbuffer[SEND_BUFFER_SIZE];
-static volatile uint8_t sendhead = 0;
-static volatile uint8_t sendtail = 0;
+static uint8_t
+channel_space(struct SendChannel *ch)
+{
+	return ring_free(&ch->ring) - ch->pending;
+}
 
 
-static uint8_t
-sendbuffer_space(void)
+/**
+ * @brief Let the interrupt handler send everything queued on a channel.
+ */
+static void
+channel_publish(struct SendChannel *ch)
 {
-	if (sendhead == sendtail) {
-		return SEND_BUFFER_SIZE - 1;
-	} else if (sendhead > sendtail) {
-		return SEND_BUFFER_SIZE - 1 - (sendhead - sendtail);
-	} else {
-		/* sendhead < sendtail */
-		return sendtail - sendhead - 1;
-	}
+	ring_commit(&ch->ring, ch->pending);
+	ch->pending = 0;
+	/* This is a single sbi instruction, so it's safe from the interrupt
+	   handler clearing UDRIE at the same time. */
+	UCSRB |= (1 << UDRIE);
 }
 
 
 /**
- * @brief Put one character into the serial send buffer.
+ * @brief Put a block of characters into a channel's send buffer.
+ *
+ * The space is worked out once and the characters are staged in the ring.
+ * Only task level code adds to the rings, so none of this needs interrupts
+ * off.  An interrupt handler must not send anything this way, as it could
+ * stage over the pending bytes of a send it interrupted.  fff() reports
+ * through serial_assert() for that reason.
  *
- * We assume that the buffer has already been checked for space.
+ * The block is handed to the interrupt handler if it ends a line, if it is a
+ * binary trace record, or if it didn't fit.
  *
- * Interrupts should be off when calling this function.
+ * If the block doesn't fit, as much as fits is sent, followed by a '!', and
+ * the channel's drop count goes up.  With SEND_WHOLE in @e flags, only the '!'
+ * is sent.  That's for binary trace records, which are no use cut short.
+ *
+ * @param flags SEND_ROM if @e s is in program memory, and SEND_WHOLE
+ *
+ * @return the number of characters from @e s that were put into the buffer,
+ * not counting any '!'.
  */
-static void
-put_into_buffer(char c)
+static int send_block(struct SendChannel *ch,
+		      const char *s, uint8_t len, uint8_t flags)
 {
-	sendbuffer[sendhead] = c;
-	sendhead++;
-	if (sendhead >= SEND_BUFFER_SIZE)
-		sendhead = 0;
-	UCSRB |= (1 << UDRIE);
+	uint8_t space;
+	uint8_t n;
+	char last;
+
+	if (! len) {
+		return 0;
+	}
+	space = channel_space(ch);
+	if (! space) {
+		ch->drops++;
+		return 0;
+	}
+	if (len < space) {
+		n = len;
+	} else {
+		/* Leave room for the '!'. */
+		n = (flags & SEND_WHOLE) ? 0 : space - 1;
+	}
+	if (flags & SEND_ROM) {
+		ring_stage_P(&ch->ring, ch->pending, s, n);
+	} else {
+		ring_stage(&ch->ring, ch->pending, s, n);
+	}
+	ch->pending += n;
+	if (n < len) {
+		ring_stage_byte(&ch->ring, ch->pending, '!');
+		ch->pending++;
+		ch->drops++;
+		channel_publish(ch);
+		return n;
+	}
+	last = (flags & SEND_ROM) ? pgm_read_byte(s + len - 1) : s[len - 1];
+	if ('\n' == last || (flags & SEND_WHOLE)) {
+		channel_publish(ch);
+	}
+	return n;
 }
 
 
@@ -195,44 +337,482 @@ put_into_buffer(char c)
  */
 int serial_send_char(char c)
 {
-	int available;
-	int sent;
-	uint8_t sreg;
+	return send_block(URGENT, &c, 1, 0);
+}
 
-	sreg = SREG;
-	cli();
-	available = sendbuffer_space();
-	if (available >= 1) {
-		if (available == 1) {
-			put_into_buffer('!');
-			sent = 0;
-		} else {
-			put_into_buffer(c);
-			sent = 1;
+
+/**
+ * @brief Send one byte straight away, without waiting for the end of a line.
+ *
+ * This is for the status bytes that answer binary commands.
+ *
+ * @return 1 if the byte was put into the buffer, 0 otherwise.
+ */
+int serial_send_byte(uint8_t b)
+{
+	return send_block(URGENT, (const char *)&b, 1, SEND_WHOLE);
+}
+
+
+/**
+ * Adds characters to a channel one at a time, from a single reservation of
+ * space.  See channel_printf().
+ */
+struct ChannelWriter {
+	struct SendChannel *ch;
+	/** Where the next byte goes, past the ring's head. */
+	uint8_t pending;
+	/** Space left, including the byte kept for a '!'. */
+	uint8_t space;
+	/** The number of characters written. */
+	uint8_t n;
+	/** Set if some output didn't fit. */
+	uint8_t overflow;
+	char last;
+};
+
+
+static void writer_put(struct ChannelWriter *w, char c)
+{
+	if (w->space <= 1) {
+		w->overflow = 1;
+		return;
+	}
+	ring_stage_byte(&w->ch->ring, w->pending, c);
+	w->pending++;
+	w->space--;
+	w->n++;
+	w->last = c;
+}
+
+
+static void writer_put_buf(struct ChannelWriter *w, const char *s, uint8_t n)
+{
+	while (n--) {
+		writer_put(w, *s++);
+	}
+}
+
+
+/**
+ * @brief Format straight into a channel's buffer.
+ *
+ * The space is worked out once at the start, like send_block(), and what
+ * doesn't fit is replaced by a '!'.  The output is handed to the interrupt
+ * handler if it ends a line or didn't fit.
+ *
+ * @see serial_printf_P() for the conversions.
+ */
+static int channel_printf(struct SendChannel *ch, PGM_P fmt, va_list ap)
+{
+	struct ChannelWriter w;
+	char buf[FORMAT_TIME_MAX];
+	uint8_t width;
+	char c;
+	PGM_P rs;
+	const char *s;
+	int d;
+
+	w.ch = ch;
+	w.pending = ch->pending;
+	w.space = channel_space(ch);
+	w.n = 0;
+	w.overflow = 0;
+	w.last = '\0';
+	if (! w.space) {
+		ch->drops++;
+		return 0;
+	}
+	while ((c = pgm_read_byte(fmt++))) {
+		if ('%' != c) {
+			writer_put(&w, c);
+			continue;
+		}
+		c = pgm_read_byte(fmt++);
+		width = 0;
+		if ('0' == c) {
+			c = pgm_read_byte(fmt++);
+		}
+		if (c >= '1' && c <= '0' + FORMAT_UINT_MAX) {
+			width = c - '0';
+			c = pgm_read_byte(fmt++);
+		}
+		switch (c) {
+		case 'u':
+			writer_put_buf(&w, buf, format_uint_padded(
+					       buf, va_arg(ap, unsigned int),
+					       width));
+			break;
+		case 'd':
+			d = va_arg(ap, int);
+			if (d < 0) {
+				writer_put(&w, '-');
+				d = -d;
+			}
+			writer_put_buf(&w, buf, format_uint_padded(
+					       buf, (uint16_t)d, width));
+			break;
+		case 'x':
+			writer_put_buf(&w, buf,
+				       format_hex(buf, va_arg(ap, unsigned int)));
+			break;
+		case 'b':
+			writer_put_buf(&w, buf, format_bcd(
+					       buf, (uint8_t)va_arg(ap, unsigned int)));
+			break;
+		case 'T':
+			writer_put_buf(&w, buf, format_time(
+					       buf, va_arg(ap, const uint8_t *)));
+			break;
+		case 'S':
+			rs = va_arg(ap, PGM_P);
+			while ((c = pgm_read_byte(rs++))) {
+				writer_put(&w, c);
+			}
+			break;
+		case 's':
+			s = va_arg(ap, const char *);
+			while (*s) {
+				writer_put(&w, *s++);
+			}
+			break;
+		case 'c':
+			writer_put(&w, (char)va_arg(ap, int));
+			break;
+		case '\0':
+			/* A '%' at the end. */
+			fmt--;
+			break;
+		default:
+			writer_put(&w, c);
+			break;
 		}
-	} else {
-		sent = 0;
 	}
-	SREG = sreg;
-	return sent;
+	if (w.overflow) {
+		ring_stage_byte(&ch->ring, w.pending, '!');
+		w.pending++;
+		ch->drops++;
+	}
+	ch->pending = w.pending;
+	if (w.overflow || '\n' == w.last) {
+		channel_publish(ch);
+	}
+	return w.n;
+}
+
+
+/**
+ * @brief Send formatted output, with the format string in program memory.
+ *
+ * The whole output is put into the send buffer in one go, so a line made up
+ * of text and numbers costs one call rather than one for each part.  Use it
+ * through SF(), which puts the format string in program memory.
+ *
+ * The conversions are:
+ *
+ * - %%u unsigned decimal, and %%d signed decimal;
+ *
+ * - %%x hex, upper case, without leading zeros;
+ *
+ * - %%b a BCD byte (such as a DS1307 register), as two digits;
+ *
+ * - %%T a time, from a pointer to the DS1307 seconds, minutes and hours
+ *   registers, see format_time();
+ *
+ * - %%S a string in program memory, and %%s a string in data memory;
+ *
+ * - %%c a character, and %%%% a '%'.
+ *
+ * %%u and %%d can have a width of 1 to 5 digits, as in %%02u, and are padded
+ * with leading zeros (with or without the 0).  There are no other flags.
+ *
+ * @return the number of characters sent, not counting any '!'.
+ */
+int serial_printf_P(PGM_P fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = channel_printf(URGENT, fmt, ap);
+	va_end(ap);
+	return n;
+}
+
+
+/**
+ * @brief Send formatted trace output on the bulk channel, if tracing is on.
+ *
+ * @see serial_printf_P()
+ */
+int serial_trace_printf_P(PGM_P fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (! trace) return 0;
+	va_start(ap, fmt);
+	n = channel_printf(BULK, fmt, ap);
+	va_end(ap);
+	return n;
+}
+
+
+/**
+ * @brief The room for more on the urgent channel, in bytes.
+ */
+uint8_t serial_send_space(void)
+{
+	return channel_space(URGENT);
+}
+
+
+/**
+ * @brief The number of sends on a channel that were cut short or lost.
+ *
+ * @param channel SERIAL_URGENT, SERIAL_TELEMETRY or SERIAL_BULK
+ */
+uint16_t serial_drops(uint8_t channel)
+{
+	return channels[channel].drops;
+}
+
+
+/**
+ * Active objects waiting for SERIAL_DRAINED_SIGNAL, one bit each.  Bit 0 is
+ * priority 1.
+ */
+static volatile uint8_t drainwaiters = 0;
+
+/** Set once the event loop is running, after which serial_drain() is not
+    allowed. */
+static uint8_t qfstarted = 0;
+
+
+/**
+ * Post SERIAL_DRAINED_SIGNAL to each active object waiting for it, from the
+ * transmit interrupt handler.
+ */
+static void post_drained(void)
+{
+	uint8_t waiters = drainwaiters;
+	uint8_t p;
+
+	drainwaiters = 0;
+	for (p = 1; waiters; p++, waiters >>= 1) {
+		if (waiters & 1) {
+			QActive *ao = (QActive *)Q_ROM_PTR(QF_active[p].act);
+			fff(ao);
+			QActive_postISR(ao, SERIAL_DRAINED_SIGNAL, 0);
+		}
+	}
+}
+
+
+/**
+ * @name Framed mode
+ *
+ * In framed mode each run of output from one channel (one or more lines, or
+ * a binary record) is sent as a SLIP frame (RFC 1055): the channel number, the bytes,
+ * and a CRC-8 of those, with SLIP_END and SLIP_ESC escaped, between two
+ * SLIP_END bytes.  Commands are received the same way, on channel
+ * SERIAL_URGENT.  tools/wcframe.h is the host side.
+ * @{
+ */
+#define SLIP_END     0xc0
+#define SLIP_ESC     0xdb
+#define SLIP_ESC_END 0xdc
+#define SLIP_ESC_ESC 0xdd
+
+/** Set by serial_framed().  The transmit interrupt handler takes this up
+    between runs. */
+static volatile uint8_t framedwanted = 0;
+
+/** The framing of the run being sent. */
+static uint8_t txframed;
+
+/** Where the transmit interrupt handler is in a frame. */
+static uint8_t txstate;
+#define TX_CHANNEL 0
+#define TX_DATA    1
+#define TX_CRC     2
+#define TX_END     3
+
+/** The second byte of an escape, still to be sent, or 0. */
+static uint8_t txescape;
+
+/** The CRC of the frame so far. */
+static uint8_t txcrc;
+
+/**
+ * @brief The most data bytes in one frame from the bulk channel.
+ *
+ * A longer run from the bulk channel goes in several frames, and the urgent
+ * channel gets a look in between them.  So urgent output waits for at most
+ * this many bytes and the five around them, about 10ms at 38400 baud (18ms
+ * if every byte needs escaping), or for one telemetry frame.
+ */
+#ifndef SEND_FRAME_BULK_MAX
+#define SEND_FRAME_BULK_MAX 32
+#endif
+Q_ASSERT_COMPILE(SEND_FRAME_BULK_MAX > 0 && SEND_FRAME_BULK_MAX < 256);
+
+/** The data bytes left in this frame, see SEND_FRAME_BULK_MAX.  From 0, it
+    wraps round to more than any ring holds, so there's no limit. */
+static uint8_t txleft;
+/** @} */
+
+
+/**
+ * @brief Send a binary telemetry record, in framed mode only.
+ *
+ * The record goes whole, in its own frame on the telemetry channel, or not at
+ * all.
+ *
+ * @return the number of bytes sent, or 0.
+ */
+int serial_send_telemetry(const void *data, uint8_t len)
+{
+	if (! framedwanted) return 0;
+	return send_block(TELEMETRY, data, len, SEND_WHOLE);
+}
+
+
+/**
+ * Add a byte to a CRC-8 (polynomial 0x07, starting at 0), four bits at a time.
+ *
+ * This is the same CRC as avr-libc's _crc8_ccitt_update(), in about 20 cycles
+ * rather than 60.  A frame followed by its CRC has a CRC of 0.
+ */
+static uint8_t crc8_update(uint8_t crc, uint8_t data)
+{
+	static const uint8_t Q_ROM table[16] = {
+		0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15,
+		0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d,
+	};
+
+	crc ^= data;
+	crc = (uint8_t)(crc << 4) ^ Q_ROM_BYTE(table[crc >> 4]);
+	crc = (uint8_t)(crc << 4) ^ Q_ROM_BYTE(table[crc >> 4]);
+	return crc;
+}
+
+
+#define XON  0x11
+#define XOFF 0x13
+
+/** XON or XOFF to send before anything else, or 0.  See send_flow(). */
+static volatile uint8_t txflow = 0;
+
+/** The channel the interrupt handler is sending from, or null. */
+static struct SendChannel *sending = 0;
+
+/** Where the interrupt handler will stop sending from that channel. */
+static uint8_t sendstop;
+
+
+/**
+ * The next byte of a frame from the sending channel.
+ */
+static void send_framed(struct SendChannel *ch)
+{
+	uint8_t c;
+
+	if (txescape) {
+		UDR = txescape;
+		txescape = 0;
+		return;
+	}
+	switch (txstate) {
+	case TX_CHANNEL:
+		c = (uint8_t)(ch - channels);
+		txstate = TX_DATA;
+		break;
+	case TX_DATA:
+		c = ring_pop(&ch->ring);
+		if (ch->ring.tail == sendstop || ! --txleft)
+			txstate = TX_CRC;
+		break;
+	case TX_CRC:
+		c = txcrc;
+		txstate = TX_END;
+		break;
+	default:
+		sending = 0;
+		UDR = SLIP_END;
+		return;
+	}
+	txcrc = crc8_update(txcrc, c);
+	if (SLIP_END == c) {
+		txescape = SLIP_ESC_END;
+		c = SLIP_ESC;
+	} else if (SLIP_ESC == c) {
+		txescape = SLIP_ESC_ESC;
+		c = SLIP_ESC;
+	}
+	UDR = c;
 }
 
 
+/**
+ * Send the next byte.
+ *
+ * Between runs of ready bytes, the channels are tried in priority order:
+ * urgent, telemetry, then bulk.  The handler then stays with the chosen
+ * channel up to the end of the bytes that were ready when it chose, or the
+ * end of the first line of them, so the channels are only interleaved at line
+ * ends.  Urgent output waits for at most the rest of one bulk line.  Binary
+ * trace records can contain '\n', so with WORDCLOCK_TRACE_BINARY the run goes
+ * on to the end of the ready bytes, and urgent output can wait for a full bulk
+ * buffer, about 30ms at 38400 baud.  In framed mode, see SEND_FRAME_BULK_MAX.
+ * XON and XOFF go straight away, even in the middle of a line.
+ */
 SIGNAL(USART_UDRE_vect)
 {
-	char c;
+	struct SendChannel *ch;
+	uint8_t c;
 
 	//TOGGLE_ON();
 
-	if (sendhead == sendtail) {
-		UCSRB &= ~ (1 << UDRIE);
-	} else {
-		c = sendbuffer[sendtail];
-		sendtail++;
-		if (sendtail >= SEND_BUFFER_SIZE)
-			sendtail = 0;
-		UDR = c;
+	if (txflow) {
+		UDR = txflow;
+		txflow = 0;
+		return;
+	}
+	ch = sending;
+	if (! ch) {
+		for (ch = channels; ! ring_used(&ch->ring); ) {
+			if (++ch == channels + SERIAL_CHANNELS) {
+				UCSRB &= ~ (1 << UDRIE);
+				if (drainwaiters) {
+					post_drained();
+				}
+				return;
+			}
+		}
+		sending = ch;
+		sendstop = ch->ring.head;
+		txframed = framedwanted;
+		if (txframed) {
+			txstate = TX_CHANNEL;
+			txcrc = 0;
+			txleft = (BULK == ch) ? SEND_FRAME_BULK_MAX : 0;
+			UDR = SLIP_END;
+			return;
+		}
+	}
+	if (txframed) {
+		send_framed(ch);
+		return;
 	}
+	c = ring_pop(&ch->ring);
+	if (ch->ring.tail == sendstop)
+		sending = 0;
+#ifndef WORDCLOCK_TRACE_BINARY
+	if ('\n' == c)
+		sending = 0;
+#endif
+	UDR = c;
 }
 
 
@@ -245,17 +825,50 @@ serial_send_noint(uint8_t byte)
 }
 
 
+/**
+ * Send everything queued on a channel, without interrupts.
+ */
+static void
+send_channel_noint(struct SendChannel *ch)
+{
+	ring_commit(&ch->ring, ch->pending);
+	ch->pending = 0;
+	while (ring_used(&ch->ring)) {
+		serial_send_noint(ring_pop(&ch->ring));
+	}
+}
+
+
+char const Q_ROM *serial_assert_name = 0;
+
+
+/**
+ * Send an assert message, with the polled sends below, and reset.  The
+ * message is "ASSERT file line", then serial_assert_name if that is set.
+ */
 void serial_assert(char const Q_ROM * const Q_ROM_VAR file, int line)
 {
 	int i;
-	char number[10];
+	uint8_t n;
+	char number[FORMAT_UINT_MAX];
 
 	/* Turn off everything. */
 	cli();
 	wdt_reset();
 	wdt_disable();
 
-	/* Rashly assume that the UART is configured. */
+	/* Rashly assume that the UART is configured.  Send what's already in
+	   the buffers first, since it often says what went wrong.  Finish the
+	   line being sent, then the urgent channel.  In framed mode all of
+	   this goes raw between two SLIP_ENDs, which the host sees as a bad
+	   frame and can show as text.  Telemetry is left out, since it's
+	   binary. */
+	if (framedwanted)
+		serial_send_noint(SLIP_END);
+	if (sending)
+		send_channel_noint(sending);
+	send_channel_noint(URGENT);
+	send_channel_noint(BULK);
 	serial_send_noint('\r');
 	serial_send_noint('\n');
 	serial_send_noint('A');
@@ -275,100 +888,678 @@ void serial_assert(char const Q_ROM * const Q_ROM_VAR file, int line)
 	}
 	serial_send_noint(' ');
 
-	if (line) {
-		char *cp = number+9;
-		*cp = '\0';
-		while (line) {
-			int n = line % 10;
-			*--cp = (char)(n+'0');
-			line /= 10;
+	n = format_uint(number, (uint16_t)line);
+	for (i = 0; i < n; i++) {
+		serial_send_noint(number[i]);
+	}
+	if (serial_assert_name) {
+		serial_send_noint(' ');
+		for (i = 0; Q_ROM_BYTE(serial_assert_name[i]); i++) {
+			serial_send_noint(Q_ROM_BYTE(serial_assert_name[i]));
 		}
-		while (*cp) {
-			serial_send_noint(*cp++);
-		}
-	} else {
-		serial_send_noint('0');
 	}
 	serial_send_noint('\r');
 	serial_send_noint('\n');
+	if (framedwanted)
+		serial_send_noint(SLIP_END);
 
-	while (1) {
-		_delay_ms(10);
-	}
+	/* Let the watchdog reset us.  main() will find the state saved by the
+	   wordclock and carry on from there. */
+	wdt_enable(WDTO_15MS);
+	while (1)
+		;
+}
+
+
+static int send_int(struct SendChannel *ch, unsigned int n)
+{
+	char buf[FORMAT_UINT_MAX];
+
+	return send_block(ch, buf, format_uint(buf, n), 0);
 }
 
 
 int serial_send_int(unsigned int n)
 {
-	char buf[10];
-	char *bufp;
+	return send_int(URGENT, n);
+}
 
-	bufp = buf + 9;
-	*bufp = '\0';
-	if (0 == n) {
-		bufp--;
-		*bufp = '0';
-	} else {
-		while (n) {
-			int nn = n % 10;
-			bufp--;
-			*bufp = (char)(nn + '0');
-			n /= 10;
+
+#ifdef WORDCLOCK_TRACE_BINARY
+
+/**
+ * Put a 16 bit value in a binary trace record, low byte first.  A byte that
+ * is XON, XOFF or TRACE_RECORD_ESC goes as TRACE_RECORD_ESC and the byte
+ * with bit 5 flipped, see serial.h.
+ *
+ * @return the number of bytes written, 2 to 4
+ */
+static uint8_t record_value(char *p, uint16_t value)
+{
+	uint8_t n = 0;
+	uint8_t i;
+	uint8_t b;
+
+	for (i = 0; i < 2; i++, value >>= 8) {
+		b = value & 0xff;
+		if (XON == b || XOFF == b || TRACE_RECORD_ESC == b) {
+			p[n++] = TRACE_RECORD_ESC;
+			b ^= 0x20;
 		}
+		p[n++] = b;
 	}
-	return serial_send(bufp);
+	return n;
+}
+
+
+/**
+ * Send a binary trace record: a type byte and a 16 bit value.
+ */
+static int trace_record(uint8_t type, uint16_t value)
+{
+	char record[5];
+
+	record[0] = type;
+	return send_block(BULK, record, 1 + record_value(record + 1, value),
+			  SEND_WHOLE);
+}
+
+
+int serial_trace_int(unsigned int n) {
+	if (trace) return trace_record(TRACE_RECORD_INT, n);
+	else return 0;
 }
 
+#else
 
 int serial_trace_int(unsigned int n) {
-	if (trace) return serial_send_int(n);
+	if (trace) return send_int(BULK, n);
 	else return 0;
 }
 
+#endif
+
+
+static int send_hex_int(struct SendChannel *ch, unsigned int x)
+{
+	char buf[4];
+
+	return send_block(ch, buf, format_hex(buf, x), 0);
+}
+
 
 int serial_send_hex_int(unsigned int x)
 {
-	char buf[10];
-	char *bufp;
+	return send_hex_int(URGENT, x);
+}
 
-	static PROGMEM char hexchars[] = "0123456789ABCDEF";
 
-	bufp = buf + 9;
-	*bufp = '\0';
-	if (0 == x) {
-		bufp--;
-		*bufp = '0';
-	} else {
-		while (x) {
-			int xx = x & 0x0f;
-			char c = pgm_read_byte_near(&(hexchars[xx]));
-			bufp--;
-			*bufp = c;
-			x >>= 4;
-		}
+#ifdef WORDCLOCK_TRACE_BINARY
+
+int serial_trace_hex_int(unsigned int x) {
+	if (trace) return trace_record(TRACE_RECORD_HEX, x);
+	else return 0;
+}
+
+
+/**
+ * Send a binary trace record for an ST() site.  See ST().
+ */
+int serial_trace_id(uint16_t id)
+{
+	char record[9];
+	uint8_t n;
+
+	if (! trace) {
+		return 0;
 	}
-	return serial_send(bufp);
+	record[0] = TRACE_RECORD_ID;
+	n = 1 + record_value(record + 1, id);
+	n += record_value(record + n, BSP_ticks());
+	return send_block(BULK, record, n, SEND_WHOLE);
 }
 
+#else
 
 int serial_trace_hex_int(unsigned int x) {
-	if (trace) return serial_send_hex_int(x);
+	if (trace) return send_hex_int(BULK, x);
 	else return 0;
 }
 
+#endif
+
+
+/**
+ * @brief Find a baud rate by name, such as "115200".
+ *
+ * @return the index of the rate, or -1 if there is no such rate.
+ */
+int8_t serial_baud_index(const char *name)
+{
+	int8_t i;
+
+	for (i = 0; i < SERIAL_BAUDS; i++) {
+		if (! strcmp_P(name, baudrates[i].name)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+/** The name of a baud rate, in ROM. */
+PGM_P serial_baud_name(uint8_t index)
+{
+	return baudrates[index].name;
+}
+
+
+/** The index of the current baud rate. */
+uint8_t serial_baud(void)
+{
+	return baudindex;
+}
 
+
+/**
+ * @brief Change the baud rate now.
+ *
+ * Anything still being sent is garbled, so wait for SERIAL_DRAINED_SIGNAL,
+ * and then long enough for the last two bytes to leave the USART, first.
+ */
+void serial_set_baud(uint8_t index)
+{
+	baudindex = index;
+	UBRRH = 0;
+	UBRRL = Q_ROM_BYTE(baudrates[index].ubrr);
+}
+
+
+/**
+ * @brief Save a baud rate in EEPROM, for serial_use_saved_baud().
+ *
+ * This busy waits for the EEPROM writes, about 17ms if the rate has changed.
+ */
+void serial_save_baud(uint8_t index)
+{
+	eeprom_update_byte(&eebaud[0], index);
+	eeprom_update_byte(&eebaud[1], (uint8_t)~index);
+}
+
+
+/**
+ * @brief Change to the saved baud rate, at the end of the boot.
+ *
+ * Call this after the boot banner, before QF_run().  The change is announced
+ * at the default rate first.
+ */
+void serial_use_saved_baud(void)
+{
+	uint8_t index = eeprom_read_byte(&eebaud[0]);
+
+	if ((uint8_t)~index != eeprom_read_byte(&eebaud[1])
+	    || index >= SERIAL_BAUDS || index == baudindex) {
+		return;
+	}
+	SF("Switching to %S baud\r\n", baudrates[index].name);
+	serial_drain();
+	/* The last two bytes can still be in UDR and the shift register, and
+	   take about 0.5ms at 38400 baud. */
+	_delay_ms(1);
+	serial_set_baud(index);
+}
+
+
+/**
+ * @brief Wait until the send buffers are empty.
+ *
+ * This busy waits, and while it does no events are handled, so it may only be
+ * used before QF_run().  Once the event loop is running, use
+ * serial_notify_drained() instead.
+ */
 void serial_drain(void)
 {
-	while (sendhead != sendtail)
-		;
+	uint8_t i;
+
+	Q_ASSERT(! qfstarted);
+	for (i = 0; i < SERIAL_CHANNELS; i++) {
+		channel_publish(&channels[i]);
+		while (ring_used(&channels[i].ring))
+			;
+	}
 }
 
 
-SIGNAL(USART_RXC_vect)
+/**
+ * @brief Ask for SERIAL_DRAINED_SIGNAL when the send buffers are empty.
+ *
+ * The signal is posted to @e ao once, from the transmit interrupt handler,
+ * when it finds nothing ready to send on either channel.  A line that hasn't
+ * been finished yet doesn't count.  That's when the last byte has been
+ * handed to the USART, so it may still be going out on the wire.  If the
+ * buffer is already empty the signal comes straight away.
+ */
+void serial_notify_drained(QActive *ao)
 {
-	uint8_t data;
+	uint8_t sreg;
+
+	sreg = SREG;
+	cli();
+	drainwaiters |= (uint8_t)(1 << (ao->prio - 1));
+	UCSRB |= (1 << UDRIE);
+	SREG = sreg;
+}
+
+
+/**
+ * Note that the event loop is running.  Called from QF_onStartup().
+ */
+void serial_qf_started(void)
+{
+	qfstarted = 1;
+}
+
+
+/**
+ * @brief The number of received bytes that can wait for a free line.
+ *
+ * Received bytes go into this ring, and are taken into a line as long as the
+ * commander has given one back.  While it has both lines, bytes wait here.
+ * This must be a power of two, no more than 128, see ring.h.
+ */
+#ifndef SERIAL_RX_SIZE
+#define SERIAL_RX_SIZE 64
+#endif
+
+Q_ASSERT_COMPILE(RING_SIZE_OK(SERIAL_RX_SIZE));
+
+/**
+ * @name Receive flow control
+ *
+ * In plain text and binary command modes we send XOFF when RX_XOFF_LEVEL bytes are waiting, and
+ * XON when no more than RX_XON_LEVEL are.  That leaves room for the bytes the
+ * sender has in flight when the XOFF arrives (a USB serial adapter can have
+ * a few dozen), so a script can be sent at full speed without losing
+ * anything.  The host must honour XON/XOFF on its output ("stty ixon").
+ *
+ * Framed mode has no flow control, since XON and XOFF can be in binary
+ * frames (sent by us, that is; in binary command mode only the host sends
+ * binary).  A framed host waits for each reply.
+ *
+ * XON and XOFF go out straight away, even in the middle of a binary trace
+ * record (WORDCLOCK_TRACE_BINARY).  Holding them to the end of a run could
+ * take a whole bulk buffer, far too long.  So record values never contain
+ * them (see record_byte()), and tools/tracedecode drops them wherever they
+ * are.
+ * @{
+ */
+#define RX_XOFF_LEVEL (SERIAL_RX_SIZE / 4)
+#define RX_XON_LEVEL  4
+/** @} */
+
+static char rxbuffer[SERIAL_RX_SIZE];
+static struct Ring rxring = RING_INIT(rxbuffer);
+
+/** Set when we have sent XOFF. */
+static uint8_t rxstopped = 0;
+
+/** Receive errors since boot. */
+static struct SerialErrors rxerrors;
+
+
+/**
+ * Lines being received, or waiting for the commander.
+ */
+static struct SerialLine lines[2];
+
+/** Index into lines[] of the line being received. */
+static uint8_t rxline = 0;
+
+/** Set when a frame is being thrown away. */
+static uint8_t rxdiscard = 0;
+
+/** How the receive interrupt handler takes bytes. */
+#define RX_TEXT   0
+#define RX_FRAMED 1
+#define RX_BINARY 2
+static uint8_t rxmode = RX_TEXT;
 
-	data = UDR;
+/** Set after a SLIP_ESC. */
+static uint8_t rxescape;
+
+/** The channel of the frame being received, or RX_NO_CHANNEL before its
+    first byte. */
+#define RX_NO_CHANNEL 0xff
+static uint8_t rxchannel = RX_NO_CHANNEL;
+
+/** The CRC of the frame or packet so far. */
+static uint8_t rxcrc;
+
+/** BSP_stamp() when the last byte arrived. */
+static uint16_t rxstamp;
+/** Set while rx_process() is taking the byte that just arrived, so rxstamp
+    is the arrival of a line that it finishes. */
+static uint8_t rxstampok;
+
+
+static void rx_process(void);
+
+
+/**
+ * Send XON or XOFF ahead of any other output.  Call with interrupts off.
+ */
+static void send_flow(uint8_t c)
+{
+	txflow = c;
+	UCSRB |= (1 << UDRIE);
+}
+
+
+/**
+ * Give a line back to the receive interrupt handler.
+ *
+ * Call this when finished with the line from a LINE_SIGNAL.  Any bytes that
+ * arrived while the commander had both lines are taken up now, which can post
+ * the next line straight away, and the sender is let go if it was stopped.
+ */
+void serial_line_done(struct SerialLine *line)
+{
+	uint8_t sreg;
+
+	sreg = SREG;
+	cli();
+	line->len = 0;
+	line->locked = 0;
+	rxstampok = 0;
+	rx_process();
+	if (rxstopped && ring_used(&rxring) <= RX_XON_LEVEL) {
+		rxstopped = 0;
+		send_flow(XON);
+	}
+	SREG = sreg;
+}
+
+
+/**
+ * Change the way received bytes are taken, and the framing of output.
+ */
+static void set_mode(uint8_t framed, uint8_t mode)
+{
+	uint8_t sreg;
+
+	sreg = SREG;
+	cli();
+	framedwanted = framed;
+	rxmode = mode;
+	rxchannel = RX_NO_CHANNEL;
+	rxescape = 0;
+	rxdiscard = 0;
+	if (! lines[rxline].locked)
+		lines[rxline].len = 0;
+	if (rxstopped) {
+		rxstopped = 0;
+		send_flow(XON);
+	}
+	SREG = sreg;
+}
+
+
+/**
+ * @brief Turn framed mode on or off.
+ *
+ * Received bytes are taken the new way straight away, and any partial line or
+ * frame is thrown away.  Output that has not started yet is sent the new way,
+ * so the reply to the command that changed the mode is sent in the new mode.
+ * Telemetry is only sent in framed mode.
+ */
+void serial_framed(uint8_t on)
+{
+	set_mode(on, on ? RX_FRAMED : RX_TEXT);
+}
+
+
+/**
+ * @brief Turn binary command mode on or off.
+ *
+ * In binary mode each command arrives as a packet: an opcode, a length, that
+ * many bytes, and a CRC-8 of all of those (as for frames).  A good packet is
+ * posted to the commander as a line holding the opcode, length and bytes.  A
+ * bad one is posted as an empty line, so the commander can say so.  Packets
+ * with opcode 0 are dropped, so a run of zero bytes gets back in step.
+ *
+ * Output is not framed.  Any partial line or packet is thrown away.
+ */
+void serial_binary(uint8_t on)
+{
+	set_mode(0, on ? RX_BINARY : RX_TEXT);
+}
+
+
+/** @brief Non-zero in framed mode. */
+uint8_t serial_is_framed(void)
+{
+	return framedwanted;
+}
+
+
+/**
+ * @brief Copy the receive error counts since boot.
+ */
+void serial_errors(struct SerialErrors *errors)
+{
+	uint8_t sreg;
+
+	sreg = SREG;
+	cli();
+	*errors = rxerrors;
+	SREG = sreg;
+}
+
+
+/**
+ * Post a finished line to the commander, and go on to the other line.
+ */
+static void rx_line_done(struct SerialLine *line)
+{
+	line->data[line->len] = '\0';
+	line->stamp = rxstamp;
+	line->stamped = rxstampok && ! ring_used(&rxring);
+	line->locked = 1;
+	rxline ^= 1;
 	fff(&commander);
-	QActive_postISR((QActive*)(&commander), CHAR_SIGNAL, data);
+	QActive_postISR((QActive*)(&commander), LINE_SIGNAL, (QParam)line);
+}
+
+
+/**
+ * Take a received byte in plain text mode.
+ *
+ * Only a complete line is posted to the commander, so a line pasted in at
+ * full speed costs one event rather than one per character.
+ *
+ * ESC clears the line so far.
+ */
+static void rx_text(char c)
+{
+	struct SerialLine *line = &lines[rxline];
+
+	if ('\r' == c || '\n' == c || '\0' == c) {
+		if (! line->len) {
+			return;
+		}
+	} else {
+		if ('\x1b' == c) {
+			line->len = 0;
+			return;
+		}
+		line->data[line->len++] = c;
+		if (line->len < SERIAL_BUFFER_SIZE - 1) {
+			return;
+		}
+	}
+	rx_line_done(line);
+}
+
+
+/**
+ * Take a received byte in framed mode.
+ *
+ * A good frame on the urgent channel becomes a line for the commander.  Frames
+ * on other channels are ignored, and bad ones are counted.  The CRC byte is
+ * stored with the data, and taken off at the end.
+ */
+static void rx_framed(uint8_t c)
+{
+	struct SerialLine *line = &lines[rxline];
+	uint8_t channel;
+
+	if (SLIP_END == c) {
+		channel = rxchannel;
+		rxchannel = RX_NO_CHANNEL;
+		rxescape = 0;
+		if (RX_NO_CHANNEL == channel) {
+			/* Nothing since the last SLIP_END. */
+			return;
+		}
+		if (rxdiscard || rxcrc) {
+			rxdiscard = 0;
+			rxerrors.frames++;
+			line->len = 0;
+			return;
+		}
+		if (SERIAL_URGENT != channel) {
+			return;
+		}
+		if (line->len < 2) {
+			/* Only the CRC. */
+			line->len = 0;
+			return;
+		}
+		line->len--;
+		rx_line_done(line);
+		return;
+	}
+	if (rxescape) {
+		rxescape = 0;
+		if (SLIP_ESC_END == c) {
+			c = SLIP_END;
+		} else if (SLIP_ESC_ESC == c) {
+			c = SLIP_ESC;
+		} else {
+			rxdiscard = 1;
+		}
+	} else if (SLIP_ESC == c) {
+		rxescape = 1;
+		return;
+	}
+	if (RX_NO_CHANNEL == rxchannel) {
+		rxchannel = c;
+		rxcrc = crc8_update(0, c);
+		return;
+	}
+	rxcrc = crc8_update(rxcrc, c);
+	if (SERIAL_URGENT != rxchannel) {
+		return;
+	}
+	if (line->len >= SERIAL_BUFFER_SIZE - 1) {
+		/* Too long. */
+		rxdiscard = 1;
+		return;
+	}
+	line->data[line->len++] = c;
+}
+
+
+/**
+ * Take a received byte in binary mode.  See serial_binary().
+ */
+static void rx_binary(uint8_t c)
+{
+	struct SerialLine *line = &lines[rxline];
+
+	if (line->len >= 2 && line->len == 2 + (uint8_t)line->data[1]) {
+		/* The CRC, which makes the CRC of the packet 0. */
+		if (crc8_update(rxcrc, c)) {
+			rxerrors.frames++;
+			line->len = 0;
+		} else if ('\0' == line->data[0]) {
+			line->len = 0;
+			return;
+		}
+		rx_line_done(line);
+		return;
+	}
+	rxcrc = crc8_update(line->len ? rxcrc : 0, c);
+	line->data[line->len++] = c;
+	if (2 == line->len && c > SERIAL_BUFFER_SIZE - 3) {
+		/* Too long to keep. */
+		rxerrors.frames++;
+		line->len = 0;
+		rx_line_done(line);
+	}
+}
+
+
+/**
+ * Take waiting bytes into lines, until the commander has both lines.  Called
+ * with interrupts off.
+ */
+static void rx_process(void)
+{
+	uint8_t c;
+
+	while (ring_used(&rxring) && ! lines[rxline].locked) {
+		c = ring_pop(&rxring);
+		switch (rxmode) {
+		case RX_FRAMED:
+			rx_framed(c);
+			break;
+		case RX_BINARY:
+			rx_binary(c);
+			break;
+		default:
+			rx_text(c);
+			break;
+		}
+	}
+}
+
+
+/**
+ * Take a received byte.
+ *
+ * The error flags in UCSRA belong to the byte in UDR, so they are read first.
+ * A byte with a framing or parity error is thrown away.  An overrun means
+ * bytes were lost before this one, which is kept.
+ */
+SIGNAL(USART_RXC_vect)
+{
+	uint8_t status;
+	char c;
+
+	rxstamp = BSP_stamp();
+	status = UCSRA;
+	c = UDR;
+	if (status & (1 << DOR)) {
+		rxerrors.overrun++;
+	}
+	if (status & (1 << FE)) {
+		rxerrors.framing++;
+		return;
+	}
+	if (status & (1 << PE)) {
+		rxerrors.parity++;
+		return;
+	}
+	if (! ring_push(&rxring, c)) {
+		rxerrors.lost++;
+		return;
+	}
+	rxstampok = 1;
+	rx_process();
+	if (RX_FRAMED != rxmode && ! rxstopped
+	    && ring_used(&rxring) >= RX_XOFF_LEVEL) {
+		rxstopped = 1;
+		send_flow(XOFF);
+	}
 }
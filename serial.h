@@ -4,41 +4,125 @@
 #include "qpn_port.h"
 #include <stdint.h>
 
-#define SERIAL_BUFFER_SIZE 100
+#define SERIAL_BUFFER_SIZE 64
 
 /**
  * Data structure used for serial reception.
+ *
+ * There are two of these.  The receive interrupt handler fills one, and when
+ * it has a whole line it locks that one, posts a LINE_SIGNAL to the commander
+ * with a pointer to it, and goes on to the other.  The commander owns a locked
+ * line until it calls serial_line_done().  While the commander has both,
+ * received bytes wait in a ring (see SERIAL_RX_SIZE in serial.c).
  */
 struct SerialLine {
+	/** Non-zero while the commander owns this line. */
 	volatile uint8_t locked;
+	/** Number of characters in data, not counting the null. */
 	uint8_t len;
+	/** BSP_stamp() when the last byte of the line arrived, if stamped is
+	    set. */
+	uint16_t stamp;
+	/** Set if the line was finished by the receive interrupt handler as
+	    its last byte arrived.  A line made from bytes that waited in the
+	    ring has no good stamp. */
+	uint8_t stamped;
 	/**
 	 * @brief Serial data is read into this buffer.
 	 *
 	 * After the serial interrupt routine recognises the end of a line,
 	 * this buffer will be null terminated.  The end of a line is a
-	 * carriage return, a line feed, or more than the buffer size.
+	 * carriage return, a line feed, a null, or one less than the buffer
+	 * size.  Empty lines are not passed on.
 	 */
 	char data[SERIAL_BUFFER_SIZE];
 };
 
+/**
+ * Output channels, in priority order.  The urgent channel (the console) is
+ * always sent first, and the bulk channel (trace output) is the one that loses
+ * data when output can't keep up.  The telemetry channel only carries binary
+ * records in framed mode.
+ *
+ * In framed mode, these numbers are the channel byte at the start of each
+ * frame.
+ */
+enum SerialChannel {
+	SERIAL_URGENT = 0,
+	SERIAL_TELEMETRY = 1,
+	SERIAL_BULK = 2,
+	SERIAL_CHANNELS,
+};
+
+/** The number of baud rates, see serial_baud_index(). */
+#define SERIAL_BAUDS 6
+/** The index of 38400 baud, used at boot. */
+#define SERIAL_BAUD_DEFAULT 2
+
 void serial_init(void);
+void serial_line_done(struct SerialLine *line);
 
 int  serial_send(const char *s);
 int  serial_send_rom(char const Q_ROM * const Q_ROM_VAR s);
 int  serial_send_int(unsigned int n);
 int  serial_send_hex_int(unsigned int x);
 int  serial_send_char(char c);
+int  serial_send_byte(uint8_t b);
+int  serial_printf_P(PGM_P fmt, ...);
 
 int  serial_trace(const char *s);
 int  serial_trace_rom(char const Q_ROM * const Q_ROM_VAR s);
 int  serial_trace_int(unsigned int n);
 int  serial_trace_hex_int(unsigned int x);
 int  serial_trace_char(char c);
+int  serial_trace_id(uint16_t id);
+int  serial_trace_printf_P(PGM_P fmt, ...);
+
+uint16_t serial_drops(uint8_t channel);
+uint8_t  serial_send_space(void);
+
+int      serial_send_telemetry(const void *data, uint8_t len);
+void     serial_framed(uint8_t on);
+void     serial_binary(uint8_t on);
+uint8_t  serial_is_framed(void);
+
+/**
+ * Receive errors since boot.  See serial_errors().
+ */
+struct SerialErrors {
+	/** Overruns (DOR): bytes lost in the USART because the receive
+	    interrupt handler was late. */
+	uint16_t overrun;
+	/** Bytes with a framing error (FE), usually a baud rate mismatch. */
+	uint16_t framing;
+	/** Bytes with a parity error (PE).  Parity is off, so this should
+	    stay at 0. */
+	uint16_t parity;
+	/** Bytes lost because the receive ring was full, so the sender did
+	    not stop for XOFF. */
+	uint16_t lost;
+	/** Frames with a bad CRC or escape, or too long for a line, in
+	    framed mode. */
+	uint16_t frames;
+};
+
+void     serial_errors(struct SerialErrors *errors);
+
+int8_t  serial_baud_index(const char *name);
+PGM_P   serial_baud_name(uint8_t index);
+uint8_t serial_baud(void);
+void    serial_set_baud(uint8_t index);
+void    serial_save_baud(uint8_t index);
+void    serial_use_saved_baud(void);
 
 void serial_drain(void);
+void serial_notify_drained(QActive *ao);
+void serial_qf_started(void);
 void serial_assert(char const Q_ROM * const Q_ROM_VAR file, int line);
 
+/** A name to add to the assert message, or null.  See fff(). */
+extern char const Q_ROM *serial_assert_name;
+
 uint8_t tracing(void);
 void traceon(void);
 void traceoff(void);
@@ -57,22 +141,124 @@ void traceoff(void);
 		serial_send_rom(ss);				\
 	} while (0)
 
+/**
+ * Send formatted output, with the format string stored in ROM.  See
+ * serial_printf_P() for the conversions.
+ */
+#define SF(fmt, ...)						\
+	do {							\
+		static const char PROGMEM ss[] = fmt;		\
+		serial_printf_P(ss, __VA_ARGS__);		\
+	} while (0)
+
+/**
+ * Send a constant string and wait for it to go.
+ *
+ * This busy waits, so it's only for use before QF_run().  State handlers use
+ * S() and, if they must know when the output has gone, serial_notify_drained().
+ */
 #define SD(s)					\
 	do {					\
 		S(s);				\
 		serial_drain();			\
 	} while (0)
 
-#define ST(s)							\
+/**
+ * @name Trace levels
+ *
+ * Each trace site has a level.  Sites above the file's TRACE_LEVEL are not
+ * compiled in at all, so they cost no code and no flash for strings.  The
+ * Makefile sets TRACE_LEVEL for each file.  The sites that are compiled in
+ * only send anything while tracing is on (TRON and TROFF).
+ * @{
+ */
+#define TRACE_LEVEL_NONE    0
+#define TRACE_LEVEL_ERROR   1	/**< Something failed. */
+#define TRACE_LEVEL_INFO    2	/**< Occasional changes of state. */
+#define TRACE_LEVEL_TRACE   3	/**< Events as they are handled. */
+#define TRACE_LEVEL_VERBOSE 4	/**< Every tick, every bus transaction. */
+/** @} */
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_LEVEL_TRACE
+#endif
+
+/**
+ * Non-zero if trace sites at @e level (ERROR, INFO, TRACE or VERBOSE) are
+ * compiled into this file.
+ */
+#define TRACE_AT(level) (TRACE_LEVEL_##level <= TRACE_LEVEL)
+
+/**
+ * Non-zero if trace sites at @e level are compiled in and tracing is on.  Put
+ * this around a group of trace calls, so the numbers sent with
+ * serial_trace_int() etc go too.
+ */
+#define TRACING(level) (TRACE_AT(level) && tracing())
+
+/** Send a constant trace string at @e level.  See ST_SITE(). */
+#define STL(level,s)						\
+	do {							\
+		if (TRACE_AT(level)) {				\
+			ST_SITE(s);				\
+		}						\
+	} while (0)
+
+#define STE(s)  STL(ERROR, s)
+#define STI(s)  STL(INFO, s)
+#define ST(s)   STL(TRACE, s)
+#define STV(s)  STL(VERBOSE, s)
+
+/**
+ * Send a constant trace string, if tracing is on.
+ *
+ * Use this through ST() and friends, which add the level.
+ *
+ * Normally this is like S().  With WORDCLOCK_TRACE_BINARY defined, the string
+ * is left out of the program, and a binary trace record is sent instead.  The
+ * record holds an ID made from TRACE_FILE (which each file that uses ST() must
+ * define) and the line number, and a timestamp.  The arguments sent by
+ * serial_trace_int() and serial_trace_hex_int() become binary records too.
+ *
+ * The records are:
+ *
+ * - TRACE_RECORD_ID, ID (2 bytes), timestamp in ticks (2 bytes);
+ *
+ * - TRACE_RECORD_INT, value (2 bytes), to be printed in decimal;
+ *
+ * - TRACE_RECORD_HEX, value (2 bytes), to be printed in hex.
+ *
+ * All values are little endian.  A value byte that is XON (0x11), XOFF (0x13)
+ * or TRACE_RECORD_ESC is sent as TRACE_RECORD_ESC followed by the byte with
+ * bit 5 flipped, since flow control can put XON and XOFF anywhere in the
+ * output.  Everything else, including the output of S(), is sent as text.  The table of IDs and strings is made at build time by
+ * preprocessing the sources with WORDCLOCK_TRACE_TABLE defined (see the
+ * Makefile), and tools/tracedecode turns the records back into text.
+ *
+ * Two ST() on one line would get the same ID, so don't do that.
+ */
+#if defined(WORDCLOCK_TRACE_TABLE)
+#define ST_SITE(s) __trace_entry__ TRACE_FILE __LINE__ s
+#elif defined(WORDCLOCK_TRACE_BINARY)
+#define ST_SITE(s)						\
+	do {							\
+		(void)sizeof(char[__LINE__ < 1024 ? 1 : -1]);	\
+		serial_trace_id(TRACE_ID(__LINE__));		\
+	} while (0)
+#else
+#define ST_SITE(s)						\
 	do {							\
 		static const char PROGMEM ss[] = s;		\
 		serial_trace_rom(ss);				\
 	} while (0)
+#endif
 
-#define STD(s)					\
-	do {					\
-		ST(s);				\
-		serial_drain();			\
-	} while (0)
+/** The binary trace ID for a line in this file. */
+#define TRACE_ID(line) (((uint16_t)(TRACE_FILE) << 10) | (line))
+
+#define TRACE_RECORD_INT 0x1c
+#define TRACE_RECORD_HEX 0x1d
+#define TRACE_RECORD_ID  0x1e
+#define TRACE_RECORD_ESC 0x10
 
 #endif
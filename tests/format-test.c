@@ -0,0 +1,144 @@
+/**
+ * @file
+ *
+ * @brief Host tests for format.c, against snprintf().
+ *
+ * Every input is tried: each 16 bit number at each padding width, each BCD
+ * byte, and each time the DS1307 can hold in either hour mode, with and
+ * without the bits that aren't part of the time.  Run with "make test".
+ */
+
+#include "format.h"
+#include <stdio.h>
+#include <string.h>
+
+
+static int failures;
+
+/** Compare @e n bytes of output with the null terminated @e want. */
+static void check(const char *what, unsigned input, const char *got,
+		  uint8_t n, const char *want)
+{
+	if (n != strlen(want) || memcmp(got, want, n)) {
+		if (failures < 20) {
+			fprintf(stderr, "%s(0x%x): \"%.*s\", not \"%s\"\n",
+				what, input, n, got, want);
+		}
+		failures++;
+	}
+}
+
+
+static void test_uint(void)
+{
+	char buf[FORMAT_UINT_MAX + 1];
+	char want[16];
+	unsigned n;
+	uint8_t width;
+
+	for (n = 0; n <= 0xffff; n++) {
+		snprintf(want, sizeof(want), "%u", n);
+		check("format_uint", n, buf, format_uint(buf, n), want);
+		for (width = 0; width <= FORMAT_UINT_MAX; width++) {
+			snprintf(want, sizeof(want), "%0*u", width, n);
+			check("format_uint_padded", n | width << 16, buf,
+			      format_uint_padded(buf, n, width), want);
+		}
+	}
+}
+
+
+static void test_hex(void)
+{
+	char buf[4];
+	char want[16];
+	unsigned x;
+
+	for (x = 0; x <= 0xffff; x++) {
+		snprintf(want, sizeof(want), "%X", x);
+		check("format_hex", x, buf, format_hex(buf, x), want);
+	}
+}
+
+
+static void test_bcd(void)
+{
+	char buf[2];
+	char want[16];
+	unsigned n;
+	uint8_t bcd;
+
+	for (n = 0; n <= 99; n++) {
+		bcd = (uint8_t)((n / 10) << 4 | n % 10);
+		snprintf(want, sizeof(want), "%02u", n);
+		check("format_bcd", bcd, buf, format_bcd(buf, bcd), want);
+	}
+}
+
+
+static uint8_t to_bcd(unsigned n)
+{
+	return (uint8_t)((n / 10) << 4 | n % 10);
+}
+
+
+static void test_time(void)
+{
+	char buf[FORMAT_TIME_MAX + 1];
+	char want[32];
+	uint8_t regs[3];
+	unsigned hour, min, sec, ch;
+
+	for (hour = 0; hour < 48; hour++) {
+		for (min = 0; min < 60; min++) {
+			for (sec = 0; sec < 60; sec++) {
+				for (ch = 0; ch <= 0x80; ch += 0x80) {
+					/* CH in the seconds, and the spare
+					   top bit of the minutes. */
+					regs[0] = to_bcd(sec) | ch;
+					regs[1] = to_bcd(min) | ch;
+					if (hour < 24) {
+						/* 24 hour mode, bit 7 spare */
+						regs[2] = to_bcd(hour) | ch;
+						snprintf(want, sizeof(want),
+							 "%u:%02u:%02u (24)",
+							 hour, min, sec);
+					} else {
+						/* 12 hour mode, 1 to 12, AM
+						   then PM */
+						unsigned h12 = (hour - 24) % 12;
+						uint8_t pm = hour >= 36;
+
+						h12 = h12 ? h12 : 12;
+						regs[2] = 0x40 | (pm ? 0x20 : 0)
+							| to_bcd(h12) | ch;
+						snprintf(want, sizeof(want),
+							 "%u:%02u:%02u %s",
+							 h12, min, sec,
+							 pm ? "PM" : "AM");
+					}
+					check("format_time",
+					      regs[0] | regs[1] << 8
+					      | regs[2] << 16, buf,
+					      format_time(buf, regs), want);
+				}
+			}
+		}
+	}
+}
+
+
+int main(void)
+{
+	test_uint();
+	test_hex();
+	test_bcd();
+	test_time();
+
+	if (failures) {
+		fprintf(stderr, "format-test: %d failures\n", failures);
+		return 1;
+	}
+	printf("format-test: OK\n");
+	return 0;
+}
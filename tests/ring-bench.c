@@ -0,0 +1,159 @@
+/**
+ * @file
+ *
+ * @brief Time ring.h against the send buffer it replaced in serial.c.
+ *
+ * The old channel kept its head and tail as indexes from 0 to size - 1, so
+ * each step compared and wrapped, and the size needn't be a power of two.
+ * Both are copied here from serial.c as it was before ring.h.  Each is timed
+ * with the host clock, moving 20 byte lines through a 128 byte buffer: a
+ * block copy in at task level, and single bytes out as the transmit interrupt
+ * handler takes them.  Run with "make bench".  The clock is only read around
+ * each whole run, as reading it costs more than a line.
+ *
+ * This shows the difference in the code, not AVR cycles.
+ */
+
+#include "ring.h"
+#include <stdio.h>
+#include <time.h>
+
+
+#define SIZE  128
+#define LINE  20
+#define LINES 2000000L
+
+
+/** @name The old send channel
+ * @{
+ */
+struct OldChannel {
+	char *buffer;
+	uint8_t size;
+	uint8_t head;
+	volatile uint8_t ready;
+	volatile uint8_t tail;
+};
+
+
+static uint8_t old_space(struct OldChannel *ch, uint8_t head)
+{
+	uint8_t tail = ch->tail;
+
+	if (head >= tail) {
+		return ch->size - 1 - (head - tail);
+	} else {
+		return tail - head - 1;
+	}
+}
+
+
+static uint8_t old_push_block(struct OldChannel *ch, const char *s, uint8_t n)
+{
+	uint8_t head = ch->head;
+	uint8_t space = old_space(ch, head);
+	uint8_t first;
+
+	if (n > space)
+		n = space;
+	first = ch->size - head;
+	if (first > n)
+		first = n;
+	memcpy(ch->buffer + head, s, first);
+	memcpy(ch->buffer, s + first, n - first);
+	head += n;
+	if (head >= ch->size)
+		head -= ch->size;
+	ch->head = head;
+	ch->ready = head;
+	return n;
+}
+
+
+static char old_pop(struct OldChannel *ch)
+{
+	uint8_t tail = ch->tail;
+	char c = ch->buffer[tail];
+
+	tail++;
+	if (tail >= ch->size)
+		tail = 0;
+	ch->tail = tail;
+	return c;
+}
+/** @} */
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static char oldbuffer[SIZE];
+static char newbuffer[SIZE];
+static struct OldChannel old = { oldbuffer, SIZE, 0, 0, 0 };
+static struct Ring ring = RING_INIT(newbuffer);
+
+/** Where the popped bytes go, so that the loops aren't optimised away. */
+static volatile char sink;
+
+
+/** Seconds to push and pop LINES lines through the old channel. */
+static double time_old(void)
+{
+	static const char line[LINE] = "Processing: \"TIME\"\r\n";
+	double t0 = now();
+	long i;
+	int j;
+
+	for (i = 0; i < LINES; i++) {
+		old_push_block(&old, line, LINE);
+		for (j = 0; j < LINE; j++) {
+			sink = old_pop(&old);
+		}
+	}
+	return now() - t0;
+}
+
+
+/** Seconds to push and pop LINES lines through a Ring. */
+static double time_ring(void)
+{
+	static const char line[LINE] = "Processing: \"TIME\"\r\n";
+	double t0 = now();
+	long i;
+	int j;
+
+	for (i = 0; i < LINES; i++) {
+		ring_push_block(&ring, line, LINE);
+		for (j = 0; j < LINE; j++) {
+			sink = ring_pop(&ring);
+		}
+	}
+	return now() - t0;
+}
+
+
+int main(void)
+{
+	double oldbest = 1e9, ringbest = 1e9, t;
+	int run;
+
+	/* The best of a few runs, taken in turn, to keep out other load. */
+	for (run = 0; run < 5; run++) {
+		t = time_old();
+		if (t < oldbest)
+			oldbest = t;
+		t = time_ring();
+		if (t < ringbest)
+			ringbest = t;
+	}
+	printf("per %d byte line: old %.1fns, ring %.1fns (%.0f%%)\n", LINE,
+	       oldbest * 1e9 / LINES, ringbest * 1e9 / LINES,
+	       100.0 * ringbest / oldbest);
+	return 0;
+}
@@ -0,0 +1,264 @@
+/**
+ * @file
+ *
+ * @brief Host tests for ring.h.
+ *
+ * Each ring size is driven through several laps of the 8-bit head and tail,
+ * and checked against a plain array queue.  Guard bytes after the buffer
+ * catch writes past its end.  Run with "make test".
+ */
+
+#include "ring.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define GUARD      16
+#define GUARD_BYTE 0x5a
+
+static int failures;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check(int ok, const char *what, int line)
+{
+	if (! ok) {
+		if (failures < 20) {
+			fprintf(stderr, "ring-test.c:%d: %s\n", line, what);
+		}
+		failures++;
+	}
+}
+
+
+static char buffer[128 + GUARD];
+static struct Ring ring;
+
+/** The bytes that should be in the ring, in order. */
+static char model[256];
+static unsigned modelused;
+/** The next byte value to add. */
+static uint8_t next;
+
+
+static void start(uint8_t size, uint8_t at)
+{
+	ring.buffer = buffer;
+	ring.mask = size - 1;
+	ring.head = at;
+	ring.tail = at;
+	memset(buffer, GUARD_BYTE, sizeof(buffer));
+	modelused = 0;
+}
+
+
+static void check_guard(uint8_t size)
+{
+	unsigned i;
+
+	for (i = size; i < size + GUARD; i++) {
+		CHECK(GUARD_BYTE == (uint8_t)buffer[i]);
+	}
+}
+
+
+static void model_push(char c)
+{
+	model[modelused++] = c;
+}
+
+
+static void model_pop(char *d, unsigned n)
+{
+	memcpy(d, model, n);
+	memmove(model, model + n, modelused - n);
+	modelused -= n;
+}
+
+
+/**
+ * Push and pop single bytes, in uneven bursts, for a few laps of the
+ * indexes, starting the indexes at @e at.
+ */
+static void test_bytes(uint8_t size, uint8_t at)
+{
+	unsigned step;
+	unsigned i;
+	char c;
+
+	start(size, at);
+	for (step = 0; step < 1500; step++) {
+		for (i = 0; i < step % 7; i++) {
+			if (modelused < size) {
+				CHECK(1 == ring_push(&ring, (char)next));
+				model_push((char)next++);
+			} else {
+				CHECK(0 == ring_push(&ring, 'x'));
+			}
+		}
+		for (i = 0; i < step % 5; i++) {
+			if (! ring_used(&ring)) {
+				break;
+			}
+			model_pop(&c, 1);
+			CHECK(c == ring_pop(&ring));
+		}
+		CHECK(modelused == ring_used(&ring));
+		CHECK(size - modelused == ring_free(&ring));
+	}
+	check_guard(size);
+}
+
+
+/** Fill the ring, check that it refuses more, then empty it. */
+static void test_full_empty(uint8_t size, uint8_t at)
+{
+	unsigned i;
+	char c;
+
+	start(size, at);
+	CHECK(0 == ring_used(&ring));
+	CHECK(size == ring_free(&ring));
+	for (i = 0; i < size; i++) {
+		CHECK(1 == ring_push(&ring, (char)next));
+		model_push((char)next++);
+	}
+	CHECK(size == ring_used(&ring));
+	CHECK(0 == ring_free(&ring));
+	CHECK(0 == ring_push(&ring, 'x'));
+	CHECK(0 == ring_push_block(&ring, "xyz", 3));
+	CHECK(size == ring_used(&ring));
+	for (i = 0; i < size; i++) {
+		model_pop(&c, 1);
+		CHECK(c == ring_pop(&ring));
+	}
+	CHECK(0 == ring_used(&ring));
+	CHECK(size == ring_free(&ring));
+	CHECK(0 == ring_pop_block(&ring, &c, 1));
+	check_guard(size);
+}
+
+
+/**
+ * Push and pop blocks of every length up to the size, from each start
+ * position, so that every split across the end of the buffer is tried.
+ */
+static void test_blocks(uint8_t size, uint8_t at)
+{
+	char in[256];
+	char out[256];
+	char want[256];
+	unsigned n, j, offset;
+	uint8_t added, taken;
+
+	for (offset = 0; offset < size; offset++) {
+		start(size, (uint8_t)(at + offset));
+		/* Leave a few bytes in, so the block doesn't start at an
+		   empty ring. */
+		for (j = 0; j < offset % 3 && j < size; j++) {
+			ring_push(&ring, (char)next);
+			model_push((char)next++);
+		}
+		for (n = 1; n <= size + 1u; n++) {
+			for (j = 0; j < n; j++) {
+				in[j] = (char)(next + j);
+			}
+			added = ring_push_block(&ring, in, (uint8_t)n);
+			CHECK(added == (n < size - modelused
+					? n : size - modelused));
+			for (j = 0; j < added; j++) {
+				model_push(in[j]);
+			}
+			next += added;
+			CHECK(modelused == ring_used(&ring));
+
+			/* Take back most of it, leaving the indexes moving
+			   round the buffer. */
+			j = modelused - modelused / 3;
+			taken = ring_pop_block(&ring, out, (uint8_t)j);
+			CHECK(taken == j);
+			model_pop(want, taken);
+			CHECK(! memcmp(out, want, taken));
+		}
+		taken = ring_pop_block(&ring, out, 255);
+		CHECK(taken == modelused);
+		model_pop(want, taken);
+		CHECK(! memcmp(out, want, taken));
+		CHECK(0 == ring_used(&ring));
+		check_guard(size);
+	}
+}
+
+
+/**
+ * Staged bytes stay out of sight until they are committed, however they
+ * are split across the end of the buffer.
+ */
+static void test_stage(uint8_t size, uint8_t at)
+{
+	char line[128];
+	char out[128];
+	unsigned offset, n, j;
+	uint8_t pending;
+
+	for (offset = 0; offset < size; offset++) {
+		start(size, (uint8_t)(at + offset));
+		for (n = 1; n <= size; n++) {
+			/* Stage the line in two pieces, as send_block() does
+			   for a line sent in parts, with one byte put on its
+			   own. */
+			for (j = 0; j < n; j++) {
+				line[j] = (char)(next + j);
+			}
+			pending = 0;
+			ring_stage(&ring, pending, line, (uint8_t)(n / 2));
+			pending += n / 2;
+			if (pending < n) {
+				ring_stage_byte(&ring, pending, line[pending]);
+				pending++;
+			}
+			ring_stage(&ring, pending, line + pending,
+				   (uint8_t)(n - pending));
+			pending = (uint8_t)n;
+			CHECK(0 == ring_used(&ring));
+			CHECK(size == ring_free(&ring));
+
+			ring_commit(&ring, pending);
+			CHECK(n == ring_used(&ring));
+			CHECK(n == ring_pop_block(&ring, out, (uint8_t)n));
+			CHECK(! memcmp(out, line, n));
+			next += n;
+		}
+		check_guard(size);
+	}
+}
+
+
+int main(void)
+{
+	static const uint8_t starts[] = { 0, 1, 127, 200, 255 };
+	unsigned size;
+	unsigned odd;
+	unsigned i;
+
+	for (size = 1; size <= 128; size <<= 1) {
+		odd = size * 3;
+		CHECK(RING_SIZE_OK(size));
+		CHECK(! RING_SIZE_OK(odd));
+		for (i = 0; i < sizeof(starts); i++) {
+			test_bytes(size, starts[i]);
+			test_full_empty(size, starts[i]);
+			test_blocks(size, starts[i]);
+			test_stage(size, starts[i]);
+		}
+	}
+	CHECK(! RING_SIZE_OK(0));
+	CHECK(! RING_SIZE_OK(256));
+
+	if (failures) {
+		fprintf(stderr, "ring-test: %d failures\n", failures);
+		return 1;
+	}
+	printf("ring-test: OK\n");
+	return 0;
+}
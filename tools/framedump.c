@@ -0,0 +1,164 @@
+/**
+ * @file
+ *
+ * @brief Show, or make, the wordclock's framed serial traffic.
+ *
+ * Usage: framedump [-c CHANNEL] [CAPTURE]
+ *        framedump -e
+ *
+ * Without -c, each frame from the capture (or stdin) is shown on a line of
+ * its own, with its channel: console lines as text, time telemetry as a time,
+ * and anything else in hex.  Bad frames are shown as text, so that an assert
+ * message can still be read.
+ *
+ * With -c, only the data of frames on that channel is written, as it was
+ * sent.  "framedump -c 2 capture | tracedecode wordclock.trace" decodes binary
+ * trace output captured in framed mode.
+ *
+ * With -e, each line of stdin is framed as a console command and written to
+ * stdout, eg "echo 'FRAME OFF' | framedump -e > /dev/ttyUSB0".
+ */
+
+#include "wcframe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+
+static void put_text(const uint8_t *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if ('\r' == data[i] || '\n' == data[i]) {
+			continue;
+		}
+		if (data[i] < ' ' || data[i] > '~') {
+			printf("\\x%02x", data[i]);
+		} else {
+			putchar(data[i]);
+		}
+	}
+}
+
+
+static void show(void *ctx, int channel, const uint8_t *data, size_t len)
+{
+	size_t i;
+
+	switch (channel) {
+	case WCFRAME_BAD:
+		printf("bad:     ");
+		put_text(data, len);
+		break;
+	case WCFRAME_CONSOLE:
+		printf("console: ");
+		put_text(data, len);
+		break;
+	case WCFRAME_TRACE:
+		printf("trace:   ");
+		put_text(data, len);
+		break;
+	case WCFRAME_TELEMETRY:
+		printf("telem:   ");
+		if (4 == len && WCFRAME_TELEMETRY_TIME == data[0]) {
+			printf("time %x:%02x:%02x %s", data[3] & 0x1f, data[2],
+			       data[1], (data[3] & 0x20) ? "PM" : "AM");
+			break;
+		}
+		for (i = 0; i < len; i++) {
+			printf(" %02x", data[i]);
+		}
+		break;
+	default:
+		printf("chan %d: ", channel);
+		put_text(data, len);
+		break;
+	}
+	putchar('\n');
+	fflush(stdout);
+}
+
+
+static void extract(void *ctx, int channel, const uint8_t *data, size_t len)
+{
+	if (channel == *(int *)ctx) {
+		fwrite(data, 1, len, stdout);
+		fflush(stdout);
+	}
+}
+
+
+static int encode(void)
+{
+	char line[256];
+	uint8_t out[wcframe_encoded_max(sizeof(line))];
+	size_t len;
+
+	while (fgets(line, sizeof(line), stdin)) {
+		len = strcspn(line, "\r\n");
+		if (! len) {
+			continue;
+		}
+		len = wcframe_encode(WCFRAME_CONSOLE, (uint8_t *)line, len, out);
+		fwrite(out, 1, len, stdout);
+		fflush(stdout);
+	}
+	return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+	struct wcframe_decoder d;
+	FILE *in = stdin;
+	int channel = -1;
+	int opt;
+	uint8_t buf[256];
+	ssize_t n;
+
+	while (-1 != (opt = getopt(argc, argv, "c:e"))) {
+		switch (opt) {
+		case 'c':
+			channel = atoi(optarg);
+			break;
+		case 'e':
+			return encode();
+		default:
+			goto usage;
+		}
+	}
+	if (optind + 1 < argc) {
+		goto usage;
+	}
+	if (optind < argc) {
+		in = fopen(argv[optind], "rb");
+		if (! in) {
+			fprintf(stderr, "framedump: %s: %s\n",
+				argv[optind], strerror(errno));
+			return 2;
+		}
+	}
+
+	wcframe_init(&d);
+	/* read() rather than fread(), so a live device is shown as it
+	   arrives. */
+	while ((n = read(fileno(in), buf, sizeof(buf))) > 0) {
+		if (channel < 0) {
+			wcframe_feed(&d, buf, n, show, NULL);
+		} else {
+			wcframe_feed(&d, buf, n, extract, &channel);
+		}
+	}
+	if (d.bad) {
+		fprintf(stderr, "framedump: %lu bad frames\n", d.bad);
+	}
+	return 0;
+
+ usage:
+	fprintf(stderr, "usage: framedump [-c CHANNEL] [CAPTURE]\n"
+		"       framedump -e\n");
+	return 2;
+}
@@ -0,0 +1,249 @@
+/**
+ * @file
+ *
+ * @brief Decode the wordclock's binary trace output.
+ *
+ * Usage: tracedecode wordclock.trace [capture]
+ *
+ * wordclock.trace is made by the build (make WORDCLOCK_TRACE_BINARY=1).  The
+ * capture is a file of serial output, or the serial device itself (set its
+ * speed with stty first).  Without it we read stdin.
+ *
+ * Text is passed through.  Binary trace records (see ST() in serial.h) are
+ * turned back into their strings and numbers, and each line that starts with
+ * a trace record gets its timestamp, in seconds since the board started.
+ * XON and XOFF, which the clock sends for flow control even in the middle of
+ * a record, are dropped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+
+/* These must match serial.h. */
+#define TRACE_RECORD_INT 0x1c
+#define TRACE_RECORD_HEX 0x1d
+#define TRACE_RECORD_ID  0x1e
+#define TRACE_RECORD_ESC 0x10
+#define XON  0x11
+#define XOFF 0x13
+/* And this must match bsp-avr.c. */
+#define TICKS_PER_SECOND 20
+
+/* Trace IDs are 16 bits. */
+#define MAX_IDS 65536
+
+
+static char *strings[MAX_IDS];
+
+
+/**
+ * Turn a sequence of C string literals into the string they represent.
+ *
+ * @return the string, or NULL if the literals are malformed
+ */
+static char *parse_literals(const char *p)
+{
+	char *s = malloc(strlen(p) + 1);
+	char *d = s;
+
+	if (! s) {
+		return NULL;
+	}
+	while (*p) {
+		if (' ' == *p || '\t' == *p || '\n' == *p) {
+			p++;
+			continue;
+		}
+		if ('"' != *p++) {
+			goto bad;
+		}
+		while (*p != '"') {
+			if (! *p) {
+				goto bad;
+			}
+			if ('\\' != *p) {
+				*d++ = *p++;
+				continue;
+			}
+			p++;
+			switch (*p++) {
+			case 'r':  *d++ = '\r'; break;
+			case 'n':  *d++ = '\n'; break;
+			case 't':  *d++ = '\t'; break;
+			case '\\': *d++ = '\\'; break;
+			case '"':  *d++ = '"';  break;
+			case '\'': *d++ = '\''; break;
+			default:   goto bad;
+			}
+		}
+		p++;
+	}
+	*d = '\0';
+	return s;
+
+ bad:
+	free(s);
+	return NULL;
+}
+
+
+static void read_table(const char *name)
+{
+	FILE *f;
+	char line[1024];
+	unsigned long id;
+	char *rest;
+	int lineno = 0;
+
+	f = fopen(name, "r");
+	if (! f) {
+		fprintf(stderr, "tracedecode: %s: %s\n", name, strerror(errno));
+		exit(2);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		id = strtoul(line, &rest, 10);
+		if (rest == line || id >= MAX_IDS
+		    || ! (strings[id] = parse_literals(rest))) {
+			fprintf(stderr, "tracedecode: %s:%d: bad line\n",
+				name, lineno);
+			exit(2);
+		}
+	}
+	fclose(f);
+}
+
+
+/**
+ * Read a byte of a record's value, dropping XON and XOFF and undoing the
+ * escape for those and TRACE_RECORD_ESC.
+ *
+ * @return the byte, or EOF
+ */
+static int read_byte(FILE *in)
+{
+	int c;
+
+	do {
+		c = getc(in);
+	} while (XON == c || XOFF == c);
+	if (TRACE_RECORD_ESC == c) {
+		do {
+			c = getc(in);
+		} while (XON == c || XOFF == c);
+		if (EOF != c) {
+			c ^= 0x20;
+		}
+	}
+	return c;
+}
+
+
+/**
+ * Read a little endian 16 bit value.
+ *
+ * @return the value, or -1 at end of file
+ */
+static long read16(FILE *in)
+{
+	int lo, hi;
+
+	lo = read_byte(in);
+	if (EOF == lo) {
+		return -1;
+	}
+	hi = read_byte(in);
+	if (EOF == hi) {
+		return -1;
+	}
+	return lo | (hi << 8);
+}
+
+
+static void put_text(const char *s, int *line_start)
+{
+	for (; *s; s++) {
+		if ('\r' == *s) {
+			continue;
+		}
+		putchar(*s);
+		*line_start = ('\n' == *s);
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	FILE *in = stdin;
+	int line_start = 1;
+	int c;
+	long id, ticks, value;
+	char number[16];
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: tracedecode TABLE [CAPTURE]\n");
+		return 2;
+	}
+	read_table(argv[1]);
+	if (3 == argc) {
+		in = fopen(argv[2], "rb");
+		if (! in) {
+			fprintf(stderr, "tracedecode: %s: %s\n",
+				argv[2], strerror(errno));
+			return 2;
+		}
+	}
+
+	while (EOF != (c = getc(in))) {
+		switch (c) {
+
+		case TRACE_RECORD_ID:
+			if (-1 == (id = read16(in)) ||
+			    -1 == (ticks = read16(in))) {
+				goto done;
+			}
+			if (line_start) {
+				printf("[%5ld.%02ld] ", ticks / TICKS_PER_SECOND,
+				       (ticks % TICKS_PER_SECOND)
+				       * (100 / TICKS_PER_SECOND));
+			}
+			if (strings[id]) {
+				put_text(strings[id], &line_start);
+			} else {
+				printf("<unknown trace %ld:%ld>", id >> 10,
+				       id & 0x3ff);
+				line_start = 0;
+			}
+			break;
+
+		case TRACE_RECORD_INT:
+		case TRACE_RECORD_HEX:
+			if (-1 == (value = read16(in))) {
+				goto done;
+			}
+			snprintf(number, sizeof(number),
+				 TRACE_RECORD_INT == c ? "%ld" : "%lX", value);
+			put_text(number, &line_start);
+			break;
+
+		case '\r':
+		case XON:
+		case XOFF:
+			break;
+
+		default:
+			putchar(c);
+			line_start = ('\n' == c);
+			break;
+		}
+		if (line_start) {
+			fflush(stdout);
+		}
+	}
+ done:
+	fflush(stdout);
+	return 0;
+}
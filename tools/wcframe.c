@@ -0,0 +1,141 @@
+/**
+ * @file
+ *
+ * @brief Host side of the wordclock's framed serial mode.  See wcframe.h.
+ */
+
+#include "wcframe.h"
+#include <string.h>
+
+
+/**
+ * CRC-8, polynomial 0x07, starting from @e crc.  The same as crc8_update() in
+ * serial.c, a bit at a time.
+ */
+uint8_t wcframe_crc8(uint8_t crc, const uint8_t *data, size_t len)
+{
+	int i;
+
+	while (len--) {
+		crc ^= *data++;
+		for (i = 0; i < 8; i++) {
+			crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07)
+				: (uint8_t)(crc << 1);
+		}
+	}
+	return crc;
+}
+
+
+void wcframe_init(struct wcframe_decoder *d)
+{
+	d->len = 0;
+	d->escape = 0;
+	d->overflow = 0;
+	d->bad = 0;
+}
+
+
+static void frame_end(struct wcframe_decoder *d,
+		      wcframe_handler handler, void *ctx)
+{
+	if (! d->len) {
+		/* Nothing between two ENDs. */
+		d->overflow = 0;
+		return;
+	}
+	if (d->overflow || d->len < 2 || wcframe_crc8(0, d->buf, d->len)) {
+		d->bad++;
+		handler(ctx, WCFRAME_BAD, d->buf, d->len);
+	} else {
+		handler(ctx, d->buf[0], d->buf + 1, d->len - 2);
+	}
+	d->len = 0;
+	d->overflow = 0;
+}
+
+
+/**
+ * Decode @e n received bytes, calling @e handler for each frame they finish.
+ */
+void wcframe_feed(struct wcframe_decoder *d, const uint8_t *bytes, size_t n,
+		  wcframe_handler handler, void *ctx)
+{
+	uint8_t c;
+
+	while (n--) {
+		c = *bytes++;
+		if (WCFRAME_END == c) {
+			d->escape = 0;
+			frame_end(d, handler, ctx);
+			continue;
+		}
+		if (d->escape) {
+			d->escape = 0;
+			if (WCFRAME_ESC_END == c) {
+				c = WCFRAME_END;
+			} else if (WCFRAME_ESC_ESC == c) {
+				c = WCFRAME_ESC;
+			} else {
+				d->overflow = 1;
+			}
+		} else if (WCFRAME_ESC == c) {
+			d->escape = 1;
+			continue;
+		}
+		if (d->len < sizeof(d->buf)) {
+			d->buf[d->len++] = c;
+		} else {
+			d->overflow = 1;
+		}
+	}
+}
+
+
+static size_t put_escaped(uint8_t *out, uint8_t c)
+{
+	if (WCFRAME_END == c) {
+		out[0] = WCFRAME_ESC;
+		out[1] = WCFRAME_ESC_END;
+		return 2;
+	}
+	if (WCFRAME_ESC == c) {
+		out[0] = WCFRAME_ESC;
+		out[1] = WCFRAME_ESC_ESC;
+		return 2;
+	}
+	out[0] = c;
+	return 1;
+}
+
+
+size_t wcframe_encode(int channel, const uint8_t *data, size_t len,
+		      uint8_t *out)
+{
+	uint8_t ch = (uint8_t)channel;
+	uint8_t crc;
+	size_t n = 0;
+	size_t i;
+
+	crc = wcframe_crc8(0, &ch, 1);
+	crc = wcframe_crc8(crc, data, len);
+	out[n++] = WCFRAME_END;
+	n += put_escaped(out + n, ch);
+	for (i = 0; i < len; i++) {
+		n += put_escaped(out + n, data[i]);
+	}
+	n += put_escaped(out + n, crc);
+	out[n++] = WCFRAME_END;
+	return n;
+}
+
+
+size_t wcframe_packet(uint8_t opcode, const uint8_t *payload, uint8_t len,
+		      uint8_t *out)
+{
+	out[0] = opcode;
+	out[1] = len;
+	memcpy(out + 2, payload, len);
+	out[len + 2] = wcframe_crc8(0, out, len + 2);
+	return len + 3;
+}
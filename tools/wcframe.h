@@ -0,0 +1,113 @@
+/**
+ * @file
+ *
+ * @brief Host side of the wordclock's framed serial mode.
+ *
+ * In framed mode (the FRAME ON command) each run of output from one channel
+ * (one or more whole lines, or a binary record) is sent as a SLIP frame
+ * (RFC 1055):
+ *
+ *     END channel data... crc END
+ *
+ * with END and ESC in the channel, data and crc bytes escaped.  The crc is a
+ * CRC-8 (polynomial 0x07, starting at 0) of the channel and data bytes.  The
+ * channels are WCFRAME_CONSOLE, WCFRAME_TELEMETRY and WCFRAME_TRACE, as
+ * enum SerialChannel in serial.h.  Commands are sent to the wordclock the
+ * same way, on WCFRAME_CONSOLE.
+ *
+ * A one byte "!" frame means the wordclock had no room for some output on that
+ * channel.
+ *
+ * wcframe_packet() makes the packets for binary command mode (BINARY ON),
+ * which is not framed.
+ */
+
+#ifndef wcframe_h_INCLUDED
+#define wcframe_h_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* These must match serial.h and serial.c. */
+#define WCFRAME_CONSOLE   0
+#define WCFRAME_TELEMETRY 1
+#define WCFRAME_TRACE     2
+
+#define WCFRAME_END     0xc0
+#define WCFRAME_ESC     0xdb
+#define WCFRAME_ESC_END 0xdc
+#define WCFRAME_ESC_ESC 0xdd
+
+/** Passed to the handler instead of a channel for a bad frame.  The data is
+    the frame as received, after unescaping, which is the way to see a
+    wordclock assert message in framed mode. */
+#define WCFRAME_BAD (-1)
+
+/** The longest frame we keep, unescaped. */
+#define WCFRAME_MAX 512
+
+/** Must match WORDCLOCK_TELEMETRY_TIME in wordclock.h. */
+#define WCFRAME_TELEMETRY_TIME 'T'
+
+/* Binary command mode (BINARY ON).  These must match commander.h. */
+#define WCFRAME_STATUS_OK         0x80
+#define WCFRAME_STATUS_FAILED     0x81
+#define WCFRAME_STATUS_BAD_ARGS   0x82
+#define WCFRAME_STATUS_UNKNOWN    0x83
+#define WCFRAME_STATUS_BAD_PACKET 0x84
+/** The longest payload of a binary command packet. */
+#define WCFRAME_PACKET_MAX 61
+
+
+/**
+ * Called by wcframe_feed() for each frame.
+ *
+ * @param channel the channel, or WCFRAME_BAD
+ * @param data the bytes of the frame, without the channel and crc
+ */
+typedef void (*wcframe_handler)(void *ctx, int channel,
+				const uint8_t *data, size_t len);
+
+
+struct wcframe_decoder {
+	uint8_t buf[WCFRAME_MAX];
+	size_t len;
+	int escape;
+	int overflow;
+	/** The number of bad frames seen. */
+	unsigned long bad;
+};
+
+
+uint8_t wcframe_crc8(uint8_t crc, const uint8_t *data, size_t len);
+
+void wcframe_init(struct wcframe_decoder *d);
+
+void wcframe_feed(struct wcframe_decoder *d, const uint8_t *bytes, size_t n,
+		  wcframe_handler handler, void *ctx);
+
+/**
+ * Frame @e len bytes of @e data for @e channel.
+ *
+ * @param out at least wcframe_encoded_max(len) bytes
+ * @return the number of bytes in @e out
+ */
+size_t wcframe_encode(int channel, const uint8_t *data, size_t len,
+		      uint8_t *out);
+
+/** The most that wcframe_encode() can make from @e len bytes. */
+#define wcframe_encoded_max(len) (2 * ((len) + 2) + 2)
+
+/**
+ * Make a binary command packet: @e opcode, @e len, the payload, and a CRC-8
+ * of those.  Opcodes and payloads are in struct Command in commander.c.
+ *
+ * @param len no more than WCFRAME_PACKET_MAX
+ * @param out at least @e len + 3 bytes
+ * @return the number of bytes in @e out
+ */
+size_t wcframe_packet(uint8_t opcode, const uint8_t *payload, uint8_t len,
+		      uint8_t *out);
+
+#endif
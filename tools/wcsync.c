@@ -0,0 +1,259 @@
+/**
+ * @file
+ *
+ * @brief Set the wordclock's time from this host, to within a few
+ * milliseconds.
+ *
+ * Usage: wcsync [-b BAUD] [-n PINGS] DEVICE
+ *
+ * This uses the SYNC command, in plain text mode.  It sends "QUIET ON" (so
+ * replies aren't mixed with echoes), then a number of bare "SYNC" lines, each
+ * answered with how long the line waited in the clock.  The quickest round
+ * trip, less that wait and the time the characters take on the wire, gives
+ * the delay from writing a line to its last byte arriving.  Then it sends
+ * "SYNC h:mm:ss AM|PM frac" with our time at the expected arrival of that
+ * line, and the clock writes its RTC at the start of our next second.
+ *
+ * The delay is taken to be the same both ways.  USB serial adapters often
+ * hold received bytes back (16ms for an FTDI chip, unless its latency_timer
+ * is set to 1), which breaks that, so turn that off for a good result.
+ * Tracing on the clock should be off too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/select.h>
+
+
+static int fd;
+/** Seconds to send or receive one character. */
+static double char_time;
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static int send_line(const char *s)
+{
+	size_t len = strlen(s);
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, s, len);
+		if (n < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return -1;
+		}
+		s += n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+/**
+ * Read lines until one starts with @e prefix, for up to @e timeout seconds.
+ * The line is left in @e buf without its line ending.
+ *
+ * @return 0, or -1 on timeout or error
+ */
+static int expect(const char *prefix, char *buf, size_t size, double timeout)
+{
+	double end = now() + timeout;
+	double left;
+	struct timeval tv;
+	fd_set fds;
+	size_t len = 0;
+	char c;
+	ssize_t n;
+
+	while ((left = end - now()) > 0) {
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+		tv.tv_sec = (long)left;
+		tv.tv_usec = (long)((left - tv.tv_sec) * 1e6);
+		n = select(fd + 1, &fds, NULL, NULL, &tv);
+		if (n < 0 && EINTR != errno) {
+			return -1;
+		}
+		if (n <= 0) {
+			continue;
+		}
+		n = read(fd, &c, 1);
+		if (n <= 0) {
+			return -1;
+		}
+		if ('\r' == c) {
+			continue;
+		}
+		if ('\n' != c) {
+			if (len < size - 1) {
+				buf[len++] = c;
+			}
+			continue;
+		}
+		buf[len] = '\0';
+		if (! strncmp(buf, prefix, strlen(prefix))) {
+			return 0;
+		}
+		len = 0;
+	}
+	return -1;
+}
+
+
+static speed_t baud_speed(long baud)
+{
+	switch (baud) {
+	case 9600:   return B9600;
+	case 19200:  return B19200;
+	case 38400:  return B38400;
+	case 57600:  return B57600;
+	case 115200: return B115200;
+	case 230400: return B230400;
+	}
+	return 0;
+}
+
+
+static int open_device(const char *path, long baud)
+{
+	struct termios t;
+	speed_t speed = baud_speed(baud);
+
+	if (! speed) {
+		fprintf(stderr, "wcsync: no such baud rate %ld\n", baud);
+		return -1;
+	}
+	fd = open(path, O_RDWR | O_NOCTTY);
+	if (fd < 0 || tcgetattr(fd, &t)) {
+		fprintf(stderr, "wcsync: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	cfmakeraw(&t);
+	cfsetispeed(&t, speed);
+	cfsetospeed(&t, speed);
+	t.c_cc[VMIN] = 1;
+	t.c_cc[VTIME] = 0;
+	if (tcsetattr(fd, TCSANOW, &t)) {
+		fprintf(stderr, "wcsync: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	tcflush(fd, TCIOFLUSH);
+	return 0;
+}
+
+
+/**
+ * Make the SYNC line for our time @e t.
+ */
+static void sync_line(char *buf, size_t size, double t)
+{
+	time_t secs = (time_t)t;
+	struct tm tm;
+	int hour;
+
+	localtime_r(&secs, &tm);
+	hour = tm.tm_hour % 12;
+	snprintf(buf, size, "SYNC %d:%02d:%02d %s %04d\r", hour ? hour : 12,
+		 tm.tm_min, tm.tm_sec, tm.tm_hour >= 12 ? "PM" : "AM",
+		 (int)((t - secs) * 10000));
+}
+
+
+int main(int argc, char **argv)
+{
+	long baud = 38400;
+	int pings = 8;
+	int good = 0;
+	int opt;
+	int i;
+	char reply[128];
+	char line[64];
+	double t0, rtt, latency, best = 1e9, arrive;
+	unsigned waited;
+
+	while (-1 != (opt = getopt(argc, argv, "b:n:"))) {
+		switch (opt) {
+		case 'b':
+			baud = atol(optarg);
+			break;
+		case 'n':
+			pings = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind + 1 != argc || pings < 1) {
+		goto usage;
+	}
+	if (open_device(argv[optind], baud)) {
+		return 2;
+	}
+	/* A start bit, eight data bits and a stop bit. */
+	char_time = 10.0 / baud;
+
+	if (send_line("\x1bQUIET ON\r")
+	    || expect("Quiet", reply, sizeof(reply), 2.0)) {
+		fprintf(stderr, "wcsync: no answer to QUIET ON\n");
+		return 1;
+	}
+
+	for (i = 0; i < pings; i++) {
+		t0 = now();
+		if (send_line("SYNC\r")
+		    || expect("Sync", reply, sizeof(reply), 1.0)) {
+			continue;
+		}
+		rtt = now() - t0;
+		if (1 != sscanf(reply, "Sync %u", &waited)) {
+			/* Sync busy */
+			continue;
+		}
+		/* Each way, less the characters on the wire. */
+		latency = (rtt - waited / 10000.0
+			   - (strlen("SYNC\r") + strlen(reply) + 2) * char_time)
+			/ 2;
+		if (latency < best) {
+			best = latency;
+		}
+		good++;
+	}
+	if (! good) {
+		fprintf(stderr, "wcsync: no answers to SYNC\n");
+		return 1;
+	}
+
+	/* The line's length hardly depends on the time, so make it once to
+	   find that, then again with the arrival time. */
+	sync_line(line, sizeof(line), now());
+	arrive = now() + best + strlen(line) * char_time;
+	sync_line(line, sizeof(line), arrive);
+	if (send_line(line)
+	    || expect("Sync", reply, sizeof(reply), 3.0)) {
+		fprintf(stderr, "wcsync: no answer to SYNC\n");
+		return 1;
+	}
+	printf("delay %.1fms (best of %d), %s\n",
+	       (best + strlen(line) * char_time) * 1000, good, reply);
+	return strncmp(reply, "Synced", 6) ? 1 : 0;
+
+ usage:
+	fprintf(stderr, "usage: wcsync [-b BAUD] [-n PINGS] DEVICE\n");
+	return 2;
+}
@@ -4,14 +4,44 @@
  * Connect to a device via TWI and transfer data.
  *
  * We run two state machines here.  The QP-nano state machine is a very simple
- * QHsm.  In addition, the interrupt handler is implemented as an informal FSM
- * indexed by function pointer.  The real interrupt handler calls through that
- * function pointer to the handler, and the handler sets the next state by
- * changing the function pointer.
+ * QHsm.  In addition, the interrupt handler is a small FSM.  Its state is the
+ * phase of the current request (struct TWI.phase), and the TWI status tells
+ * us what has just happened.  A table indexed by the status (twi_actions)
+ * gives the phase in which that status is expected, and what to do next.  A
+ * status that doesn't match the phase is an error.
  *
- * @todo Handle the errors that can be produced by the TWI at each stage of a
- * transaction.  Ensure we handle all the cases mentioned in the ATmega32
- * documentation.
+ * Requests arrive as chains, and wait in a FIFO (struct TWI.chains) until the
+ * bus is free.  The QP-nano state machine only adds chains to the FIFO, and
+ * starts the bus if it is idle.  The interrupt handler does the rest: it sends
+ * each reply straight to the requester, and when a chain finishes it starts
+ * the next one with a STOP followed by a START, without waiting for the event
+ * loop.
+ *
+ * Each chain has TWI_DEADLINE_TICKS to finish, enforced by the QP-nano state
+ * machine's time event.  A NACK fails the rest of its chain but leaves the bus
+ * in a known state, so the interrupt handler goes straight on to the next
+ * chain.  A timeout or any unexpected status stops the bus, fails the chain,
+ * and the state machine recovers the bus (see twi_recover_bus()) before
+ * starting the next chain.  Nothing waits or loops in the interrupt handler.
+ *
+ * QF-nano runs here without interrupt nesting, so time spent in the TWI
+ * interrupt handler delays the tick and the USART interrupts.  The budget for
+ * the handler is 100 cycles (about 27us at 3.6864MHz) for sending or receiving
+ * a byte in the middle of a request, including entry and exit.  Counting the
+ * instructions, that path is about 40 cycles of work, plus about 70 for the
+ * vector, saving and restoring the registers, and RETI.  (The registers are
+ * all saved because the paths that finish a request call QActive_postISR().)
+ * A byte on the bus takes 90us, so the TWI is never kept waiting.  The paths
+ * that finish a request or a chain also post events and take several times
+ * as long, but happen once per request.  Use "make twi-isr" to disassemble
+ * the handler and check the count after changing it.
+ *
+ * To measure it, build with "make WORDCLOCK_TWI_TIMING=1".  Timer 2 then runs
+ * at clk/8, the handler notes it on entry and exit, and STATS shows the
+ * longest run since boot, to 8 cycles.  That is the body only: add the entry
+ * and exit (the 70 cycles above).  Timer 1 (BSP_stamp()) counts in 256 cycle
+ * steps, which is too coarse for this.  The host simulation doesn't count
+ * Timer 2, so there it shows 0.
  */
 
 
@@ -28,6 +58,9 @@
 
 Q_DEFINE_THIS_FILE;
 
+/** This file's number in binary trace IDs, see ST(). */
+#define TRACE_FILE 2
+
 
 /**
  * Interface to a TWI slave.
@@ -37,55 +70,83 @@ struct TWI twi;
 
 static QState twiInitial        (struct TWI *me);
 static QState twiState          (struct TWI *me);
-static QState twiBusyState      (struct TWI *me);
-
-typedef void (*TWIInterruptHandler)(struct TWI *me);
 
 static void twi_init(void);
 
 
 /**
- * This function gets called from the TWI interrupt handler.
- *
- * This function pointer implements the interrupt state machine, and is set to
- * different handlers depending on what state we expect the TWI bus to be in at
- * the next interrupt.  Each handler is expected to check for its own errors,
- * reenable the bus for the next part of the transaction, and then set the
- * handler to the correct function for the next TWI bus state.
+ * Phases of a request, as seen by the interrupt handler.
  */
-volatile TWIInterruptHandler twint;
+enum TWIPhase {
+	TWI_PHASE_IDLE = 0,	/**< No request. */
+	TWI_PHASE_START,	/**< START sent, SLA+R/W is next. */
+	TWI_PHASE_MT,		/**< Master transmitter, sending data. */
+	TWI_PHASE_MR,		/**< Master receiver, receiving data. */
+};
+
 
 /**
- * Atomically set the interrupt handler state function pointer.
- *
- * Only call this when setting the function pointer with interrupts on, as it
- * will ensure interrupts are off before changing the function pointer.  If you
- * want to set the function pointer inside an interrupt handler (or inside one
- * of the interrupt state machine functions) don't bother calling this - just
- * set it.
- *
- * @param handler the interrupt state machine function pointer
- *
- * @param twcr if @e set_twcr is non-zero, also write @e twcr into TWCR, the
- * TWI Control Register
- *
- * @param set_twcr if non-zero, write @e twcr into TWCR
+ * What the interrupt handler does for each TWI status.
  */
-static void set_twint(TWIInterruptHandler handler,
-		      uint8_t twcr, uint8_t set_twcr);
+enum TWIAction {
+	TWI_ACT_ERROR = 0,	/**< Unexpected status. */
+	TWI_ACT_SEND_SLA,	/**< Send the address and R/W. */
+	TWI_ACT_NACK,		/**< The slave NACKed. */
+	TWI_ACT_MT_NEXT,	/**< Send the next byte, or finish. */
+	TWI_ACT_MR_FIRST,	/**< Start receiving. */
+	TWI_ACT_MR_BYTE,	/**< Store a byte, and ask for another. */
+	TWI_ACT_MR_LAST,	/**< Store the last byte, and finish. */
+};
+
 
-static void send_start(struct TWI *me);
+/** Make an entry in twi_actions. */
+#define TWI_ACTION(phase,action) (((phase) << 4) | (action))
 
-static void twint_null(struct TWI *me);
-static void twint_start_sent(struct TWI *me);
-static void twint_MT_address_sent(struct TWI *me);
-static void twint_MR_address_sent(struct TWI *me);
-static void twint_MT_data_sent(struct TWI *me);
-static void twint_MR_data_received(struct TWI *me);
 
+/**
+ * The interrupt handler's dispatch table, indexed by TWSR status >> 3.
+ *
+ * Each entry is the phase in which we expect that status, in the high nybble,
+ * and the action, in the low nybble.  Master mode statuses stop at 0x58.
+ * Anything else, including 0x00 (bus error) and 0x38 (arbitration lost), is an
+ * error.
+ */
+static const uint8_t twi_actions[] PROGMEM = {
+	/* 0x00 */ TWI_ACTION(TWI_PHASE_IDLE , TWI_ACT_ERROR   ),
+	/* 0x08 */ TWI_ACTION(TWI_PHASE_START, TWI_ACT_SEND_SLA),
+	/* 0x10 */ TWI_ACTION(TWI_PHASE_START, TWI_ACT_SEND_SLA),
+	/* 0x18 */ TWI_ACTION(TWI_PHASE_MT   , TWI_ACT_MT_NEXT ),
+	/* 0x20 */ TWI_ACTION(TWI_PHASE_MT   , TWI_ACT_NACK    ),
+	/* 0x28 */ TWI_ACTION(TWI_PHASE_MT   , TWI_ACT_MT_NEXT ),
+	/* 0x30 */ TWI_ACTION(TWI_PHASE_MT   , TWI_ACT_NACK    ),
+	/* 0x38 */ TWI_ACTION(TWI_PHASE_IDLE , TWI_ACT_ERROR   ),
+	/* 0x40 */ TWI_ACTION(TWI_PHASE_MR   , TWI_ACT_MR_FIRST),
+	/* 0x48 */ TWI_ACTION(TWI_PHASE_MR   , TWI_ACT_NACK    ),
+	/* 0x50 */ TWI_ACTION(TWI_PHASE_MR   , TWI_ACT_MR_BYTE ),
+	/* 0x58 */ TWI_ACTION(TWI_PHASE_MR   , TWI_ACT_MR_LAST ),
+};
+
+
+/** TWCR to carry on with the transaction. */
+#define TWCR_GO    ((1 << TWINT) | (1 << TWEN) | (1 << TWIE))
+/** TWCR to carry on, and ACK the next byte received. */
+#define TWCR_ACK   (TWCR_GO | (1 << TWEA))
+/** TWCR to send a START or REPEATED START. */
+#define TWCR_START (TWCR_GO | (1 << TWSTA))
+
+
+static void twi_int_nack(struct TWI *me);
 static void twi_int_error(struct TWI *me, uint8_t status);
 
-static void start_request(struct TWI *);
+static void reply_chain(struct TWI *me, uint8_t status, uint8_t isr);
+static void twi_recover_bus(void);
+static void next_chain(struct TWI *me);
+static void arm_deadline(struct TWI *me, uint8_t busy);
+
+static uint8_t enqueue_chain(struct TWI *me, struct TWIRequest **chain);
+static void start_request(struct TWI *me, uint8_t twcr);
+static void request_done(struct TWI *me, struct TWIRequest *request);
+static void chain_done(struct TWI *me);
 
 
 void twi_ctor(void)
@@ -94,14 +155,19 @@ void twi_ctor(void)
 
 	QActive_ctor((QActive*)(&twi), (QStateHandler)&twiInitial);
 	twi_init();
-	twi.requests[0] = 0;
-	twi.requests[1] = 0;
+	twi.head = 0;
+	twi.tail = 0;
+	twi.nchains = 0;
+	twi.chainsDone = 0;
+	twi.request = 0;
 	twi.requestIndex = 0;
-	ST("TWI address==");
-	serial_trace_hex_int((unsigned int)(&twi));
-	ST(" &name==");
-	serial_trace_hex_int((unsigned int)(twiName));
-	STD("\r\n");
+	if (TRACING(VERBOSE)) {
+		STV("TWI address==");
+		serial_trace_hex_int((unsigned int)(&twi));
+		STV(" &name==");
+		serial_trace_hex_int((unsigned int)(twiName));
+		STV("\r\n");
+	}
 	twi.super.name = twiName;
 }
 
@@ -111,465 +177,599 @@ void twi_ctor(void)
  */
 static void twi_init(void)
 {
-	set_twint(twint_null, 0, 0);
+#ifdef WORDCLOCK_TWI_TIMING
+	TCCR2 = (1 << CS21);
+#endif
+	twi.phase = TWI_PHASE_IDLE;
 	TWCR = 0;
 	TWSR = 0;		/* Prescaler = 4^0 = 1 */
 	TWBR=10;		/* Approx 100kbits/s SCL */
 }
 
 
-static QState twiInitial(struct TWI *me)
+
+/**
+ * True when the TWI hardware has set TWINT.
+ *
+ * The host simulation (bsp-posix.c) can't see a written one clearing TWINT,
+ * so it marks a TWINT set by the hardware separately, and defines its own
+ * version of this.
+ */
+#ifndef TWINT_IS_SET
+#define TWINT_IS_SET() (TWCR & (1 << TWINT))
+#endif
+
+
+/**
+ * Wait for the TWI to finish the action started by writing @e twcr.
+ *
+ * @return the TWI status, or 0 if the TWI did not finish in about 10ms.
+ */
+static uint8_t twi_polled(uint8_t twcr)
 {
-	return Q_TRAN(twiState);
+	uint16_t n;
+
+	TWCR = twcr;
+	for (n = 0; n < 10000; n++) {
+		if (TWINT_IS_SET()) {
+			return TWSR & 0xf8;
+		}
+		_delay_us(1);
+	}
+	return 0;
 }
 
 
-static QState twiState(struct TWI *me)
+/**
+ * Read from a TWI device by polling, with interrupts off.
+ *
+ * This is for use at boot, before twi_ctor() and QF_run(), so we can read the
+ * RTC before anything else happens.  It does a register address write, a
+ * REPEATED START and a burst read, all in one bus transaction.
+ *
+ * @param address the device's bus address, without the R/W bit
+ *
+ * @param reg the first register to read
+ *
+ * @param bytes where to put the data
+ *
+ * @param nbytes how many bytes to read, at least one
+ *
+ * @return TWI_OK, or TWI_NACK if any part of the transaction failed
+ */
+uint8_t twi_read_polled(uint8_t address, uint8_t reg,
+			uint8_t *bytes, uint8_t nbytes)
 {
-	struct TWIRequest **requestp;
-	struct TWIRequest *request;
+	uint8_t status = TWI_NACK;
+	uint8_t i;
+
+	TWSR = 0;
+	TWBR = 10;
+
+	if (TWI_08_START_SENT != twi_polled((1 << TWINT) |
+					    (1 << TWSTA) |
+					    (1 << TWEN )))
+		goto stop;
+	TWDR = (address << 1) | 0b0;
+	if (TWI_18_MT_SLA_W_TX_ACK_RX != twi_polled((1 << TWINT) |
+						    (1 << TWEN )))
+		goto stop;
+	TWDR = reg;
+	if (TWI_28_MT_DATA_TX_ACK_RX != twi_polled((1 << TWINT) |
+						   (1 << TWEN )))
+		goto stop;
+	if (TWI_10_REPEATED_START_SENT != twi_polled((1 << TWINT) |
+						     (1 << TWSTA) |
+						     (1 << TWEN )))
+		goto stop;
+	TWDR = (address << 1) | 0b1;
+	if (TWI_40_MR_SLA_R_TX_ACK_RX != twi_polled((1 << TWINT) |
+						    (1 << TWEN )))
+		goto stop;
+	for (i = 0; i < nbytes; i++) {
+		/* ACK every byte but the last. */
+		if (i < nbytes - 1) {
+			if (TWI_50_MR_DATA_RX_ACK_TX !=
+			    twi_polled((1 << TWINT) | (1 << TWEN) | (1 << TWEA)))
+				goto stop;
+		} else {
+			if (TWI_58_MR_DATA_RX_NACK_TX !=
+			    twi_polled((1 << TWINT) | (1 << TWEN)))
+				goto stop;
+		}
+		bytes[i] = TWDR;
+	}
+	status = TWI_OK;
 
-	switch (Q_SIG(me)) {
+ stop:
+	TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);
+	/* TWSTO clears when the STOP has gone out. */
+	for (i = 0; i < 100 && (TWCR & (1 << TWSTO)); i++) {
+		_delay_us(1);
+	}
+	return status;
+}
 
-	case Q_ENTRY_SIG:
-		return Q_HANDLED();
 
-	case TWI_REQUEST_SIGNAL:
-		requestp = (struct TWIRequest **)Q_PAR(me);
-		Q_ASSERT( requestp );
-		request = *requestp;
-		ST("TWI Got TWI_REQUEST_SIGNAL\r\n");
-		Q_ASSERT( request );
-		Q_ASSERT( ! me->requests[0] );
-		me->requests[0] = request;
-		requestp++;
-		request = *requestp;
-		Q_ASSERT( ! me->requests[1] );
-		me->requests[1] = request;
-		me->requestIndex = 0;
-		return Q_TRAN(twiBusyState);
 
-	case Q_TIMEOUT_SIG:
-		ST("TWI timeout without outstanding request\r\n");
-		return Q_HANDLED();
-
-	}
-	return Q_SUPER(&QHsm_top);
+static QState twiInitial(struct TWI *me)
+{
+	return Q_TRAN(twiState);
 }
 
 
-/**
- * Wait here until the interrupt state machine tells us it's finished the
- * TWI requests.  Reject any further TWI requests.
- */
-static QState twiBusyState(struct TWI *me)
+static QState twiState(struct TWI *me)
 {
-	uint8_t r;
+	struct TWIRequest **chain;
 	uint8_t sreg;
-	struct TWIRequest **requestp;
+	uint8_t busy;
 
 	switch (Q_SIG(me)) {
 
 	case Q_ENTRY_SIG:
-		STD("TWI > twiBusyState\r\n");
-		start_request(me);
 		return Q_HANDLED();
 
-	case Q_EXIT_SIG:
-		STD("TWI < twiBusyState\r\n");
+	case TWI_REQUEST_SIGNAL:
+		chain = (struct TWIRequest **)Q_PAR(me);
+		Q_ASSERT( chain );
+		Q_ASSERT( chain[0] );
+		if (TRACING(VERBOSE)) {
+			STV("TWI addr=");
+			serial_trace_hex_int(chain[0]->address & 0xfe);
+			if (chain[0]->address & 0b1) {
+				STV("(r)");
+			} else {
+				STV("(w)");
+			}
+			STV(" nbytes=");
+			serial_trace_int(chain[0]->nbytes);
+			STV("\r\n");
+		}
+		if (enqueue_chain(me, chain)) {
+			arm_deadline(me, 1);
+		}
+		return Q_HANDLED();
+
+	case TWI_FINISHED_SIGNAL:
+		STV("TWI chain finished\r\n");
+		/* The interrupt handler may have started another chain. */
 		sreg = SREG;
 		cli();
-		me->requests[0] = 0;
-		me->requests[1] = 0;
-		me->requestIndex = 0;
+		busy = (0 != me->request);
 		SREG = sreg;
+		arm_deadline(me, busy);
 		return Q_HANDLED();
 
-	case TWI_REQUEST_SIGNAL:
-		STD("TWI got excess TWI_REQUEST_SIGNAL\r\n");
-		requestp = (struct TWIRequest **)Q_PAR(me);
-		if (requestp[0]) {
-			requestp[0]->status = TWI_QUEUE_FULL;
-			fff(requestp[0]->qactive);
-			QActive_post(requestp[0]->qactive, requestp[0]->signal,
-				     (QParam)requestp[0]);
-		}
-		if (requestp[1]) {
-			requestp[1]->status = TWI_QUEUE_FULL;
-			fff(requestp[1]->qactive);
-			QActive_post(requestp[1]->qactive, requestp[1]->signal,
-				     (QParam)requestp[1]);
-		}
+	case TWI_ERROR_SIGNAL:
+		SF("TWI bus error, status=%x\r\n", (uint8_t)Q_PAR(me));
+		twi_recover_bus();
+		next_chain(me);
 		return Q_HANDLED();
 
-	case TWI_REPLY_SIGNAL:
-		STD("TWI got TWI_REPLY_SIGNAL\r\n");
-		r = (uint8_t) Q_PAR(me);
-		fff(me->requests[r]->qactive);
-		QActive_post(me->requests[r]->qactive, me->requests[r]->signal,
-			     (QParam)me->requests[r]);
+	case Q_TIMEOUT_SIG:
+		/* Check that this is for the chain still on the bus, and not
+		   one that finished just as the time event fired. */
+		sreg = SREG;
+		cli();
+		busy = me->request && me->chainsDone == me->deadlineChain;
+		if (busy) {
+			me->phase = TWI_PHASE_IDLE;
+			TWCR = 0;
+			me->request = 0;
+		}
+		SREG = sreg;
+		if (! busy) {
+			ST("TWI stale timeout\r\n");
+			return Q_HANDLED();
+		}
+		S("TWI timeout\r\n");
+		reply_chain(me, TWI_TIMEOUT, 0);
+		twi_recover_bus();
+		next_chain(me);
 		return Q_HANDLED();
 
-	case TWI_FINISHED_SIGNAL:
-		return Q_TRAN(twiState);
-
 	}
-	return Q_SUPER(twiState);
+	return Q_SUPER(&QHsm_top);
 }
 
 
 /**
- * Called at the very start of a request.
+ * Add a chain of requests to the FIFO, and start the bus if it's idle.
  *
- * The request can be either a single request, or a chain of two.  The chaining
- * of requests (with a REPEATED START) is handled later in the interrupt
- * handler.
+ * If the FIFO is full, every request in the chain is returned straight away
+ * with TWI_QUEUE_FULL.  Make TWI_QUEUE_LENGTH at least the number of chains
+ * that can be outstanding at once, and that won't happen.
+ *
+ * @return non-zero if this chain was started
  */
-static void start_request(struct TWI *me)
+static uint8_t enqueue_chain(struct TWI *me, struct TWIRequest **chain)
 {
-	Q_ASSERT( ! me->requestIndex );
-	ST("TWI addr=");
-	serial_trace_hex_int(me->requests[0]->address & 0xfe);
-	if (me->requests[0]->address & 0b1) {
-		ST("(r)");
-	} else {
-		ST("(w)");
+	uint8_t sreg;
+
+	sreg = SREG;
+	cli();
+	if (me->nchains >= TWI_QUEUE_LENGTH) {
+		SREG = sreg;
+		STE("TWI queue full\r\n");
+		while (*chain) {
+			(*chain)->status = TWI_QUEUE_FULL;
+			fff((*chain)->qactive);
+			QActive_post((*chain)->qactive, (*chain)->signal,
+				     (QParam)(*chain));
+			chain++;
+		}
+		return 0;
 	}
-	ST(" nbytes=");
-	serial_trace_int(me->requests[0]->nbytes);
-	STD("\r\n");
-	me->requests[0]->count = 0;
-	send_start(me);
+	me->chains[me->head] = chain;
+	me->head ++;
+	if (me->head >= TWI_QUEUE_LENGTH)
+		me->head = 0;
+	me->nchains ++;
+	if (1 == me->nchains) {
+		/* The bus was idle, so this chain goes first. */
+		me->requestIndex = 0;
+		me->request = chain[0];
+		start_request(me, TWCR_START);
+		SREG = sreg;
+		return 1;
+	}
+	SREG = sreg;
+	return 0;
 }
 
 
 /**
- * Interrupt handler for the TWI.  Not much work is done by this function -
- * it's all done by calling the interrupt state function.
+ * Start or stop the deadline for the chain on the bus.
+ *
+ * The time event can fire just after the interrupt handler has finished the
+ * chain, so we remember which chain the deadline is for.  me->chainsDone only
+ * changes when a chain leaves the FIFO.
+ *
+ * @param busy non-zero if a chain is on the bus
  */
-SIGNAL(TWI_vect)
+static void arm_deadline(struct TWI *me, uint8_t busy)
 {
-	static uint8_t counter = 0;
-
-	counter ++;
-	if (0 == counter)
-		ST(",");
-	if (! twi.requests[twi.requestIndex]) {
-		twint = twint_null;
+	if (busy) {
+		me->deadlineChain = me->chainsDone;
+		QActive_arm((QActive*)me, TWI_DEADLINE_TICKS);
+	} else {
+		QActive_disarm((QActive*)me);
 	}
-	(*twint)(&twi);
 }
 
 
-static void set_twint(TWIInterruptHandler handler,
-		      uint8_t twcr, uint8_t set_twcr)
+/**
+ * Take a failed chain off the FIFO, and start the next one if there is one.
+ *
+ * This is called by the state machine after the interrupt handler or the
+ * deadline has stopped the bus, and after the bus has been recovered.  The
+ * failed chain's requests have already been replied to.
+ */
+static void next_chain(struct TWI *me)
 {
 	uint8_t sreg;
+	uint8_t busy = 0;
 
 	sreg = SREG;
 	cli();
-	twint = handler;
-	if (set_twcr) {
-		TWCR = twcr;
+	me->tail ++;
+	if (me->tail >= TWI_QUEUE_LENGTH)
+		me->tail = 0;
+	me->nchains --;
+	me->chainsDone ++;
+	if (me->nchains) {
+		me->requestIndex = 0;
+		me->request = me->chains[me->tail][0];
+		start_request(me, TWCR_START);
+		busy = 1;
 	}
 	SREG = sreg;
+	arm_deadline(me, busy);
 }
 
 
-static void send_start(struct TWI *me)
+/** SCL is PC0 on the ATmega32. */
+#define TWI_SCL (1 << 0)
+/** SDA is PC1 on the ATmega32. */
+#define TWI_SDA (1 << 1)
+
+
+/**
+ * Free the bus from a slave that is holding SDA low, and reset the TWI.
+ *
+ * A slave that lost track of the master part way through sending a byte will
+ * wait for the rest of the clocks for that byte.  We disconnect the TWI from
+ * the pins, then clock SCL by hand until SDA goes high, up to nine times (a
+ * byte and an ACK).  Then we send a STOP, so the slave knows the bus is free,
+ * and give the pins back to the TWI.
+ *
+ * The pins are driven open drain, by switching between output low and input.
+ * The bus pull-up resistors do the rest.  This takes up to about 100us, and is
+ * only called from the state machine, never from the interrupt handler.
+ */
+static void twi_recover_bus(void)
 {
-	set_twint(twint_start_sent,
-		  (1 << TWINT) |
-		  (1 << TWSTA) |
-		  (1 << TWEN ) |
-		  (1 << TWIE ),
-		  1);
+	uint8_t i;
+
+	TWCR = 0;
+	PORTC &= ~(TWI_SCL | TWI_SDA);
+	DDRC &= ~(TWI_SCL | TWI_SDA);
+	for (i = 0; i < 9 && ! (PINC & TWI_SDA); i++) {
+		DDRC |= TWI_SCL;
+		_delay_us(5);
+		DDRC &= ~TWI_SCL;
+		_delay_us(5);
+	}
+	/* STOP: SDA goes low then high while SCL is high. */
+	DDRC |= TWI_SDA;
+	_delay_us(5);
+	DDRC &= ~TWI_SDA;
+	_delay_us(5);
+	twi_init();
 }
 
 
 /**
- * Default interrupt handler that disables the TWI.
+ * Start me->request by sending a START.
+ *
+ * Call this with interrupts off.
+ *
+ * @param twcr the value for TWCR, which will include TWSTA, and may also
+ * include TWSTO to finish the previous chain first
  */
-static void twint_null(struct TWI *me)
+static void start_request(struct TWI *me, uint8_t twcr)
 {
-	/* Notify that we have been called.  This should never happen. */
-	ST("<TWI>");
-	/* Disable the TWI.  We need to set TWINT in order to reset the
-	   internal value of TWINT. */
-	TWCR = (1 << TWINT);
+	me->request->count = 0;
+	me->request->status = TWI_OK;
+	me->phase = TWI_PHASE_START;
+	TWCR = twcr;
 }
 
 
 /**
- * Handle an error detected during the interrupt handler.
+ * Called from the interrupt handler when the current request has finished.
+ *
+ * The reply goes straight to the requester.  If there is another request in
+ * the chain it gets a REPEATED START, otherwise the chain is finished.
  */
-static void twi_int_error(struct TWI *me, uint8_t status)
+static void request_done(struct TWI *me, struct TWIRequest *request)
 {
-	ST("<E>");
-	twint = twint_null;
-	/* Transmit a STOP. */
-	TWCR =  (1 << TWINT) |
-		(1 << TWSTO) |
-		(1 << TWEN );
-	me->requests[me->requestIndex]->status = status;
-	fff(me);
-	QActive_postISR((QActive*)me, TWI_REPLY_SIGNAL, me->requestIndex);
+	fff(request->qactive);
+	QActive_postISR(request->qactive, request->signal, (QParam)request);
+	me->requestIndex ++;
+	me->request = me->chains[me->tail][me->requestIndex];
+	if (me->request) {
+		start_request(me, TWCR_START);
+	} else {
+		chain_done(me);
+	}
 }
 
 
 /**
- * Called when we expect to have sent a start condition and need to next send
- * the TWI bus address (SLA+R/W).
+ * Called from the interrupt handler when the last request of a chain has
+ * finished.
+ *
+ * Take the chain off the FIFO.  If there's another one waiting, send a STOP
+ * and a START together (the TWI does them in that order) to begin it.
+ * Otherwise send a STOP and leave the bus idle.
  */
-static void twint_start_sent(struct TWI *me)
+static void chain_done(struct TWI *me)
 {
-	uint8_t status;
-
-	status = TWSR & 0xf8;
-	switch (status) {
-	case TWI_08_START_SENT:
-	case TWI_10_REPEATED_START_SENT:
-		if (me->requests[me->requestIndex]->address & 0b1) {
-			twint = twint_MR_address_sent;
-		} else {
-			twint = twint_MT_address_sent;
-		}
-		/* Address includes R/W */
-		TWDR = me->requests[me->requestIndex]->address;
+	me->tail ++;
+	if (me->tail >= TWI_QUEUE_LENGTH)
+		me->tail = 0;
+	me->nchains --;
+	me->chainsDone ++;
+	fff(me);
+	QActive_postISR((QActive*)me, TWI_FINISHED_SIGNAL, 0);
+	if (me->nchains) {
+		me->requestIndex = 0;
+		me->request = me->chains[me->tail][0];
+		start_request(me, TWCR_START | (1 << TWSTO));
+	} else {
+		me->request = 0;
+		me->phase = TWI_PHASE_IDLE;
 		TWCR =  (1 << TWINT) |
 			(1 << TWEN ) |
-			(1 << TWIE );
-		break;
-	default:
-		Q_ASSERT(0);
-		twi_int_error(me, status);
-		break;
+			(1 << TWSTO);
 	}
 }
 
 
 /**
- * Called in MT mode, when we are sending data.
+ * Reply to the current request, and any after it in the same chain, with
+ * @e status.
+ *
+ * The rest of the chain depends on the failed request, so there's no point
+ * trying it.
+ *
+ * @param isr non-zero when called from the interrupt handler
  */
-static void twint_MT_address_sent(struct TWI *me)
+static void reply_chain(struct TWI *me, uint8_t status, uint8_t isr)
 {
-	uint8_t status;
-
-	status = TWSR & 0xf8;
-	switch (status) {
-	case TWI_18_MT_SLA_W_TX_ACK_RX:
-		/* We've sent an address or previous data, and got an ACK.  If
-		   there is data to send, send the first byte.  If not,
-		   finish. */
-		if (me->requests[me->requestIndex]->nbytes) {
-			uint8_t data = me->requests[me->requestIndex]->bytes[0];
-			me->requests[me->requestIndex]->count ++;
-			TWDR = data;
-			twint = twint_MT_data_sent;
-			TWCR =  (1 << TWINT) |
-				(1 << TWEN ) |
-				(1 << TWIE );
+	struct TWIRequest **chain;
+
+	chain = me->chains[me->tail] + me->requestIndex;
+	while (*chain) {
+		(*chain)->status = status;
+		fff((*chain)->qactive);
+		if (isr) {
+			QActive_postISR((*chain)->qactive, (*chain)->signal,
+					(QParam)(*chain));
 		} else {
-			/* No more data. */
-			twint = twint_null;
-			TWCR =  (1 << TWINT) |
-				(1 << TWSTO) |
-				(1 << TWEN ) |
-				(1 << TWIE );
+			QActive_post((*chain)->qactive, (*chain)->signal,
+				     (QParam)(*chain));
 		}
-		break;
-
-	case TWI_20_MT_SLA_W_TX_NACK_RX:
-		/* We've sent an address or previous data, and got a NACK. */
-		me->requests[me->requestIndex]->status = status;
-		twint = twint_null;
-		TWCR =  (1 << TWINT) |
-			(1 << TWSTO) |
-			(1 << TWEN ) |
-			(1 << TWIE );
-		break;
-	default:
-		Q_ASSERT(0);
-		twi_int_error(me, status);
-		break;
+		chain++;
 	}
 }
 
 
 /**
- * Called in master transmitter mode, after data has been sent.
+ * Handle a NACK from the slave.
+ *
+ * Fail the chain, then send a STOP and go on to the next chain.  The bus is
+ * fine, it's just that nobody wanted to talk to us.
  */
-static void twint_MT_data_sent(struct TWI *me)
+static void twi_int_nack(struct TWI *me)
 {
-	uint8_t status;
-	uint8_t data;
-	volatile struct TWIRequest *request;
-
-	status = TWSR & 0xf8;
-	switch (status) {
-
-	case TWI_28_MT_DATA_TX_ACK_RX:
-		request = me->requests[me->requestIndex];
-		if (request->count >= request->nbytes) {
-			/* finished */
-			fff(me);
-			QActive_postISR((QActive*)me, TWI_REPLY_SIGNAL,
-					me->requestIndex);
-
-			if ((0 == me->requestIndex) && me->requests[1]) {
-				me->requestIndex ++;
-				Q_ASSERT( me->requestIndex == 1 );
-				twint = twint_start_sent;
-				TWCR =  (1 << TWINT) |
-					(1 << TWEN ) |
-					(1 << TWIE ) |
-					(1 << TWSTA);
-			} else {
-				fff(me);
-				QActive_postISR((QActive*)me, TWI_FINISHED_SIGNAL,
-						0);
-				twint = twint_null;
-				TWCR =  (1 << TWINT) |
-					(1 << TWEN ) |
-					(1 << TWSTO);
-			}
+	reply_chain(me, TWI_NACK, 1);
+	chain_done(me);
+}
 
-		} else {
-			data = request->bytes[request->count];
-			request->count ++;
-			TWDR = data;
-			/* All good, keep going */
-			TWCR =  (1 << TWINT) |
-				(1 << TWEN ) |
-				(1 << TWIE );
-		}
-		break;
 
-	case TWI_30_MT_DATA_TX_NACK_RX:
-		Q_ASSERT(0);
-		/* Ah nu */
-		break;
+/**
+ * Handle an unexpected status from the TWI.
+ *
+ * We don't know what state the bus is in, so fail the chain, stop the TWI,
+ * and leave the rest to the state machine, which will recover the bus.  The
+ * failed chain stays in the FIFO with me->request cleared until then, so
+ * nothing new can start.
+ */
+static void twi_int_error(struct TWI *me, uint8_t status)
+{
+	reply_chain(me, TWI_BUS_ERROR, 1);
+	me->request = 0;
+	me->phase = TWI_PHASE_IDLE;
+	TWCR = 0;
+	fff(me);
+	QActive_postISR((QActive*)me, TWI_ERROR_SIGNAL, status);
+}
 
-	default:
-		serial_send_hex_int(status);
-		_delay_ms(100);
-		Q_ASSERT(0);
-		/* Ah nu */
-		break;
+
+/**
+ * Interrupt handler for the TWI.
+ *
+ * The current request is read once, so it can stay in registers.  There's no
+ * tracing in here, as that would cost more than the rest put together.
+ */
+#ifdef WORDCLOCK_TWI_TIMING
+
+/** The longest run of the interrupt handler, in Timer 2 counts of 8 cycles. */
+static volatile uint8_t isr_max;
+
+static inline void twi_isr(void) __attribute__((always_inline));
+
+SIGNAL(TWI_vect)
+{
+	uint8_t start = TCNT2;
+	uint8_t t;
+
+	twi_isr();
+	t = TCNT2 - start;
+	if (t > isr_max) {
+		isr_max = t;
 	}
 }
 
 
 /**
- * Called in master receiver mode, after the address has been sent.
+ * The longest run of the interrupt handler since boot, in cycles, not
+ * counting entry and exit.
  */
-static void twint_MR_address_sent(struct TWI *me)
+uint16_t twi_isr_max_cycles(void)
 {
-	uint8_t status;
+	return isr_max * 8;
+}
 
-	status = TWSR & 0xf8;
-	switch (status) {
 
-	case TWI_40_MR_SLA_R_TX_ACK_RX:
-		switch (me->requests[me->requestIndex]->nbytes) {
+static inline void twi_isr(void)
+#else
+SIGNAL(TWI_vect)
+#endif
+{
+	struct TWI *me = &twi;
+	struct TWIRequest *request = me->request;
+	uint8_t status = TWSR & 0xf8;
+	uint8_t action = TWI_ACTION(TWI_PHASE_IDLE, TWI_ACT_ERROR);
+	uint8_t count;
+
+	if (! request) {
+		/* This should never happen.  Disable the TWI.  We need to set
+		   TWINT in order to reset the internal value of TWINT. */
+		TWCR = (1 << TWINT);
+		return;
+	}
+	if (status < sizeof(twi_actions) * 8) {
+		action = pgm_read_byte(&twi_actions[status >> 3]);
+	}
+	if ((action >> 4) != me->phase) {
+		action = TWI_ACT_ERROR;
+	}
+
+	switch (action & 0x0f) {
+
+	case TWI_ACT_SEND_SLA:
+		/* Address includes R/W */
+		TWDR = request->address;
+		if (request->address & 0b1) {
+			me->phase = TWI_PHASE_MR;
+		} else {
+			me->phase = TWI_PHASE_MT;
+		}
+		TWCR = TWCR_GO;
+		break;
+
+	case TWI_ACT_MT_NEXT:
+		/* We've sent an address or previous data, and got an ACK. */
+		count = request->count;
+		if (count < request->nbytes) {
+			TWDR = request->bytes[count];
+			request->count = count + 1;
+			TWCR = TWCR_GO;
+		} else {
+			request_done(me, request);
+		}
+		break;
+
+	case TWI_ACT_MR_FIRST:
+		switch (request->nbytes) {
 		case 0:
 			/* No data to receive, so stop now. */
-			twint = twint_null;
-			TWCR =  (1 << TWINT) |
-				(1 << TWEN ) |
-				(1 << TWSTO);
+			request_done(me, request);
 			break;
-
 		case 1:
 			/* We only want one byte, so make sure we NACK this
 			   first byte. */
-			twint = twint_MR_data_received;
-			TWCR =  (1 << TWINT) |
-				(1 << TWEN ) |
-				(1 << TWEA ) |
-				(1 << TWIE );
+			TWCR = TWCR_GO;
 			break;
-
 		default:
 			/* We want more than one byte, so we have to ACK this
 			   first byte to convince the slave to continue. */
-			twint = twint_MR_data_received;
-			TWCR =  (1 << TWINT) |
-				(1 << TWEN ) |
-				(1 << TWEA ) |
-				(1 << TWIE );
+			TWCR = TWCR_ACK;
 			break;
 		}
 		break;
 
-	case TWI_48_MR_SLA_R_TX_NACK_RX:
-		_delay_ms(500);
-		Q_ASSERT(0);
+	case TWI_ACT_MR_BYTE:
+		count = request->count;
+		request->bytes[count] = TWDR;
+		count ++;
+		request->count = count;
+		if (count == request->nbytes - 1) {
+			/* Only one more byte required, so NACK that byte. */
+			TWCR = TWCR_GO;
+		} else {
+			TWCR = TWCR_ACK;
+		}
 		break;
 
-	default:
-		_delay_ms(500);
-		Q_ASSERT(0);
+	case TWI_ACT_MR_LAST:
+		count = request->count;
+		request->bytes[count] = TWDR;
+		request->count = count + 1;
+		/* Tell the requester we've finished this (sub-)request, and
+		   go on to the next. */
+		request_done(me, request);
 		break;
-	}
-}
-
 
-/**
- * Called in master receiver mode, after data has been received.
- */
-static void twint_MR_data_received(struct TWI *me)
-{
-	/* FIXME */
-	uint8_t status;
-	uint8_t data;
-	volatile struct TWIRequest *request;
-
-	status = TWSR & 0xf8;
-	switch (status) {
-
-	case TWI_50_MR_DATA_RX_ACK_TX:
-		request = me->requests[me->requestIndex];
-		data = TWDR;
-		request->bytes[request->count] = data;
-		request->count ++;
-		if (request->count == request->nbytes - 1) {
-			/* Only one more byte required, so NACK that byte. */
-			TWCR =  (1 << TWINT) |
-				(1 << TWEN ) |
-				(1 << TWIE );
-		} else {
-			TWCR =  (1 << TWINT) |
-				(1 << TWEN ) |
-				(1 << TWEA ) |
-				(1 << TWIE );
-		}
+	case TWI_ACT_NACK:
+		twi_int_nack(me);
 		break;
 
-	case TWI_58_MR_DATA_RX_NACK_TX:
-		data = TWDR;
-		request = me->requests[me->requestIndex];
-		request->bytes[request->count] = data;
-		request->count ++;
-		/* Tell the state machine we've finished this (sub-)request. */
-		fff(me);
-		QActive_postISR((QActive*)me, TWI_REPLY_SIGNAL, me->requestIndex);
-		/* Now check for the next request. */
-		if ((0 == me->requestIndex) && me->requests[1]) {
-			me->requestIndex ++;
-			twint = twint_start_sent;
-			TWCR =  (1 << TWINT) |
-				(1 << TWEN ) |
-				(1 << TWIE ) |
-				(1 << TWSTA);
-		} else {
-			fff(me);
-			QActive_postISR((QActive*)me, TWI_FINISHED_SIGNAL, 0);
-			twint = twint_null;
-			TWCR =  (1 << TWINT) |
-				(1 << TWEN ) |
-				(1 << TWSTO);
-		}
+	default:
+		twi_int_error(me, status);
 		break;
 	}
 }
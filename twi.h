@@ -20,23 +20,72 @@ struct TWIRequest {
 
 
 /**
- * This represents a state machine implementing TWI, and one or two requests.
+ * How many chains of requests can wait for the bus.
+ *
+ * Each active object that uses the TWI has at most one chain outstanding, so
+ * this only needs to be as big as the number of TWI users.
+ */
+#ifndef TWI_QUEUE_LENGTH
+#define TWI_QUEUE_LENGTH 4
+#endif
+
+
+/**
+ * How long a chain of requests may take, in clock ticks, once it has started
+ * on the bus.
+ *
+ * A chain normally takes about a millisecond.  Two ticks is at least 50ms, so
+ * anything that takes this long has gone wrong.
+ */
+#ifndef TWI_DEADLINE_TICKS
+#define TWI_DEADLINE_TICKS 2
+#endif
+
+
+/**
+ * This represents a state machine implementing TWI, and a FIFO of request
+ * chains.
+ *
+ * A chain is a null terminated array of pointers to requests.  The requests in
+ * a chain are done one after the other, joined by REPEATED STARTs.  The array
+ * and the requests belong to the requester, and must stay untouched until the
+ * last request in the chain has been replied to.
+ *
+ * The FIFO is shared with the TWI interrupt handler, so only change it with
+ * interrupts off.
  */
 struct TWI {
 	QActiveNamed super;
-	/** Pointers to the current request.  These must be volatile as they're
-	    used by the TWI interrupt handler. */
-	struct TWIRequest volatile *requests[2];
+	/** Chains waiting for, or using, the bus.  The chain at @e tail is the
+	    one in progress. */
+	struct TWIRequest **chains[TWI_QUEUE_LENGTH];
+	/** Where the next chain goes. */
+	uint8_t head;
+	/** The chain being handled. */
+	uint8_t tail;
+	/** Number of chains in the FIFO, including the one in progress. */
+	volatile uint8_t nchains;
 	/** The request currently being handled by the TWI and associated
-	    interrupt handler. */
+	    interrupt handler, or 0 if the bus is idle. */
+	struct TWIRequest *volatile request;
+	/** Index of @e request in its chain. */
 	uint8_t requestIndex;
+	/** Where @e request is up to, for the interrupt handler. */
+	uint8_t phase;
+	/** Count of chains taken off the FIFO, so a deadline can be matched
+	    with its chain. */
+	volatile uint8_t chainsDone;
+	/** The value of @e chainsDone when the deadline was armed. */
+	uint8_t deadlineChain;
 };
 
 
 enum TWICodes {
 	TWI_OK = 0,		/**< Everything went ok. */
-	TWI_QUEUE_FULL,		/**< Too many requests. */
+	TWI_QUEUE_FULL,		/**< Too many chains waiting for the bus. */
 	TWI_NACK,		/**< Some part of the transaction NACKEd. */
+	TWI_BUS_ERROR,		/**< Unexpected TWI status.  The bus was reset. */
+	TWI_TIMEOUT,		/**< Missed the deadline.  The bus was reset. */
 };
 
 
@@ -44,6 +93,12 @@ extern struct TWI twi;
 
 
 void twi_ctor(void);
+uint8_t twi_read_polled(uint8_t address, uint8_t reg,
+			uint8_t *bytes, uint8_t nbytes);
+
+#ifdef WORDCLOCK_TWI_TIMING
+uint16_t twi_isr_max_cycles(void);
+#endif
 
 
 #endif
@@ -9,19 +9,46 @@ enum WordclockSignals {
 	 * running.
 	 */
 	WATCHDOG_SIGNAL = Q_USER_SIG,
+	/** Sent to the TWI.  Parameter is a null terminated array of
+	    pointers to struct TWIRequest. */
 	TWI_REQUEST_SIGNAL,
-	TWI_REPLY_SIGNAL,
+	/** Sent by the TWI interrupt handler to the TWI when it has finished
+	    a chain of requests. */
 	TWI_FINISHED_SIGNAL,
+	/** Sent by the TWI interrupt handler to the TWI when it has stopped
+	    the bus after an unexpected status.  Parameter is the status. */
+	TWI_ERROR_SIGNAL,
 	TWI_REPLY_1_SIGNAL,
 	TWI_REPLY_2_SIGNAL,
-	CHAR_SIGNAL,
+	/** Sent to the commander for each line received.  Parameter is a
+	    pointer to a struct SerialLine, which the commander must give back
+	    with serial_line_done(). */
+	LINE_SIGNAL,
 	/** Sent 20 times a second. */
 	TICK_20TH_SIGNAL,
 	/** Sent by the Wordclock to itself, once per second. */
 	TICK_1S_SIGNAL,
+	/** Sent by the serial transmit interrupt handler when the send
+	    buffer is empty, to each active object that asked with
+	    serial_notify_drained(). */
+	SERIAL_DRAINED_SIGNAL,
 	/** Sent when we need to set the time.  Parameter is a pointer to (at
 	    least) three bytes in DS1307 format. */
 	SET_TIME_SIGNAL,
+	/** Sent by the commander to the wordclock for GET FRESH, to read
+	    the DS1307 now, or use the read already in flight. */
+	RTC_READ_SIGNAL,
+	/** Sent by the wordclock to the commander when the read asked for by
+	    RTC_READ_SIGNAL has finished.  Parameter is the TWI status, zero if
+	    the snapshot has been updated. */
+	SNAPSHOT_SIGNAL,
+	/** Sent by the commander to the wordclock for SYNC.  Parameter is a
+	    pointer to a struct WordclockSync. */
+	SYNC_SIGNAL,
+	/** Sent by the wordclock to the commander when the RTC write for SYNC
+	    is done.  Parameter is how late it was, in units of 0.1ms, or
+	    WORDCLOCK_SYNC_FAILED. */
+	SYNCED_SIGNAL,
 	MAX_PUB_SIG,
 	MAX_SIG,
 };
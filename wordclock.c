@@ -22,6 +22,7 @@
 #include "ds1307.h"
 #include "cpu-speed.h"
 #include <util/delay.h>
+#include <stddef.h>
 
 
 /** The only active Wordclock. */
@@ -30,16 +31,50 @@ struct Wordclock wordclock;
 
 Q_DEFINE_THIS_FILE;
 
+/** This file's number in binary trace IDs, see ST(). */
+#define TRACE_FILE 1
+
 static QState wordclockInitial        (struct Wordclock *me);
 static QState wordclockState          (struct Wordclock *me);
 static QState wordclockSetClockState  (struct Wordclock *me);
 static QState wordclockRunningState   (struct Wordclock *me);
 
-static void print_time(uint8_t *bytes);
 static uint8_t is_5min(uint8_t *bytes);
-static int8_t near_5s_diff(struct Wordclock *me, uint8_t *bytes);
-static void setTick1Scounter(struct Wordclock *me, int8_t diff);
+static void start_rtc_read(struct Wordclock *me);
+static void time_tick(uint8_t *time);
+static void send_time_telemetry(struct Wordclock *me);
+static void publish_snapshot(struct Wordclock *me);
+static void rtc_read_done(struct Wordclock *me, uint8_t status);
+static void sync_target(struct Wordclock *me,
+			const struct WordclockSync *sync);
+static void sync_done(struct Wordclock *me, uint16_t result);
+static void check_drift(struct Wordclock *me, uint8_t *bytes);
 static void turn_on_outputs(uint8_t *bytes);
+static uint8_t hours_24_to_12(uint8_t hours);
+static void warm_save(struct Wordclock *me);
+static void warm_invalidate(void);
+
+
+/**
+ * State kept across a watchdog reset.
+ *
+ * This lives in .noinit, so the C startup code leaves it alone.  It is saved
+ * once a second while we are running, and checked by wordclock_warm() before
+ * being used.  After a power on it contains rubbish, which the check will
+ * (almost always) reject.
+ */
+struct WarmState {
+	uint8_t magic;
+	uint8_t time[3];	/**< Copy of Wordclock.time */
+	uint32_t words;		/**< The words that were lit. */
+	uint8_t trace;		/**< Non-zero if tracing was on. */
+	uint16_t restarts;	/**< Number of warm restarts. */
+	uint8_t check;		/**< Sum of the bytes above, inverted. */
+};
+
+#define WARM_MAGIC 0xA5
+
+static struct WarmState warm __attribute__((section(".noinit")));
 
 
 static QEvent wordclockQueue[5];
@@ -61,15 +96,31 @@ Q_ASSERT_COMPILE(QF_MAX_ACTIVE == Q_DIM(QF_active) - 1);
 int main(int argc, char **argv)
 {
 	uint8_t mcucsr;
+	uint8_t shown;
+	uint16_t shown_us;
 
  startmain:
 
 	mcucsr = MCUCSR;
 	MCUCSR = 0;
 
+	/* Show the time before anything else, and in particular before
+	   waiting for the banner to go out the serial port. */
+	BSP_startmain();
+	outputs_init();
+
+	if ((mcucsr & (1 << WDRF)) && wordclock_warm()) {
+		/* The display, time and tracing are as they were before the
+		   watchdog reset.  Skip the RTC and the banner. */
+		serial_init();
+		goto startqf;
+	}
+
+	shown = wordclock_boot();
+	shown_us = BSP_boot_us();
+
 	serial_init();
-	SD("***\r\n");
-	SD("\r\n\r\n\r\n*** Word Clock ***\r\nStarting\r\n");
+	S("\r\n\r\n\r\n*** Word Clock ***\r\nStarting\r\n");
 	S("Reset:");
 	if (mcucsr & 0b1000)
 		S(" watchdog");
@@ -79,9 +130,15 @@ int main(int argc, char **argv)
 		S(" external");
 	if (mcucsr & 0b0001)
 		S(" poweron");
+	if (shown) {
+		SF("\r\nTime shown after %uus", shown_us);
+	} else {
+		S("\r\nRTC not running");
+	}
 	SD("\r\n\r\n");
 
-	BSP_startmain();
+ startqf:
+	serial_use_saved_baud();
 	/* Initialise the TWI first, as the wordclock sends a signal to the twi
 	   as part of its entry action.  @todo Send the first signal to twi
 	   after a short pause. */
@@ -89,8 +146,6 @@ int main(int argc, char **argv)
 	commander_ctor();
 	wordclock_ctor();
 	BSP_init(); /* initialize the Board Support Package */
-	outputs_init();
-	outputs_off();
 
 	//Q_ASSERT(0);
 	QF_run();
@@ -98,26 +153,192 @@ int main(int argc, char **argv)
 	goto startmain;
 }
 
+
+/**
+ * Read the DS1307 and show the time.
+ *
+ * This is called at the very start of main(), so it doesn't use the TWI
+ * state machine.  If the DS1307 oscillator is stopped (or the DS1307 doesn't
+ * answer) we arrange for wordclockSetClockState to initialise it with a
+ * default time.  If it's running but not set up the way we want it (12 hour
+ * mode, 1Hz square wave) we arrange for it to be rewritten with the same
+ * time.
+ *
+ * @return non-zero if the time is now being shown.
+ */
+uint8_t wordclock_boot(void)
+{
+	static const uint8_t Q_ROM defaultRegs[8] = {
+		0x50,		/* CH=0, seconds = 50 */
+		0x59,		/* 59 minutes */
+		0x65,		/* 12hr, 5pm */
+		0x07,		/* Sunday */
+		0x01,		/* 1st */
+		0x01,		/* January */
+		0x01,		/* 2001 */
+		DS1307_SQW_1HZ,
+	};
+	struct Wordclock *me = &wordclock;
+	uint8_t *regs = me->rtcRegs;
+	uint8_t i;
+
+	me->rtcInit = 0;
+	if (TWI_OK != twi_read_polled(DS1307_ADDRESS, 0, regs, 8)
+	    || (regs[0] & DS1307_CH)) {
+		for (i = 0; i < 8; i++) {
+			regs[i] = Q_ROM_BYTE(defaultRegs[i]);
+		}
+		me->rtcInit = 1;
+		return 0;
+	}
+	if (! (regs[2] & DS1307_12HOUR)) {
+		regs[2] = hours_24_to_12(regs[2]);
+		me->rtcInit = 1;
+	}
+	if (DS1307_SQW_1HZ != regs[7]) {
+		regs[7] = DS1307_SQW_1HZ;
+		me->rtcInit = 1;
+	}
+	me->time[0] = regs[0];
+	me->time[1] = regs[1];
+	me->time[2] = regs[2];
+	turn_on_outputs(me->time);
+	return 1;
+}
+
+
+static uint8_t warm_sum(void)
+{
+	const uint8_t *p = (const uint8_t *)&warm;
+	uint8_t sum = 0;
+	uint8_t i;
+
+	for (i = 0; i < offsetof(struct WarmState, check); i++) {
+		sum += p[i];
+	}
+	return ~sum;
+}
+
+
+/**
+ * Carry on from where we were before a watchdog reset.
+ *
+ * If the saved state is good, put the words back on the display and set the
+ * time and tracing as they were, without touching the RTC.  The RTC will be
+ * read on the first tick to correct the time, which is behind by however long
+ * it took the watchdog to fire.
+ *
+ * @return non-zero if the saved state was used.
+ */
+uint8_t wordclock_warm(void)
+{
+	struct Wordclock *me = &wordclock;
+
+	if (WARM_MAGIC != warm.magic || warm.check != warm_sum()) {
+		return 0;
+	}
+	outputs_set(warm.words);
+	me->time[0] = warm.time[0];
+	me->time[1] = warm.time[1];
+	me->time[2] = warm.time[2];
+	if (warm.trace) {
+		traceon();
+	} else {
+		traceoff();
+	}
+	warm.restarts ++;
+	warm.check = warm_sum();
+	me->rtcInit = 0;
+	me->warmStart = 1;
+	return 1;
+}
+
+
+/**
+ * Save the state that wordclock_warm() needs.
+ */
+static void warm_save(struct Wordclock *me)
+{
+	if (me->coldReset) {
+		return;
+	}
+	warm.magic = WARM_MAGIC;
+	warm.time[0] = me->time[0];
+	warm.time[1] = me->time[1];
+	warm.time[2] = me->time[2];
+	warm.words = outputs_get();
+	warm.trace = tracing();
+	warm.check = warm_sum();
+}
+
+
+/**
+ * Stop a warm restart from using the saved state, while we are changing the
+ * time.
+ */
+static void warm_invalidate(void)
+{
+	warm.magic = 0;
+}
+
+
+/**
+ * Make the next watchdog reset a full boot, with the RTC read and the banner,
+ * rather than a warm restart.  For RESET.
+ */
+void wordclock_cold_reset(void)
+{
+	wordclock.coldReset = 1;
+	warm_invalidate();
+}
+
+
 void wordclock_ctor(void)
 {
 	static const char Q_ROM wordclockName[] = "<wordclock>";
 
 	QActive_ctor((QActive *)(&wordclock), (QStateHandler)&wordclockInitial);
-	ST("WC address==");
-	serial_trace_hex_int((unsigned int)(&wordclock));
-	ST(" &name==");
-	serial_trace_hex_int((unsigned int)(wordclockName));
-	STD("\r\n");
+	if (TRACING(VERBOSE)) {
+		STV("WC address==");
+		serial_trace_hex_int((unsigned int)(&wordclock));
+		STV(" &name==");
+		serial_trace_hex_int((unsigned int)(wordclockName));
+		STV("\r\n");
+	}
 	wordclock.super.name = wordclockName;
 	wordclock.tick20counter = 0;
-	wordclock.tick1Scounter = 0;
+	wordclock.resyncCounter = 0;
 	wordclock.data = 0;
+	wordclock.rtcReading = 0;
+	wordclock.snapshotWanted = 0;
+	wordclock.syncing = 0;
+	wordclock.coldReset = 0;
+	wordclock.snapshot.age = 0xffff;
+	wordclock.snapshot.seq = 0;
+	if (! wordclock.warmStart) {
+		warm.restarts = 0;
+	}
 }
 
 
 static QState wordclockInitial(struct Wordclock *me)
 {
-	return Q_TRAN(&wordclockSetClockState);
+	if (me->rtcInit) {
+		return Q_TRAN(&wordclockSetClockState);
+	}
+	if (me->warmStart) {
+		if (TRACING(INFO)) {
+			STI("WC warm restart ");
+			serial_trace_int(warm.restarts);
+			STI("\r\n");
+		}
+		/* Correct the time on the first tick. */
+		me->resyncCounter = 1;
+	} else {
+		me->resyncCounter = WORDCLOCK_RESYNC_SECONDS;
+	}
+	publish_snapshot(me);
+	return Q_TRAN(&wordclockRunningState);
 }
 
 
@@ -127,25 +348,27 @@ static QState wordclockState(struct Wordclock *me)
 	case WATCHDOG_SIGNAL:
 		BSP_watchdog(me);
 		return Q_HANDLED();
-	case TWI_REPLY_SIGNAL:
 	case TWI_REPLY_1_SIGNAL:
 	case TWI_REPLY_2_SIGNAL:
-		S("WC WTF? I got a ");
-		switch (Q_SIG(me)) {
-		case TWI_REPLY_SIGNAL:
-			S("TWI_REPLY_SIGNAL");
-			break;
-		case TWI_REPLY_1_SIGNAL:
-			S("TWI_REPLY_1_SIGNAL");
-			break;
-		case TWI_REPLY_2_SIGNAL:
-			S("TWI_REPLY_2_SIGNAL");
-			break;
-		default:
-			S("(not a TWI reply signal)");
-			break;
+		SF("WC WTF? I got a TWI_REPLY_%u_SIGNAL in workclockState\r\n",
+		   Q_SIG(me) == TWI_REPLY_1_SIGNAL ? 1 : 2);
+		if (TWI_REPLY_2_SIGNAL == Q_SIG(me)) {
+			/* A read finished after we stopped running.  Any
+			   GET FRESH waits for the read after setting the
+			   clock. */
+			me->rtcReading = 0;
 		}
-		S(" in workclockState\r\n");
+		return Q_HANDLED();
+
+	case RTC_READ_SIGNAL:
+		/* Not running, so answer with the read that follows
+		   setting the clock. */
+		me->snapshotWanted = 1;
+		return Q_HANDLED();
+
+	case SYNC_SIGNAL:
+		/* Already setting the clock. */
+		sync_done(me, WORDCLOCK_SYNC_FAILED);
 		return Q_HANDLED();
 
 	case TICK_20TH_SIGNAL:
@@ -155,6 +378,9 @@ static QState wordclockState(struct Wordclock *me)
 		 * not needed in Wordclock now that we have interrupts from the
 		 * RTC square wave output.
 		 */
+		if (me->snapshot.age != 0xffff) {
+			me->snapshot.age ++;
+		}
 		me->tick20counter ++;
 		if (20 == me->tick20counter) {
 			fff(me);
@@ -170,47 +396,66 @@ static QState wordclockSetClockState(struct Wordclock *me)
 	switch (Q_SIG(me)) {
 
 	case Q_ENTRY_SIG:
-		STD("WC setting clock\r\n");
+		STI("WC setting clock\r\n");
+		warm_invalidate();
 		me->twiRequest1.qactive = (QActive*)me;
 		me->twiRequest1.signal = TWI_REPLY_1_SIGNAL;
 		me->twiRequest1.address = DS1307_ADDRMASK | 0b0;
-		me->twiRequest1.bytes = me->twiBuffer1;
+		me->twiRequest1.bytes = me->twiBuffer2;
 
-		me->twiBuffer1[0] = 0;	 /* register address */
+		me->twiBuffer2[0] = 0;	 /* register address */
 		if (me->data) {
-			me->twiBuffer1[1] = me->data[0];
-			me->twiBuffer1[2] = me->data[1];
-			me->twiBuffer1[3] = me->data[2];
+			me->twiBuffer2[1] = me->data[0];
+			me->twiBuffer2[2] = me->data[1];
+			me->twiBuffer2[3] = me->data[2];
 			me->twiRequest1.nbytes = 4;
 		} else {
-			me->twiBuffer1[1] = 0x50; /* CH=0, seconds = 50 */
-			me->twiBuffer1[2] = 0x59; /* 59 minutes */
-			me->twiBuffer1[3] = 0x65; /* 12hr, 5pm */
-			me->twiBuffer1[4] = 0x07; /* Sunday */
-			me->twiBuffer1[5] = 0x01; /* 1st */
-			me->twiBuffer1[6] = 0x01; /* January */
-			me->twiBuffer1[7] = 0x01; /* 2001 */
-			me->twiBuffer1[8] = (1<<7) | (1<<4); /* 1Hz sqw */
+			/* All the registers, as set up by wordclock_boot(). */
+			for (uint8_t i=0; i<8; i++) {
+				me->twiBuffer2[i+1] = me->rtcRegs[i];
+			}
 			me->twiRequest1.nbytes = 9;
 		}
 		me->twiRequest1.count = 0;
-		fff(&twi);
 		me->twiRequestAddresses[0] = &(me->twiRequest1);
 		me->twiRequestAddresses[1] = 0;
+		if (me->syncing) {
+			/* Straight from the timer interrupt to the TWI, so
+			   the write is as close to syncAt as we can get. */
+			BSP_post_at(me->syncAt, (QActive*)(&twi),
+				    TWI_REQUEST_SIGNAL,
+				    (QParam)(me->twiRequestAddresses));
+			return Q_HANDLED();
+		}
+		fff(&twi);
 		QActive_post((QActive*)(&twi), TWI_REQUEST_SIGNAL,
 			     (QParam)(me->twiRequestAddresses));
 		return Q_HANDLED();
 
 	case TWI_REPLY_1_SIGNAL:
-		ST("WC Got TWI_REPLY_1_SIGNAL in set: status=");
-		serial_trace_int(me->twiRequest1.status);
-		STD("\r\n");
-		turn_on_outputs(me->twiBuffer1 + 1);
+		if (TRACING(TRACE)) {
+			ST("WC Got TWI_REPLY_1_SIGNAL in set: status=");
+			serial_trace_int(me->twiRequest1.status);
+			ST("\r\n");
+		}
+		me->time[0] = me->twiBuffer2[1] & 0x7f;
+		me->time[1] = me->twiBuffer2[2];
+		me->time[2] = me->twiBuffer2[3];
+		turn_on_outputs(me->time);
+		publish_snapshot(me);
+		if (me->syncing) {
+			sync_done(me, me->twiRequest1.status
+				  ? WORDCLOCK_SYNC_FAILED
+				  : (uint16_t)(BSP_stamp() - me->syncAt));
+		}
 		return Q_TRAN(wordclockRunningState);
 
 	case Q_EXIT_SIG:
-		me->tick1Scounter = 5;
+		/* Read the time back on the first tick, to check the write. */
+		me->resyncCounter = 1;
 		me->data = 0;
+		me->rtcInit = 0;
+		me->syncing = 0;
 		return Q_HANDLED();
 
 	}
@@ -223,14 +468,14 @@ static QState wordclockRunningState(struct Wordclock *me)
 	switch (Q_SIG(me)) {
 
 	case Q_ENTRY_SIG:
-		STD("Running...");
+		STI("Running...");
 		enable_1hz_interrupts(1);
-		STD(" RTC SQW interrupts on\r\n");
+		STI(" RTC SQW interrupts on\r\n");
 		return Q_HANDLED();
 
 	case TICK_1S_SIGNAL:
 
-		ST("WC 1S\r\n");
+		STV("WC 1S\r\n");
 
 		me->interval_5min ++;
 
@@ -238,45 +483,44 @@ static QState wordclockRunningState(struct Wordclock *me)
 			return Q_TRAN(wordclockSetClockState);
 		}
 
-		me->tick1Scounter --;
-		if (me->tick1Scounter) {
-			return Q_HANDLED();
+		time_tick(me->time);
+		publish_snapshot(me);
+		send_time_telemetry(me);
+		if (is_5min(me->time)) {
+			me->interval_5min = 0;
+			turn_on_outputs(me->time);
 		}
+		warm_save(me);
 
-		me->twiRequest1.qactive = (QActive*)me;
-		me->twiRequest1.signal = TWI_REPLY_1_SIGNAL;
-		me->twiRequest1.address = DS1307_ADDRMASK | 0b0;
-		me->twiRequest1.bytes = me->twiBuffer1;
-		me->twiBuffer1[0] = 0;
-		me->twiRequest1.nbytes = 1;
-		me->twiRequest2.count = 0;
-
-		me->twiRequest2.qactive = (QActive*)me;
-		me->twiRequest2.signal = TWI_REPLY_2_SIGNAL;
-		me->twiRequest2.address = DS1307_ADDRMASK | 0b1;
-		me->twiRequest2.bytes = me->twiBuffer2;
-		me->twiRequest2.nbytes = 3;
-		me->twiRequest2.count = 0;
-
-		me->twiRequestAddresses[0] = &(me->twiRequest1);
-		me->twiRequestAddresses[1] = &(me->twiRequest2);
+		me->resyncCounter --;
+		if (me->resyncCounter) {
+			return Q_HANDLED();
+		}
+		me->resyncCounter = WORDCLOCK_RESYNC_SECONDS;
+		if (! me->rtcReading) {
+			start_rtc_read(me);
+		}
+		return Q_HANDLED();
 
-		fff(&twi);
-		QActive_post((QActive*)(&twi), TWI_REQUEST_SIGNAL,
-			     (QParam)(&me->twiRequestAddresses));
-		QActive_arm((QActive*)me, 30);
+	case RTC_READ_SIGNAL:
+		/* Coalesce with a read already in flight, whether it was
+		   started by the resync or by another GET FRESH. */
+		me->snapshotWanted = 1;
+		if (! me->rtcReading) {
+			start_rtc_read(me);
+		}
 		return Q_HANDLED();
 
 	case TWI_REPLY_1_SIGNAL:
-		if (tracing()) {
+		if (TRACING(TRACE)) {
 			ST("WC Got TWI_REPLY_1_SIGNAL in running: status=");
 			serial_trace_int(me->twiRequest1.status);
-			STD("\r\n");
+			ST("\r\n");
 		}
 		return Q_HANDLED();
 
 	case TWI_REPLY_2_SIGNAL:
-		if (tracing()) {
+		if (TRACING(TRACE)) {
 			ST("WC Got TWI_REPLY_2_SIGNAL in running: status=");
 			serial_trace_int(me->twiRequest2.status);
 			ST(" ");
@@ -293,125 +537,153 @@ static QState wordclockRunningState(struct Wordclock *me)
 					ST(" clock disabled");
 				} else {
 					ST(" time=");
-					print_time(me->twiBuffer2);
+					serial_trace_printf_P(PSTR("%T"), me->twiBuffer2);
 				}
 			}
-			STD("\r\n");
-			turn_on_outputs(me->twiBuffer2);
-
-		} else if (is_5min(me->twiBuffer2)) {
-			me->interval_5min = 0;
-			//S("time=");
-			//print_time(me->twiBuffer2);
-			//SD("\r\n");
-			turn_on_outputs(me->twiBuffer2);
+			ST("\r\n");
 		}
-		setTick1Scounter(me, near_5s_diff(me, me->twiRequest2.bytes));
+		if (! me->twiRequest2.status) {
+			check_drift(me, me->twiBuffer2);
+			me->time[0] = me->twiBuffer2[0] & 0x7f;
+			me->time[1] = me->twiBuffer2[1];
+			me->time[2] = me->twiBuffer2[2];
+			turn_on_outputs(me->time);
+			publish_snapshot(me);
+		}
+		rtc_read_done(me, me->twiRequest2.status);
 		return Q_HANDLED();
 
 	case SET_TIME_SIGNAL:
 		me->data = (uint8_t *) Q_PAR(me);
 		return Q_HANDLED();
 
+	case SYNC_SIGNAL:
+		if (me->rtcReading || me->data) {
+			/* The TWI requests and buffers are in use. */
+			sync_done(me, WORDCLOCK_SYNC_FAILED);
+			return Q_HANDLED();
+		}
+		sync_target(me, (const struct WordclockSync *) Q_PAR(me));
+		me->data = me->syncTime;
+		me->syncing = 1;
+		return Q_TRAN(wordclockSetClockState);
+
 	}
 	return Q_SUPER(wordclockState);
 }
 
 
-static void turn_on_outputs(uint8_t *bytes)
+/**
+ * The words for each five minute slot, without the hour.
+ */
+#define W(x) (x)
+#define SLOT_00 (W(OCLOCK))
+#define SLOT_05 (W(FIVE_MIN) | W(PAST))
+#define SLOT_10 (W(TEN_MIN)  | W(PAST))
+#define SLOT_15 (W(QUARTER)  | W(PAST))
+#define SLOT_20 (W(TWENTY)   | W(PAST))
+#define SLOT_25 (W(TWENTY)   | W(FIVE_MIN) | W(PAST))
+#define SLOT_30 (W(HALF)     | W(PAST))
+#define SLOT_35 (W(TWENTY)   | W(FIVE_MIN) | W(TO))
+#define SLOT_40 (W(TWENTY)   | W(TO))
+#define SLOT_45 (W(QUARTER)  | W(TO))
+#define SLOT_50 (W(TEN_MIN)  | W(TO))
+#define SLOT_55 (W(FIVE_MIN) | W(TO))
+
+/* Up to half past we show the current hour, and after that the next hour. */
+#define PAST_ROW(s) {							\
+		(s)|W(ONE),  (s)|W(TWO),    (s)|W(THREE),  (s)|W(FOUR),	\
+		(s)|W(FIVE), (s)|W(SIX),    (s)|W(SEVEN),  (s)|W(EIGHT), \
+		(s)|W(NINE), (s)|W(TEN),    (s)|W(ELEVEN), (s)|W(TWELVE), }
+#define TO_ROW(s) {							\
+		(s)|W(TWO),  (s)|W(THREE),  (s)|W(FOUR),   (s)|W(FIVE),	\
+		(s)|W(SIX),  (s)|W(SEVEN),  (s)|W(EIGHT),  (s)|W(NINE),	\
+		(s)|W(TEN),  (s)|W(ELEVEN), (s)|W(TWELVE), (s)|W(ONE), }
+
+/**
+ * The complete display for every time, indexed by five minute slot and by
+ * hour (1 to 12, less one).
+ */
+static const uint32_t time_words_table[12][12] PROGMEM = {
+	PAST_ROW(SLOT_00),
+	PAST_ROW(SLOT_05),
+	PAST_ROW(SLOT_10),
+	PAST_ROW(SLOT_15),
+	PAST_ROW(SLOT_20),
+	PAST_ROW(SLOT_25),
+	PAST_ROW(SLOT_30),
+	TO_ROW(SLOT_35),
+	TO_ROW(SLOT_40),
+	TO_ROW(SLOT_45),
+	TO_ROW(SLOT_50),
+	TO_ROW(SLOT_55),
+};
+
+#undef PAST_ROW
+#undef TO_ROW
+#undef W
+
+
+/**
+ * Find the words that show a time.
+ *
+ * @param bytes pointer to the seconds, minutes and hours registers from the
+ * DS1307, which must be in 12 hour mode.
+ *
+ * @return a mask of word bits, see outputs.h
+ */
+static uint32_t time_words(uint8_t *bytes)
 {
-	uint8_t seconds;
 	uint8_t minutes;
 	uint8_t hours;
+	uint8_t slot;
 
-	outputs_off();
-	seconds = bytes[0];
 	minutes = bytes[1];
 	hours = bytes[2];
 	Q_ASSERT( (hours & 0x40) ); /* Ensure we are in 12 hour mode */
 	Q_ASSERT( (hours & 0x0f) <= 9 );
 	Q_ASSERT( (minutes & 0x70) <= 0x50 );
 	Q_ASSERT( (minutes & 0x0f) <= 9 );
-	minutes -= ((minutes & 0x0f) % 5);
-	/* Convert the hours data to a plain number of hours. */
+	/* Two slots for each tens digit, and the second one from :x5. */
+	slot = ((minutes & 0x70) >> 3) + ((minutes & 0x0f) >= 5);
+	/* Convert the BCD hours to a plain number of hours, 1 to 12. */
 	hours &= 0x1f;
 	if (hours & 0x10) {
 		hours = (hours & 0x0f) + 10;
 	}
-	if (0 == minutes) {
-		output_on(hours); S(" ");
-		output_on(OCLOCK); S("\r\n");
-	} else if (0x05 == minutes) {
-		output_on(FIVE_MIN); S(" ");
-		output_on(PAST); S(" ");
-		output_on(hours); S("\r\n");
-	} else if (0x10 == minutes) {
-		output_on(TEN_MIN); S(" ");
-		output_on(PAST); S(" ");
-		output_on(hours); S("\r\n");
-	} else if (0x15 == minutes) {
-		output_on(QUARTER); S(" ");
-		output_on(PAST); S(" ");
-		output_on(hours); S("\r\n");
-	} else if (0x20 == minutes) {
-		output_on(TWENTY); S(" ");
-		output_on(PAST); S(" ");
-		output_on(hours); S("\r\n");
-	} else if (0x25 == minutes) {
-		output_on(TWENTY); S(" ");
-		output_on(FIVE_MIN); S(" ");
-		output_on(PAST); S(" ");
-		output_on(hours); S("\r\n");
-	} else if (0x30 == minutes) {
-		output_on(HALF); S(" ");
-		output_on(PAST); S(" ");
-		output_on(hours); S("\r\n");
-	} else {
-		/* It's after half past, so we now display something to the
-		   next hour. */
-		hours ++;
-		if (13 == hours) {
-			hours = 1;
-		}
-		if (0x35 == minutes) {
-			output_on(TWENTY); S(" ");
-			output_on(FIVE_MIN); S(" ");
-			output_on(TO); S(" ");
-			output_on(hours); S("\r\n");
-		} else if (0x40 == minutes) {
-			output_on(TWENTY); S(" ");
-			output_on(TO); S(" ");
-			output_on(hours); S("\r\n");
-		} else if (0x45 == minutes) {
-			output_on(QUARTER); S(" ");
-			output_on(TO); S(" ");
-			output_on(hours); S("\r\n");
-		} else if (0x50 == minutes) {
-			output_on(TEN_MIN); S(" ");
-			output_on(TO); S(" ");
-			output_on(hours); S("\r\n");
-		} else if (0x55 == minutes) {
-			output_on(FIVE_MIN); S(" ");
-			output_on(TO); S(" ");
-			output_on(hours); S("\r\n");
-		} else {
-			S("No outputs selected hex bytes = ");
-			serial_send_hex_int(bytes[0]);
-			S(":");
-			serial_send_hex_int(bytes[1]);
-			S(":");
-			serial_send_hex_int(bytes[2]);
-			S(" s=");
-			serial_send_hex_int(seconds);
-			S(" m=");
-			serial_send_hex_int(minutes);
-			S(" h=");
-			serial_send_hex_int(hours);
-			SD("\r\n");
-		}
+	Q_ASSERT( hours >= 1 && hours <= 12 );
+	return pgm_read_dword(&time_words_table[slot][hours - 1]);
+}
+
+
+static void turn_on_outputs(uint8_t *bytes)
+{
+	outputs_set(time_words(bytes));
+}
+
+/**
+ * Convert a DS1307 hours register from 24 hour mode to 12 hour mode.
+ */
+static uint8_t hours_24_to_12(uint8_t hours)
+{
+	uint8_t h;
+	uint8_t pm = 0;
+
+	h = (hours & 0x0f) + ((hours & 0x30) >> 4) * 10;
+	if (h >= 12) {
+		pm = DS1307_PM;
+		h -= 12;
 	}
+	if (0 == h) {
+		h = 12;
+	}
+	if (h >= 10) {
+		h = 0x10 | (h - 10);
+	}
+	return DS1307_12HOUR | pm | h;
 }
 
+
 /**
  * Tell us if we are on an hour boundary.
  */
@@ -424,99 +696,212 @@ static uint8_t is_5min(uint8_t *bytes)
 
 
 /**
- * Tell us which way we are from a five second boundary.
+ * Start a read of the time from the DS1307.
+ *
+ * This is two consecutive TWI operations: write the register address, then
+ * read the seconds, minutes and hours.
+ */
+static void start_rtc_read(struct Wordclock *me)
+{
+	me->twiRequest1.qactive = (QActive*)me;
+	me->twiRequest1.signal = TWI_REPLY_1_SIGNAL;
+	me->twiRequest1.address = DS1307_ADDRMASK | 0b0;
+	me->twiRequest1.bytes = me->twiBuffer1;
+	me->twiBuffer1[0] = 0;
+	me->twiRequest1.nbytes = 1;
+	me->twiRequest2.count = 0;
+
+	me->twiRequest2.qactive = (QActive*)me;
+	me->twiRequest2.signal = TWI_REPLY_2_SIGNAL;
+	me->twiRequest2.address = DS1307_ADDRMASK | 0b1;
+	me->twiRequest2.bytes = me->twiBuffer2;
+	me->twiRequest2.nbytes = 3;
+	me->twiRequest2.count = 0;
+
+	me->twiRequestAddresses[0] = &(me->twiRequest1);
+	me->twiRequestAddresses[1] = &(me->twiRequest2);
+	me->twiRequestAddresses[2] = 0;
+
+	fff(&twi);
+	QActive_post((QActive*)(&twi), TWI_REQUEST_SIGNAL,
+		     (QParam)(me->twiRequestAddresses));
+	QActive_arm((QActive*)me, 30);
+	me->rtcReading = 1;
+}
+
+
+/**
+ * A read of the time has finished, well or badly.  Tell the commander if it
+ * was waiting for one.
+ *
+ * @param status the TWI status, zero if the read worked
+ */
+static void rtc_read_done(struct Wordclock *me, uint8_t status)
+{
+	me->rtcReading = 0;
+	if (me->snapshotWanted) {
+		me->snapshotWanted = 0;
+		fff(&commander);
+		QActive_post((QActive*)(&commander), SNAPSHOT_SIGNAL,
+			     (QParam)status);
+	}
+}
+
+
+/**
+ * Work out when to write the RTC for SYNC, and what time to write.
  *
- * @param bytes pointer to a byte read from the first DS1307.
+ * That is the start of the host's next second after the line arrived, or the
+ * one after if that is too close to make (WORDCLOCK_SYNC_MARGIN).
+ */
+static void sync_target(struct Wordclock *me,
+			const struct WordclockSync *sync)
+{
+	uint16_t at;
+
+	at = sync->arrival + (uint16_t)
+		(((uint32_t)(10000 - sync->frac) * BSP_STAMP_HZ) / 10000);
+	me->syncTime[0] = sync->time[0];
+	me->syncTime[1] = sync->time[1];
+	me->syncTime[2] = sync->time[2];
+	time_tick(me->syncTime);
+	while ((int16_t)(at - BSP_stamp()) < (int16_t)WORDCLOCK_SYNC_MARGIN) {
+		at += BSP_STAMP_HZ;
+		time_tick(me->syncTime);
+	}
+	me->syncAt = at;
+}
+
+
+/**
+ * Tell the commander how SYNC went.
  *
- * @return 0 if the time is on a five second boundary; -1 or -2 if it's before
- * a five second boundary; +1 or +2 if it's after a five second boundary.
+ * @param result how late the write was, in units of 0.1ms, or
+ * WORDCLOCK_SYNC_FAILED
  */
-static int8_t near_5s_diff(struct Wordclock *me, uint8_t *bytes)
+static void sync_done(struct Wordclock *me, uint16_t result)
 {
-	uint8_t sec;
-	int8_t diff = 99;
+	if (WORDCLOCK_SYNC_FAILED != result) {
+		result = BSP_STAMP_TO_100US(result);
+	}
+	fff(&commander);
+	QActive_post((QActive*)(&commander), SYNCED_SIGNAL, (QParam)result);
+}
+
+
+/**
+ * Publish Wordclock.time as the snapshot that GET answers from.
+ */
+static void publish_snapshot(struct Wordclock *me)
+{
+	me->snapshot.regs[0] = me->time[0];
+	me->snapshot.regs[1] = me->time[1];
+	me->snapshot.regs[2] = me->time[2];
+	me->snapshot.age = 0;
+	me->snapshot.seq ++;
+}
+
 
-	sec = (*bytes) & 0x0f;
-	if (sec >= 10) {
-		sec -= 10;
+/**
+ * Add one to a BCD byte.
+ */
+static uint8_t bcd_inc(uint8_t bcd)
+{
+	bcd ++;
+	if ((bcd & 0x0f) == 0x0a) {
+		bcd += 0x06;
 	}
-	if (sec >= 5) {
-		sec -= 5;
+	return bcd;
+}
+
+
+/**
+ * Advance a time by one second.
+ *
+ * @param time seconds, minutes and hours in DS1307 format, 12 hour mode.
+ */
+static void time_tick(uint8_t *time)
+{
+	uint8_t hours;
+	uint8_t pm;
+
+	time[0] = bcd_inc(time[0]);
+	if (time[0] < 0x60) {
+		return;
 	}
-	switch (sec) {
-	case 4: diff = -1; break;
-	case 3: diff = -2; break;
-	case 2: diff =  2; break;
-	case 1: diff =  1; break;
-	case 0: diff =  0; break;
+	time[0] = 0;
+	time[1] = bcd_inc(time[1]);
+	if (time[1] < 0x60) {
+		return;
 	}
-	if (diff) {
-		S("-- diff = ");
-		serial_send_int(diff);
-		S(" at ");
-		print_time(bytes);
-		S(" interval = ");
-		serial_send_int(me->interval_5min);
-		S("\r\n");
+	time[1] = 0;
+	hours = bcd_inc(time[2] & 0x1f);
+	pm = time[2] & 0x20;
+	if (0x12 == hours) {
+		pm ^= 0x20;
+	} else if (0x13 == hours) {
+		hours = 0x01;
 	}
-	return diff;
+	time[2] = 0x40 | pm | hours;
 }
 
 
-static void setTick1Scounter(struct Wordclock *me, int8_t diff)
+/**
+ * Send the time as a telemetry record.  This does nothing unless the serial
+ * port is in framed mode.
+ */
+static void send_time_telemetry(struct Wordclock *me)
 {
-	Q_ASSERT( diff < 3 );
-	Q_ASSERT( diff > -3 );
-	me->tick1Scounter = 5 - diff;
+	uint8_t record[4];
+
+	record[0] = WORDCLOCK_TELEMETRY_TIME;
+	record[1] = me->time[0];
+	record[2] = me->time[1];
+	record[3] = me->time[2];
+	serial_send_telemetry(record, sizeof(record));
 }
 
 
 /**
- * Print a time represented by raw DS1307 data.
- *
- * We print the time without reference to the tracing state.  It's up to the
- * caller to check that first, if required.
- *
- * @param bytes pointer to at least the first three bytes of DS1307 register
- * data, in the order read from the device.
+ * Convert a time to seconds since twelve o'clock.
  */
-static void print_time(uint8_t *bytes)
+static uint16_t time_seconds(uint8_t *time)
 {
-	uint8_t hoursbyte;
-	uint8_t minutesbyte;
-	uint8_t secondsbyte;
 	uint8_t hours;
 	uint8_t minutes;
 	uint8_t seconds;
 
-	secondsbyte = bytes[0];
-	minutesbyte = bytes[1];
-	hoursbyte = bytes[2];
+	hours = time[2] & 0x1f;
+	hours = (hours & 0x0f) + ((hours & 0x10) ? 10 : 0);
+	if (12 == hours) {
+		hours = 0;
+	}
+	minutes = (time[1] & 0x0f) + ((time[1] & 0x70) >> 4) * 10;
+	seconds = (time[0] & 0x0f) + ((time[0] & 0x70) >> 4) * 10;
+	return (uint16_t)hours * 3600 + minutes * 60 + seconds;
+}
+
 
-	if (hoursbyte & 0x40) {
-		/* 12 hour mode */
-		hours = (hoursbyte & 0x0f) + ((hoursbyte & 0x10) >> 4) * 10;
-	} else {
-		hours = (hoursbyte & 0x0f) + ((hoursbyte & 0x30) >> 4)* 10;
+/**
+ * Compare the time we have been keeping with the time from the DS1307, and
+ * report any difference.
+ *
+ * @param bytes pointer to the seconds, minutes and hours read from the
+ * DS1307.
+ */
+static void check_drift(struct Wordclock *me, uint8_t *bytes)
+{
+	int16_t diff;
+
+	diff = time_seconds(bytes) - time_seconds(me->time);
+	/* Twelve hours is 43200 seconds, so take the shortest way around. */
+	if (diff > 21600) {
+		diff -= 43200;
+	} else if (diff < -21600) {
+		diff += 43200;
 	}
-	minutes = (minutesbyte & 0x0f) + ((minutesbyte & 0x70) >> 4) * 10;
-	seconds = (secondsbyte & 0x0f) + ((secondsbyte & 0x70) >> 4) * 10;
-
-	serial_send_int(hours);
-	S(":");
-	if (minutes <= 9)
-		S("0");
-	serial_send_int(minutes);
-	S(":");
-	if (seconds <= 9)
-		S("0");
-	serial_send_int(seconds);
-	if (hoursbyte & 0x40) {
-		if (hoursbyte & 0x20)
-			S(" PM");
-		else
-			S(" AM");
-	} else {
-		S(" (24)");
+	if (diff) {
+		SF("-- drift = %d at %T interval = %u\r\n",
+		   diff, bytes, me->interval_5min);
 	}
 }
@@ -9,28 +9,138 @@
 #define FOREVER for(;;)
 
 
+/**
+ * How often we read the time from the DS1307, in seconds.
+ *
+ * In between, we keep the time ourselves by counting the square wave edges
+ * from the DS1307.  Each read compares the two and reports any drift.
+ */
+#ifndef WORDCLOCK_RESYNC_SECONDS
+#define WORDCLOCK_RESYNC_SECONDS 3600
+#endif
+
+
+/**
+ * Telemetry record type for the time of day, sent each second in framed mode.
+ * The record is this byte, then the seconds, minutes and hours registers as
+ * in Wordclock.time.
+ */
+#define WORDCLOCK_TELEMETRY_TIME 'T'
+
+
+/**
+ * The time as last published by the wordclock, for queries that must not
+ * wait for the TWI.
+ *
+ * It is published after each read of the DS1307, and at each square wave
+ * edge, which is when the DS1307 registers change.  Readers are other active
+ * objects, which run to completion, so they always see a whole snapshot.
+ */
+struct TimeSnapshot {
+	/** The DS1307 seconds, minutes and hours registers. */
+	uint8_t regs[3];
+	/** Ticks since it was published, stopping at 0xffff. */
+	uint16_t age;
+	/** Counts each publication, so a reader can tell a new one. */
+	uint16_t seq;
+};
+
+
+/**
+ * A time from the host, for SYNC.
+ *
+ * The wordclock writes the RTC at the start of the host's next second after
+ * the line arrived, from the timer interrupt, so the DS1307 (which restarts
+ * its second when the seconds register is written) then ticks with the host.
+ */
+struct WordclockSync {
+	/** The host's time when the line arrived, as the DS1307 seconds,
+	    minutes and hours registers (12 hour mode). */
+	uint8_t time[3];
+	/** How far into that second the line arrived, in units of 0.1ms. */
+	uint16_t frac;
+	/** BSP_stamp() when the line arrived. */
+	uint16_t arrival;
+};
+
+/** SYNCED_SIGNAL parameter when the RTC was not written. */
+#define WORDCLOCK_SYNC_FAILED 0xffff
+
+/**
+ * Write the RTC no sooner than this after SYNC is handled, in BSP_stamp()
+ * counts, to leave time for the TWI to be free.  Otherwise the write waits
+ * for the host's following second.
+ */
+#ifndef WORDCLOCK_SYNC_MARGIN
+#define WORDCLOCK_SYNC_MARGIN (BSP_STAMP_HZ / 100)
+#endif
+
+
 /**
  * Create the word clock.
  */
 void wordclock_ctor(void);
 
+/**
+ * Read the RTC and show the time, at the start of main().
+ */
+uint8_t wordclock_boot(void);
+
+/**
+ * Restore the saved state after a watchdog reset, at the start of main().
+ */
+uint8_t wordclock_warm(void);
+
+/**
+ * Make the next watchdog reset a cold one.
+ */
+void wordclock_cold_reset(void);
+
 
 /**
  */
 struct Wordclock {
 	QActiveNamed super;
 	uint8_t tick20counter;
-	uint8_t tick1Scounter;
+	/** Seconds until we next read the time from the DS1307. */
+	uint16_t resyncCounter;
 	uint16_t interval_5min;
+	/** The time of day, as the DS1307 seconds, minutes and hours
+	    registers (12 hour mode).  This is advanced by each square wave
+	    edge. */
+	uint8_t time[3];
+	/** The time for GET.  See struct TimeSnapshot. */
+	struct TimeSnapshot snapshot;
+	/** Set while a read of the time from the DS1307 is in flight. */
+	uint8_t rtcReading;
+	/** Set by RTC_READ_SIGNAL, to send SNAPSHOT_SIGNAL to the commander
+	    when the next read finishes. */
+	uint8_t snapshotWanted;
+	/** Set while setting the clock for SYNC. */
+	uint8_t syncing;
+	/** The BSP_stamp() at which to write the RTC for SYNC. */
+	uint16_t syncAt;
+	/** The time to write for SYNC. */
+	uint8_t syncTime[3];
+	/** The DS1307 registers read at boot, or to be written if rtcInit is
+	    set. */
+	uint8_t rtcRegs[8];
+	/** Set if the DS1307 needs to be written before we start running. */
+	uint8_t rtcInit;
+	/** Set if we have restarted from the state saved before a watchdog
+	    reset. */
+	uint8_t warmStart;
+	/** Set by wordclock_cold_reset(), to stop saving the warm state. */
+	uint8_t coldReset;
 	uint8_t *data;
 	struct TWIRequest twiRequest1;
 	struct TWIRequest twiRequest2;
-	/** This contains the addresses of one or both of the TWIRequests
-	    above.  When we do consecutive TWI operations (which means keeping
-	    control of the bus between the operations and only receiving a
-	    result after both have finished) we fill in both pointers.  For a
-	    single operation, only fill in the first pointer. */
-	struct TWIRequest *twiRequestAddresses[2];
+	/** The TWI request chain: the addresses of one or both of the
+	    TWIRequests above, then a null pointer.  When we do consecutive TWI
+	    operations (which means keeping control of the bus between the
+	    operations) we fill in both pointers.  For a single operation, only
+	    fill in the first pointer. */
+	struct TWIRequest *twiRequestAddresses[3];
 	/** Buffer for data to or from a TWI device.  This is only a single
 	    byte since it will only be used for sending the register address to
 	    the DS1307. */
@@ -52,6 +162,10 @@ extern struct Wordclock wordclock;
  * QP-nano will always appear at the same line in the same file, so we won't
  * know which state machine's queue is full.  If this check is done in user
  * code instead of library code we can tell them apart.
+ *
+ * The state machine's name is added to the assert message.  It isn't sent
+ * with SF(), since this is mostly called from interrupt handlers, which must
+ * not add to the send buffers (see send_block()).
  */
 #define fff(o)								\
 	do {								\
@@ -59,13 +173,7 @@ extern struct Wordclock wordclock;
 		QActiveNamed *_men = (QActiveNamed *)(o);		\
 		QActiveCB const Q_ROM *_ao = &QF_active[_me->prio];	\
 		if(_me->nUsed >= Q_ROM_BYTE(_ao->end)) {		\
-			S("\r\nfff( _me=");				\
-			serial_send_hex_int((unsigned int)_me);		\
-			S(",  name=");					\
-			serial_send_hex_int((unsigned int)(_men->name)); \
-			S(", ");					\
-			serial_send_rom(_men->name);			\
-			SD(")\r\n");					\
+			serial_assert_name = _men->name;		\
 		}							\
 		Q_ASSERT(_me->nUsed < Q_ROM_BYTE(_ao->end));		\
 	} while (0)